@@ -0,0 +1,258 @@
+/* archive.c: compressed archive of spectra.
+
+   For long recordings, the -F archive format stores the same pixel values
+   as the binary format in a fraction of the space. Consecutive spectra
+   differ mostly by noise, so each pixel is stored as the difference to the
+   same pixel of the previous spectrum. The differences are zigzag coded
+   (0, -1, 1, -2, ... become 0, 1, 2, 3, ...) and packed in blocks of 32
+   pixels with just enough bits for the largest one. The arithmetic is
+   modulo 65536, so every uint16_t value survives unchanged.
+
+   Spectra are collected in chunks of ARCHIVE_CHUNK_FRAMES, or of at most
+   ARCHIVE_CHUNK_TIME if they come slowly, so a killed run loses at most
+   that much. Every chunk starts from scratch and carries an index of the
+   timestamps and positions of its frames, so a reader can find a time
+   range by skipping from chunk header to chunk header, and decode chunks
+   independently. The layout is described in archive.h.
+
+   The gain depends on the noise: with a few counts of noise per pixel, a
+   difference takes 4 to 6 bits instead of 16. Decoding is a few
+   instructions per pixel and much faster than reading the binary format
+   from disk.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "archive.h"
+
+#define BLOCK 32 /* pixels per block */
+
+/* room in the chunk buffer before the coded frames */
+#define ARCHIVE_HEAD (sizeof(struct archive_chunk_header) + \
+                      ARCHIVE_CHUNK_FRAMES*sizeof(struct archive_frame_index))
+
+int archive_init(struct archive_writer *w, int device) {
+    w->device = device;
+    w->frames = 0;
+    w->bytes = 0;
+    if (!w->buffer)
+        w->buffer = malloc(ARCHIVE_HEAD + ARCHIVE_CHUNK_FRAMES*ARCHIVE_MAX_FRAME);
+    return w->buffer ? 0 : -1;
+}
+
+int write_archive_header(int fd, int deviceID, char *serial,
+                         double *lam_coeff, int integrationtime,
+                         int device, int devices) {
+    struct spectrum_file_header h;
+
+    fill_binary_header(&h, deviceID, serial, lam_coeff, integrationtime,
+                       device, devices);
+    memcpy(h.magic, ARCHIVE_FILE_MAGIC, sizeof(h.magic));
+    h.recordsize = 0;
+    return write_all(fd, (char *)&h, sizeof(h));
+}
+
+static inline uint16_t zigzag(uint16_t d) {
+    return (d << 1) ^ -(d >> 15);
+}
+
+static inline uint16_t unzigzag(uint16_t z) {
+    return (z >> 1) ^ -(z & 1);
+}
+
+/* bit fields are read and written as little endian 64 bit words; a field
+   of up to 16 bits at any bit position fits into the word at its byte */
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static inline void store64(unsigned char *p, uint64_t v) {
+    v = htole64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+/* codes values against reference into out; returns the number of bytes */
+static int encode_frame(uint16_t *values, uint16_t *reference,
+                        unsigned char *out) {
+    unsigned char packed[4*16+8];
+    uint16_t z[BLOCK];
+    unsigned int all;
+    int b, i, w, pos;
+    unsigned char *p = out;
+
+    for (b=0; b<SPECTRUM_PIXELS; b+=BLOCK) {
+        all = 0;
+        for (i=0; i<BLOCK; i++) {
+            z[i] = zigzag(values[b+i]-reference[b+i]);
+            all |= z[i];
+        }
+        w = all ? 32-__builtin_clz(all) : 0;
+        *p++ = w;
+        if (!w) continue;
+        memset(packed, 0, sizeof(packed));
+        for (i=0, pos=0; i<BLOCK; i++, pos+=w)
+            store64(packed+(pos>>3),
+                    load64(packed+(pos>>3)) | (uint64_t)z[i] << (pos&7));
+        memcpy(p, packed, 4*w);
+        p += 4*w;
+    }
+    return p-out;
+}
+
+/* decodes a frame coded against reference into values; returns the
+   position after it, or NULL if a block is damaged or reaches beyond end */
+static const unsigned char *decode_frame(const unsigned char *p,
+                                         const unsigned char *end,
+                                         const uint16_t *reference,
+                                         uint16_t *values) {
+    unsigned char packed[4*16+8];
+    int b, i, w, pos;
+    uint64_t mask;
+
+    for (b=0; b<SPECTRUM_PIXELS; b+=BLOCK) {
+        if (p >= end) return NULL;
+        w = *p++;
+        if (w > 16 || end-p < 4*w) return NULL;
+        if (!w) {
+            memcpy(values+b, reference+b, BLOCK*sizeof(uint16_t));
+            continue;
+        }
+        /* the copy makes the 64 bit loads safe at the end of a file */
+        memcpy(packed, p, 4*w);
+        p += 4*w;
+        mask = (1u << w) - 1;
+        for (i=0, pos=0; i<BLOCK; i++, pos+=w)
+            values[b+i] = reference[b+i] +
+                unzigzag((load64(packed+(pos>>3)) >> (pos&7)) & mask);
+    }
+    return p;
+}
+
+int archive_add_frame(struct archive_writer *w, uint16_t *rawvalues,
+                      uint64_t timestamp, uint32_t sequence) {
+    struct archive_frame_index *index =
+        (struct archive_frame_index *)(w->buffer +
+                                       sizeof(struct archive_chunk_header));
+    struct archive_chunk_header *h = (struct archive_chunk_header *)w->buffer;
+
+    if (!w->frames) {
+        memset(w->previous, 0, sizeof(w->previous));
+        h->firsttime = timestamp;
+    }
+    index[w->frames].timestamp = timestamp;
+    index[w->frames].sequence = sequence;
+    index[w->frames].offset = w->bytes;
+    w->bytes += encode_frame(rawvalues, w->previous,
+                             w->buffer+ARCHIVE_HEAD+w->bytes);
+    memcpy(w->previous, rawvalues, sizeof(w->previous));
+    w->frames++;
+
+    return w->frames==ARCHIVE_CHUNK_FRAMES ||
+        timestamp-h->firsttime >= ARCHIVE_CHUNK_TIME;
+}
+
+int archive_flush(struct archive_writer *w, int fd) {
+    struct archive_frame_index *index =
+        (struct archive_frame_index *)(w->buffer +
+                                       sizeof(struct archive_chunk_header));
+    struct archive_chunk_header *h;
+    int i, frames = w->frames;
+    unsigned char *start;
+
+    if (!frames) return 0;
+    w->frames = 0;
+
+    /* header and index go right in front of the coded frames, so the chunk
+       goes out in one piece */
+    start = w->buffer + ARCHIVE_HEAD - sizeof(struct archive_chunk_header)
+        - frames*sizeof(struct archive_frame_index);
+    h = (struct archive_chunk_header *)w->buffer;
+    h->lasttime = index[frames-1].timestamp;
+    for (i=frames-1; i>=0; i--) {
+        index[i].timestamp = htole64(index[i].timestamp);
+        index[i].sequence = htole32(index[i].sequence);
+        index[i].offset = htole32(index[i].offset);
+    }
+    memmove(start+sizeof(*h), index, frames*sizeof(*index));
+    memcpy(h->magic, ARCHIVE_CHUNK_MAGIC, sizeof(h->magic));
+    h->device = htole16(w->device);
+    h->frames = htole16(frames);
+    h->bytes = htole32(w->bytes);
+    h->reserved = 0;
+    h->firsttime = htole64(h->firsttime);
+    h->lasttime = htole64(h->lasttime);
+    memmove(start, h, sizeof(*h));
+
+    i = write_all(fd, (char *)start, ARCHIVE_HEAD - (start-w->buffer)
+                  + w->bytes);
+    w->bytes = 0;
+    return i;
+}
+
+long archive_chunk_size(const unsigned char *p, size_t len) {
+    struct archive_chunk_header h;
+    long size;
+    int frames;
+    uint32_t bytes;
+
+    if (len < sizeof(h)) return -1;
+    memcpy(&h, p, sizeof(h));
+    if (memcmp(h.magic, ARCHIVE_CHUNK_MAGIC, sizeof(h.magic))) return -2;
+    frames = le16toh(h.frames);
+    bytes = le32toh(h.bytes);
+    if (!frames || frames > ARCHIVE_CHUNK_FRAMES ||
+        bytes > (uint32_t)frames*ARCHIVE_MAX_FRAME) return -2;
+    size = sizeof(h) + frames*sizeof(struct archive_frame_index) + bytes;
+    return (size_t)size <= len ? size : -1;
+}
+
+int archive_decode_chunk(const unsigned char *p, size_t len,
+                         uint16_t *values) {
+    static const uint16_t zero[SPECTRUM_PIXELS];
+    struct archive_chunk_header h;
+    struct archive_frame_index ix;
+    const uint16_t *reference = zero;
+    const unsigned char *coded, *q, *end;
+    long size;
+    int i;
+
+    size = archive_chunk_size(p, len);
+    if (size < 0) return -1;
+    memcpy(&h, p, sizeof(h));
+    h.frames = le16toh(h.frames);
+    coded = p + sizeof(h) + h.frames*sizeof(ix);
+    end = p + size;
+    for (i=0, q=coded; i<h.frames; i++) {
+        /* the index has to agree with the coded frames */
+        memcpy(&ix, p + sizeof(h) + i*sizeof(ix), sizeof(ix));
+        if (le32toh(ix.offset) != (uint32_t)(q-coded)) return -1;
+        q = decode_frame(q, end, reference, values);
+        if (!q) return -1;
+        reference = values;
+        values += SPECTRUM_PIXELS;
+    }
+    /* no bytes may be left over after the last frame */
+    return q == end ? h.frames : -1;
+}
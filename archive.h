@@ -0,0 +1,99 @@
+/* archive.h: compressed archive of spectra. Details see archive.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "decode.h"
+
+/* archive file: like the binary format (see output.h), it starts with one
+   struct spectrum_file_header per device, but with the magic
+   ARCHIVE_FILE_MAGIC and a recordsize of 0. Then follow chunks of up to
+   ARCHIVE_CHUNK_FRAMES spectra of one device. A chunk consists of
+     struct archive_chunk_header
+     struct archive_frame_index, one per frame
+     the coded frames, bytes in total
+   All numbers are little endian. The first frame of a chunk is coded
+   against zeros, every other against the previous frame, so a chunk can be
+   decoded without the ones before it. A coded frame consists of
+   SPECTRUM_PIXELS/32 blocks of 32 pixels; a block is one byte with the bit
+   width w (0..16), followed by 4*w bytes with the 32 zigzag coded pixel
+   differences of w bits each, lowest bits first. */
+#define ARCHIVE_FILE_MAGIC "USB2KARC"
+#define ARCHIVE_CHUNK_MAGIC "CHNK"
+#define ARCHIVE_CHUNK_FRAMES 64
+#define ARCHIVE_CHUNK_TIME 1000000000ULL /* ns; a chunk is closed after that */
+
+struct archive_chunk_header {
+    char magic[4];             /* ARCHIVE_CHUNK_MAGIC, not 0 terminated */
+    uint16_t device;           /* index of the device header */
+    uint16_t frames;           /* number of frames in this chunk */
+    uint32_t bytes;            /* size of the coded frames */
+    uint32_t reserved;
+    uint64_t firsttime;        /* timestamps of first and last frame */
+    uint64_t lasttime;
+};
+
+struct archive_frame_index {
+    uint64_t timestamp;        /* CLOCK_MONOTONIC in ns */
+    uint32_t sequence;         /* sequence number from the driver */
+    uint32_t offset;           /* of the coded frame, from the first one */
+};
+
+/* largest coded frame */
+#define ARCHIVE_MAX_FRAME (SPECTRUM_PIXELS/32*(1+4*16))
+
+/* collects the frames of one device until a chunk is complete */
+struct archive_writer {
+    int device;
+    int frames;                /* in the current chunk */
+    uint32_t bytes;            /* ...and their size */
+    uint16_t previous[SPECTRUM_PIXELS];
+    unsigned char *buffer;     /* room for a whole chunk */
+};
+
+/* prepares a writer for a device. Returns 0, or -1 if no memory could be
+   allocated. */
+int archive_init(struct archive_writer *w, int device);
+
+/* writes the file header of a device, like write_binary_header() */
+int write_archive_header(int fd, int deviceID, char *serial,
+                         double *lam_coeff, int integrationtime,
+                         int device, int devices);
+
+/* adds a frame to the current chunk. Returns 1 if the chunk is complete and
+   should be written with archive_flush(), 0 otherwise. */
+int archive_add_frame(struct archive_writer *w, uint16_t *rawvalues,
+                      uint64_t timestamp, uint32_t sequence);
+
+/* writes the current chunk, if there is one, and starts a new one. Returns
+   0 or -1 on error. */
+int archive_flush(struct archive_writer *w, int fd);
+
+/* size of the chunk at p including header and index, -1 if there is no
+   complete chunk in the len bytes at p, or -2 if the chunk header is
+   damaged: wrong magic, no frames or more than ARCHIVE_CHUNK_FRAMES, or
+   more coded bytes than that many frames can take */
+long archive_chunk_size(const unsigned char *p, size_t len);
+
+/* decodes all frames of the chunk in the len bytes at p into values, which
+   must have room for ARCHIVE_CHUNK_FRAMES*SPECTRUM_PIXELS pixels. Returns
+   the number of frames, or -1 if the chunk is incomplete or damaged. */
+int archive_decode_chunk(const unsigned char *p, size_t len,
+                         uint16_t *values);
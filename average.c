@@ -0,0 +1,115 @@
+/* average.c: averaging and smoothing of spectra.
+
+   At short integration times, a single spectrum is noisy, and writing out
+   every one of them costs more than the device is worth. These stages work
+   on the decoded pixel values as they come in, one after the other:
+
+     co-adding      the sum of N spectra, written out as their mean once
+                    every N spectra
+     exponential    a running average in which each new spectrum has the
+     average        weight 2**-k, written out for every spectrum
+     smoothing      a boxcar or quadratic Savitzky-Golay kernel across
+                    neighbouring pixels; the pixels closer to the ends than
+                    half the window stay as they are
+
+   Sums and the running average are kept in integers, the running average
+   with 16 bits of fraction, so nothing drifts however long it runs. The
+   result goes on as pixel values, rounded to whole counts. All loops run
+   over the pixels with no dependency between them, so the compiler turns
+   them into SIMD code.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <string.h>
+
+#include "average.h"
+
+int prepare_averaging(struct averaging *a, int coadd, int emashift,
+                      int smoothing, int window) {
+    int j, m, sum;
+
+    memset(a, 0, sizeof(*a));
+    if (coadd < 1 || coadd > MAX_COADD) return -1;
+    if (emashift < 0 || emashift > MAX_EMA_SHIFT) return -1;
+    a->coadd = coadd;
+    a->emashift = emashift;
+    if (smoothing==SMOOTH_NONE) return 0;
+
+    if (window < 3 || window > MAX_SMOOTHING || !(window & 1)) return -1;
+    m = a->halfwidth = window/2;
+    for (j=-m, sum=0; j<=m; j++) {
+        /* quadratic Savitzky-Golay: 3m^2+3m-1-5j^2, e.g. -3 12 17 12 -3 */
+        a->coefficient[j+m] = smoothing==SMOOTH_BOXCAR ? 1 :
+            3*m*m + 3*m - 1 - 5*j*j;
+        sum += a->coefficient[j+m];
+    }
+    a->norm = 1.0f/sum;
+    return 0;
+}
+
+static void smooth(struct averaging *a, uint16_t *values) {
+    int32_t acc[SPECTRUM_PIXELS];
+    int i, j, m = a->halfwidth;
+    float v;
+
+    memset(acc, 0, sizeof(acc));
+    for (j=-m; j<=m; j++)
+        for (i=m; i<SPECTRUM_PIXELS-m; i++)
+            acc[i] += a->coefficient[j+m] * values[i+j];
+    for (i=m; i<SPECTRUM_PIXELS-m; i++) {
+        v = acc[i]*a->norm + 0.5f;
+        v = v < 0.0f ? 0.0f : v > 65535.0f ? 65535.0f : v;
+        values[i] = (uint16_t)v;
+    }
+}
+
+int average_spectrum(struct averaging *a, uint16_t *values) {
+    int i, k = a->emashift;
+
+    if (a->coadd > 1) {
+        for (i=0; i<SPECTRUM_PIXELS; i++) a->sum[i] += values[i];
+        if (++a->count < a->coadd) return 0;
+        for (i=0; i<SPECTRUM_PIXELS; i++) {
+            values[i] = (a->sum[i] + a->coadd/2) / a->coadd;
+            a->sum[i] = 0;
+        }
+        a->count = 0;
+    }
+
+    if (k) {
+        if (!a->emastarted) {
+            for (i=0; i<SPECTRUM_PIXELS; i++) a->ema[i] = values[i] << 16;
+            a->emastarted = 1;
+        }
+        /* ema += (value-ema)/2**k, without going negative */
+        for (i=0; i<SPECTRUM_PIXELS; i++) {
+            a->ema[i] += ((uint32_t)values[i] << (16-k)) - (a->ema[i] >> k);
+            values[i] = (a->ema[i] + 0x8000) >> 16;
+        }
+    }
+
+    if (a->halfwidth) smooth(a, values);
+    return 1;
+}
+
+void restart_averaging(struct averaging *a) {
+    memset(a->sum, 0, sizeof(a->sum));
+    a->count = 0;
+    a->emastarted = 0;
+}
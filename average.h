@@ -0,0 +1,59 @@
+/* average.h: averaging and smoothing of spectra. Details see average.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+#define MAX_COADD 65536     /* spectra in one sum */
+#define MAX_EMA_SHIFT 8     /* time constant of at most 256 spectra */
+#define MAX_SMOOTHING 41    /* widest smoothing window; keeps the sums
+                               of the kernel within 31 bits */
+
+/* smoothing kernels */
+#define SMOOTH_NONE 0
+#define SMOOTH_BOXCAR 1
+#define SMOOTH_SAVGOL 2     /* quadratic Savitzky-Golay */
+
+/* averaging stages of one device */
+struct averaging {
+    int coadd;                          /* spectra per output, 1: none */
+    int count;                          /* ...in the current sum */
+    uint32_t sum[SPECTRUM_PIXELS];
+    int emashift;                       /* weight 2**-emashift, 0: none */
+    int emastarted;
+    uint32_t ema[SPECTRUM_PIXELS];      /* fixed point, 16 bit fraction */
+    int halfwidth;                      /* of the smoothing window, 0: none */
+    int32_t coefficient[MAX_SMOOTHING];
+    float norm;                         /* 1/sum of the coefficients */
+};
+
+/* sets up the stages: sums of coadd spectra, an exponential average with a
+   time constant of 2**emashift spectra, and smoothing with a kernel of
+   window pixels. Returns 0, or -1 if a parameter is out of range. */
+int prepare_averaging(struct averaging *a, int coadd, int emashift,
+                      int smoothing, int window);
+
+/* passes a spectrum through the stages. Returns 1 if values now holds a
+   spectrum to write out, or 0 if more spectra are needed for that. */
+int average_spectrum(struct averaging *a, uint16_t *values);
+
+/* forgets the current sum and the running average, e.g. when the
+   integration time has changed */
+void restart_averaging(struct averaging *a);
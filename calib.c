@@ -0,0 +1,153 @@
+/* calib.c: wavelength calibration of the spectrometers.
+
+   The wavelength coefficients are stored in the EEPROM of the device and
+   need four QueryInformation round-trips to read. Since they don't change,
+   they are kept in a small text file per device in the directory
+   $HOME/.spectroread, named after device ID and serial number. The file
+   contains serial number, device ID and the four coefficients, one per line.
+
+   The wavelength of pixel i is lam = sum_k c_k i**k. This gets evaluated
+   once into a table which all users of the wavelength axis share.
+
+   Dark and reference frames are kept in the same directory, in files named
+   after their kind, device ID, serial number and integration time, since
+   they are only valid for that. Such a file holds serial number, device ID,
+   integration time and the mean value of every pixel, one per line.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "calib.h"
+
+#define CACHE_DIRECTORY ".spectroread"
+#define CACHE_NAMLEN 200
+
+/* generates the name of the cache directory and of the file of a kind of
+   data; returns -1 if there is no home directory */
+static int cache_filename(char *kind, char *serial, int deviceID, char *dir,
+                          char *file) {
+    char *home = getenv("HOME");
+    char cleanserial[20];
+    int i;
+
+    if (!home || !home[0]) return -1;
+    /* keep the serial number from doing funny things in the file system */
+    for (i=0; serial[i] && i<(int)sizeof(cleanserial)-1; i++)
+        cleanserial[i] = isalnum((unsigned char)serial[i]) ? serial[i] : '_';
+    cleanserial[i] = 0;
+    if (!i) return -1; /* no serial, no cache */
+
+    snprintf(dir, CACHE_NAMLEN, "%s/%s", home, CACHE_DIRECTORY);
+    snprintf(file, CACHE_NAMLEN, "%s/%s-%04x-%s", dir, kind, deviceID,
+             cleanserial);
+    return 0;
+}
+
+int load_calibration(char *serial, int deviceID, double *lam_coeff) {
+    char dir[CACHE_NAMLEN], file[CACHE_NAMLEN];
+    char storedserial[20];
+    int storedID;
+    FILE *f;
+    int n;
+
+    if (cache_filename("calib", serial, deviceID, dir, file)) return -1;
+    f = fopen(file, "r");
+    if (!f) return -1;
+    n = fscanf(f, "%19s %x %lf %lf %lf %lf", storedserial, &storedID,
+               &lam_coeff[0], &lam_coeff[1], &lam_coeff[2], &lam_coeff[3]);
+    fclose(f);
+    if (n!=6 || strcmp(storedserial, serial) || storedID!=deviceID)
+        return -1;
+    return 0;
+}
+
+int store_calibration(char *serial, int deviceID, double *lam_coeff) {
+    char dir[CACHE_NAMLEN], file[CACHE_NAMLEN];
+    FILE *f;
+    int i;
+
+    if (cache_filename("calib", serial, deviceID, dir, file)) return -1;
+    mkdir(dir, 0755); /* fails harmlessly if it exists */
+    f = fopen(file, "w");
+    if (!f) return -1;
+    fprintf(f, "%s\n%x\n", serial, deviceID);
+    for (i=0; i<4; i++) fprintf(f, "%.17g\n", lam_coeff[i]);
+    return fclose(f) ? -1 : 0;
+}
+
+/* a frame file is named like the calibration file, with the integration
+   time added to the kind */
+static int frame_filename(char *kind, char *serial, int deviceID,
+                          int integrationtime, char *dir, char *file) {
+    char kindtime[40];
+
+    snprintf(kindtime, sizeof(kindtime), "%.20s-%dms", kind, integrationtime);
+    return cache_filename(kindtime, serial, deviceID, dir, file);
+}
+
+int load_frame(char *kind, char *serial, int deviceID, int integrationtime,
+               float *values, int pixels) {
+    char dir[CACHE_NAMLEN], file[CACHE_NAMLEN];
+    char storedserial[20];
+    int storedID, storedtime;
+    FILE *f;
+    int i, n;
+
+    if (frame_filename(kind, serial, deviceID, integrationtime, dir, file))
+        return -1;
+    f = fopen(file, "r");
+    if (!f) return -1;
+    n = fscanf(f, "%19s %x %d", storedserial, &storedID, &storedtime);
+    for (i=0; n==3 && i<pixels; i++)
+        if (fscanf(f, "%f", &values[i])!=1) break;
+    fclose(f);
+    if (n!=3 || i<pixels || strcmp(storedserial, serial) ||
+        storedID!=deviceID || storedtime!=integrationtime)
+        return -1;
+    return 0;
+}
+
+int store_frame(char *kind, char *serial, int deviceID, int integrationtime,
+                float *values, int pixels) {
+    char dir[CACHE_NAMLEN], file[CACHE_NAMLEN];
+    FILE *f;
+    int i;
+
+    if (frame_filename(kind, serial, deviceID, integrationtime, dir, file))
+        return -1;
+    mkdir(dir, 0755); /* fails harmlessly if it exists */
+    f = fopen(file, "w");
+    if (!f) return -1;
+    fprintf(f, "%s\n%x\n%d\n", serial, deviceID, integrationtime);
+    for (i=0; i<pixels; i++) fprintf(f, "%.3f\n", values[i]);
+    return fclose(f) ? -1 : 0;
+}
+
+void wavelength_table(double *lam_coeff, double *lambda, int pixels) {
+    int i;
+    for (i=0; i<pixels; i++)
+        lambda[i] = lam_coeff[0] + i * (lam_coeff[1] +
+                                        i*(lam_coeff[2]+i*lam_coeff[3]));
+}
@@ -0,0 +1,42 @@
+/* calib.h: wavelength calibration of the spectrometers. Details see calib.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* reads the wavelength coefficients of the device with a given serial
+   number and device ID from the local cache. Returns 0 on success, or -1 if
+   there is no valid entry. */
+int load_calibration(char *serial, int deviceID, double *lam_coeff);
+
+/* stores the wavelength coefficients in the local cache. Returns 0 on
+   success or -1 if the cache could not be written. */
+int store_calibration(char *serial, int deviceID, double *lam_coeff);
+
+/* reads a frame of a kind ("dark" or "reference") with the mean value of
+   every pixel, taken with the given device and integration time in ms,
+   from the local cache. Returns 0 on success, or -1 if there is none. */
+int load_frame(char *kind, char *serial, int deviceID, int integrationtime,
+               float *values, int pixels);
+
+/* stores such a frame in the local cache. Returns 0 on success or -1 if
+   the cache could not be written. */
+int store_frame(char *kind, char *serial, int deviceID, int integrationtime,
+                float *values, int pixels);
+
+/* fills a table with the wavelength in nm of every pixel */
+void wavelength_table(double *lam_coeff, double *lambda, int pixels);
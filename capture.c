@@ -0,0 +1,229 @@
+/* capture.c: recording and replay of raw spectra.
+
+   With the -R option, spectroread stores the raw data of every spectrum
+   together with its timestamp and sequence number, and the device ID,
+   serial number and wavelength coefficients of the device, in a capture
+   file. The format is described in capture.h.
+
+   A capture file can be used as a device again:
+     replay:file              spectra come at the original pace
+     replay:file,pace=max     spectra come as fast as they can be read
+   The replayed device answers the requests like the recorded one, and
+   GetFrameInfo gives the recorded sequence numbers and timestamps. When the
+   file is exhausted, spectrum requests fail with ENODATA, which ends a run
+   normally. The device cannot be asked for its integration time, so the
+   comments show the one given with -i; the recorded one is in the header.
+   This reproduces problems seen in the field exactly, measures
+   the processing chain with real data, and reprocesses old runs.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "device.h"
+#include "decode.h"
+#include "output.h"
+#include "capture.h"
+
+int write_capture_header(int fd, int deviceID, char *serial,
+                         double *lam_coeff, int integrationtime) {
+    struct spectrum_file_header h;
+
+    fill_binary_header(&h, deviceID, serial, lam_coeff, integrationtime, 0, 1);
+    memcpy(h.magic, CAPTURE_FILE_MAGIC, sizeof(h.magic));
+    h.pixels = htole32(SPECTRUM_PIXELS);
+    h.recordsize = htole32(CAPTURE_RECORD_SIZE);
+    return write_all(fd, (char *)&h, sizeof(h));
+}
+
+int write_capture_record(int fd, unsigned char *data, uint64_t timestamp,
+                         uint32_t sequence) {
+    uint64_t record[CAPTURE_RECORD_SIZE/sizeof(uint64_t)];
+    struct capture_record_header *h = (struct capture_record_header *)record;
+
+    h->timestamp = htole64(timestamp);
+    h->sequence = htole32(sequence);
+    h->length = htole32(SPECTRUM_BYTES);
+    memcpy((char *)record + sizeof(*h), data, SPECTRUM_BYTES);
+    memset((char *)record + sizeof(*h) + SPECTRUM_BYTES, 0,
+           CAPTURE_RECORD_SIZE - sizeof(*h) - SPECTRUM_BYTES);
+    return write_all(fd, (char *)record, CAPTURE_RECORD_SIZE);
+}
+
+/* replay device */
+struct replay {
+    FILE *file;
+    int deviceID;
+    char serial[17];
+    double lam_coeff[4];
+    int realtime;              /* keep the recorded pace */
+    int pending;               /* triggered, but not read yet */
+    int started;               /* first spectrum has been delivered */
+    uint64_t firststamp;       /* recorded time of the first spectrum */
+    struct timespec start;     /* ...and when it was replayed */
+    struct spectrum_frame_info lastframe;
+};
+
+/* the device sends the coefficients as text of at most 15 characters;
+   use the shortest one which gives back the same number */
+static void coefficient_text(double c, char *text) {
+    char t[32];
+    int precision;
+    for (precision=1; precision<=17; precision++) {
+        snprintf(t, sizeof(t), "%.*g", precision, c);
+        if (strlen(t) > 15 || strtod(t, NULL) == c) break;
+    }
+    memcpy(text, t, 15);
+    text[15] = 0;
+}
+
+/* next raw spectrum from the file, at the recorded pace if asked for */
+static int replay_spectrum(struct replay *r, unsigned char *data) {
+    uint64_t record[CAPTURE_RECORD_SIZE/sizeof(uint64_t)];
+    struct capture_record_header *h = (struct capture_record_header *)record;
+    struct timespec due;
+    uint64_t offset;
+
+    r->pending = 0;
+    if (fread(record, CAPTURE_RECORD_SIZE, 1, r->file) != 1) {
+        errno = ENODATA;
+        return -1;
+    }
+    r->lastframe.timestamp = le64toh(h->timestamp);
+    r->lastframe.sequence = le32toh(h->sequence);
+
+    if (!r->started) {
+        r->started = 1;
+        r->firststamp = r->lastframe.timestamp;
+        clock_gettime(CLOCK_MONOTONIC, &r->start);
+    } else if (r->realtime) {
+        offset = r->lastframe.timestamp - r->firststamp;
+        due.tv_sec = r->start.tv_sec + offset/1000000000;
+        due.tv_nsec = r->start.tv_nsec + offset%1000000000;
+        if (due.tv_nsec >= 1000000000) {
+            due.tv_sec++; due.tv_nsec -= 1000000000;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+               == EINTR);
+    }
+    memcpy(data, (char *)record + sizeof(*h), SPECTRUM_BYTES);
+    return 0;
+}
+
+static int replay_ioctl(struct device *dev, unsigned long request,
+                        unsigned long arg) {
+    struct replay *r = (struct replay *)dev->priv;
+    unsigned char *data = (unsigned char *)arg;
+    int index;
+
+    switch (request) {
+        case GetDeviceID:
+            *(int *)arg = r->deviceID;
+            return 0;
+        case QueryInformation:
+            index = data[0];
+            memset(data, 0, 18);
+            data[0] = QueryInformation & 0xff; data[1] = index;
+            if (index == 0) {
+                strcpy((char *)data+2, r->serial);
+            } else if (index <= 4) {
+                coefficient_text(r->lam_coeff[index-1], (char *)data+2);
+            }
+            return 0;
+        case SetIntegrationTime: /* it is what it was */
+        case InitializeUSB2000:
+        case SetTimeout:
+            return 0;
+        case TriggerPacket:
+            r->pending = 1;
+            return 0;
+        case RequestSpectra:
+            return replay_spectrum(r, data);
+        case EmptyPipe:
+            if (!r->pending) return ETIMEDOUT; /* like the driver */
+            return replay_spectrum(r, data);
+        case GetFrameInfo:
+            memcpy(data, &r->lastframe, sizeof(r->lastframe));
+            return 0;
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+static void replay_close(struct device *dev) {
+    struct replay *r = (struct replay *)dev->priv;
+    fclose(r->file);
+    free(r);
+}
+
+int replay_open(struct device *dev, char *args) {
+    struct replay *r;
+    struct spectrum_file_header h;
+    union { double d; uint64_t u; } c;
+    char name[FILENAME_MAX], *option;
+    int i;
+
+    r = (struct replay *)calloc(1, sizeof(struct replay));
+    if (!r) return -1;
+    r->realtime = 1;
+
+    snprintf(name, sizeof(name), "%s", args);
+    option = strchr(name, ',');
+    if (option) {
+        *option++ = 0;
+        if (!strcmp(option, "pace=max")) {
+            r->realtime = 0;
+        } else if (strcmp(option, "pace=real")) {
+            free(r);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    r->file = fopen(name, "r");
+    if (!r->file) {
+        free(r);
+        return -1;
+    }
+    if (fread(&h, sizeof(h), 1, r->file) != 1 ||
+        memcmp(h.magic, CAPTURE_FILE_MAGIC, sizeof(h.magic)) ||
+        le32toh(h.recordsize) != CAPTURE_RECORD_SIZE) {
+        fclose(r->file);
+        free(r);
+        errno = EINVAL; /* not a capture file */
+        return -1;
+    }
+    r->deviceID = le32toh(h.deviceID);
+    memcpy(r->serial, h.serial, sizeof(h.serial)); /* r->serial[16] is 0 */
+    for (i=0; i<4; i++) {
+        memcpy(&c.u, &h.lam_coeff[i], sizeof(double));
+        c.u = le64toh(c.u);
+        r->lam_coeff[i] = c.d;
+    }
+
+    dev->priv = r;
+    dev->ioctl = replay_ioctl;
+    dev->close = replay_close;
+    return 0;
+}
@@ -0,0 +1,50 @@
+/* capture.h: recording and replay of raw spectra. Details see capture.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+/* capture file: a struct spectrum_file_header (see output.h) with the
+   magic CAPTURE_FILE_MAGIC and recordsize CAPTURE_RECORD_SIZE, followed by
+   one record per spectrum. A record is a struct capture_record_header and
+   the SPECTRUM_BYTES bytes exactly as they came from RequestSpectra or
+   EmptyPipe, padded to a multiple of 8 bytes. All numbers are little
+   endian. */
+#define CAPTURE_FILE_MAGIC "USB2KRAW"
+
+struct capture_record_header {
+    uint64_t timestamp;        /* CLOCK_MONOTONIC in ns */
+    uint32_t sequence;         /* sequence number from the driver */
+    uint32_t length;           /* SPECTRUM_BYTES */
+};
+
+#define CAPTURE_RECORD_SIZE ((sizeof(struct capture_record_header) \
+                              + SPECTRUM_BYTES + 7) & ~7)
+
+/* writes the capture header / one raw spectrum. Return 0 or -1 on error. */
+int write_capture_header(int fd, int deviceID, char *serial,
+                         double *lam_coeff, int integrationtime);
+int write_capture_record(int fd, unsigned char *data, uint64_t timestamp,
+                         uint32_t sequence);
+
+/* sets up dev to replay a capture file. args is the part of the device
+   name after REPLAY_PREFIX (see device.h), see capture.c. Returns 0, or -1 with errno
+   set. */
+int replay_open(struct device *dev, char *args);
@@ -0,0 +1,85 @@
+/* correct.c: dark and reference correction.
+
+   The baseline correction of the text output subtracts the mean of the
+   covered pixels from all pixels. A dark frame, taken with the light
+   blocked and the same integration time, also covers the pixel-to-pixel
+   differences of dark current and offset, and is subtracted pixel by
+   pixel. With a reference frame, taken with the light source but without
+   the sample, each spectrum can be turned into a transmittance
+   T = (S-D)/(R-D), or an absorbance A = -log10 T.
+
+   Dark and reference frames are the mean of a number of spectra; they are
+   kept in the calibration cache (see calib.c). For every spectrum, the
+   work is one subtraction and one multiplication per pixel, in loops which
+   the compiler turns into SIMD code. Pixels where the reference is not
+   above the dark level give a transmittance of 0, and transmittances
+   below TRANSMITTANCE_MIN are taken as that for the absorbance.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "correct.h"
+
+void prepare_correction(struct correction *c, int mode, float *dark,
+                        float *reference) {
+    int i;
+
+    c->mode = mode;
+    memcpy(c->dark, dark, sizeof(c->dark));
+    for (i=0; i<SPECTRUM_PIXELS; i++)
+        c->scale[i] = reference && reference[i] > dark[i] ?
+            1.0f/(reference[i]-dark[i]) : 0.0f;
+}
+
+void apply_correction(struct correction *c, uint16_t *rawvalues,
+                      float *values) {
+    int i;
+
+    switch (c->mode) {
+        case CORRECT_DARK:
+            for (i=0; i<SPECTRUM_PIXELS; i++)
+                values[i] = rawvalues[i] - c->dark[i];
+            break;
+        case CORRECT_TRANSMITTANCE:
+            for (i=0; i<SPECTRUM_PIXELS; i++)
+                values[i] = (rawvalues[i] - c->dark[i]) * c->scale[i];
+            break;
+        case CORRECT_ABSORBANCE:
+            for (i=0; i<SPECTRUM_PIXELS; i++)
+                values[i] = (rawvalues[i] - c->dark[i]) * c->scale[i];
+            for (i=0; i<SPECTRUM_PIXELS; i++)
+                values[i] = -log10f(values[i] > TRANSMITTANCE_MIN ?
+                                    values[i] : TRANSMITTANCE_MIN);
+            break;
+    }
+}
+
+void add_to_average(struct frameaverage *a, uint16_t *rawvalues) {
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS; i++) a->sum[i] += rawvalues[i];
+    a->count++;
+}
+
+void get_average(struct frameaverage *a, float *values) {
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS; i++)
+        values[i] = a->count ? (float)a->sum[i]/a->count : 0.0f;
+}
@@ -0,0 +1,58 @@
+/* correct.h: dark and reference correction. Details see correct.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+/* what to make of a spectrum */
+#define CORRECT_NONE 0
+#define CORRECT_DARK 1          /* counts minus dark frame */
+#define CORRECT_TRANSMITTANCE 2 /* (counts-dark)/(reference-dark) */
+#define CORRECT_ABSORBANCE 3    /* -log10 of the transmittance */
+
+/* smallest transmittance used for the absorbance */
+#define TRANSMITTANCE_MIN 1e-6f
+
+/* correction of one device */
+struct correction {
+    int mode;
+    float dark[SPECTRUM_PIXELS];
+    float scale[SPECTRUM_PIXELS];  /* 1/(reference-dark), or 0 */
+};
+
+/* prepares a correction from dark and reference frame. The reference is
+   only needed for transmittance and absorbance. */
+void prepare_correction(struct correction *c, int mode, float *dark,
+                        float *reference);
+
+/* corrected values of a spectrum */
+void apply_correction(struct correction *c, uint16_t *rawvalues,
+                      float *values);
+
+/* sums of spectra, for taking dark and reference frames */
+struct frameaverage {
+    uint32_t sum[SPECTRUM_PIXELS];
+    uint32_t count;
+};
+
+void add_to_average(struct frameaverage *a, uint16_t *rawvalues);
+
+/* mean of the summed spectra */
+void get_average(struct frameaverage *a, float *values);
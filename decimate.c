@@ -0,0 +1,149 @@
+/* decimate.c: min/max envelope of a spectrum for display.
+
+   A plot window is a few hundred pixels wide, but the spectrum has 2048
+   points. For each screen column, the smallest and the largest value of
+   the pixels which fall into it are enough to draw the same picture, and a
+   narrow peak still shows up in full height. Which pixels belong to a
+   column follows from the wavelength table, so this is done once. A column
+   which is narrower than a pixel shows the pixel closest to its center.
+
+   Columns rarely have more than a few pixels, so on x86 machines with
+   SSE4.1, the pixels of a column are loaded into one register, padded to
+   8 values, and reduced with a single PHMINPOSUW each for minimum and
+   maximum. The plain C version is used elsewhere; both give identical
+   results.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "decimate.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+int prepare_decimation(struct decimation *d, double *wavelength,
+                       double lmin, double lmax, int columns) {
+    int edge[SPECTRUM_PIXELS+1]; /* first pixel at or right of a border */
+    double step;
+    int c, i, best;
+
+    if (columns < 1 || columns > SPECTRUM_PIXELS || !(lmax > lmin)) return -1;
+    if (wavelength[0] > lmax || wavelength[SPECTRUM_PIXELS-1] < lmin)
+        return -1;
+    d->columns = columns;
+    step = (lmax-lmin)/columns;
+
+    /* the wavelength grows with the pixel index */
+    for (c=0, i=0; c<=columns; c++) {
+        while (i<SPECTRUM_PIXELS && wavelength[i] < lmin+c*step) i++;
+        edge[c] = i;
+    }
+    for (c=0; c<columns; c++) {
+        d->lambda[c] = lmin + (c+0.5)*step;
+        d->first[c] = edge[c];
+        d->count[c] = edge[c+1] - edge[c];
+        if (d->count[c]) continue;
+        /* no pixel of its own; take the nearest one */
+        best = edge[c] < SPECTRUM_PIXELS ? edge[c] : SPECTRUM_PIXELS-1;
+        if (best > 0 && fabs(wavelength[best-1]-d->lambda[c]) <
+            fabs(wavelength[best]-d->lambda[c])) best--;
+        d->first[c] = best;
+        d->count[c] = 1;
+    }
+    return 0;
+}
+
+void decimate_minmax_scalar(struct decimation *d, uint16_t *values,
+                            uint16_t *min, uint16_t *max) {
+    int c, i;
+    uint16_t lo, hi, *v;
+
+    for (c=0; c<d->columns; c++) {
+        v = values + d->first[c];
+        lo = hi = v[0];
+        for (i=1; i<d->count[c]; i++) {
+            if (v[i] < lo) lo = v[i];
+            if (v[i] > hi) hi = v[i];
+        }
+        min[c] = lo; max[c] = hi;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* lanes from n on are all ones, so they never win a minimum */
+static const uint16_t padmask[16] = {
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff,
+};
+
+/* the maximum is the minimum of the complemented values */
+__attribute__((target("sse4.1")))
+void decimate_minmax_sse41(struct decimation *d, uint16_t *values,
+                           uint16_t *min, uint16_t *max) {
+    uint16_t padded[SPECTRUM_PIXELS+8]; /* loads may run past the end */
+    __m128i ones = _mm_set1_epi16(-1);
+    __m128i x, pad, lo, hi;
+    int c, n;
+    uint16_t *v;
+
+    memcpy(padded, values, SPECTRUM_PIXELS*sizeof(uint16_t));
+    memset(padded+SPECTRUM_PIXELS, 0, 8*sizeof(uint16_t));
+
+    for (c=0; c<d->columns; c++) {
+        v = padded + d->first[c];
+        n = d->count[c];
+        lo = ones; hi = ones;
+        for (; n>8; n-=8, v+=8) {
+            x = _mm_loadu_si128((__m128i *)v);
+            lo = _mm_min_epu16(lo, x);
+            hi = _mm_min_epu16(hi, _mm_xor_si128(x, ones));
+        }
+        pad = _mm_loadu_si128((__m128i *)(padmask+8-n));
+        x = _mm_loadu_si128((__m128i *)v);
+        lo = _mm_min_epu16(lo, _mm_or_si128(x, pad));
+        hi = _mm_min_epu16(hi, _mm_or_si128(_mm_xor_si128(x, ones), pad));
+        min[c] = _mm_extract_epi16(_mm_minpos_epu16(lo), 0);
+        max[c] = ~_mm_extract_epi16(_mm_minpos_epu16(hi), 0);
+    }
+}
+#endif
+
+/* version used by the dispatcher below */
+static void (*minmax)(struct decimation *, uint16_t *, uint16_t *,
+                      uint16_t *) = 0;
+
+static void choose_minmax(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        minmax = decimate_minmax_sse41;
+        return;
+    }
+#endif
+    minmax = decimate_minmax_scalar;
+}
+
+void decimate_minmax(struct decimation *d, uint16_t *values,
+                     uint16_t *min, uint16_t *max) {
+    if (!minmax) choose_minmax();
+    minmax(d, values, min, max);
+}
@@ -0,0 +1,53 @@
+/* decimate.h: min/max envelope of a spectrum for display. Details see
+   decimate.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+/* screen columns of a wavelength window. Column c shows the pixels
+   first[c] to first[c]+count[c]-1. */
+struct decimation {
+    int columns;
+    int first[SPECTRUM_PIXELS];
+    int count[SPECTRUM_PIXELS];
+    double lambda[SPECTRUM_PIXELS]; /* center wavelength of each column */
+};
+
+/* divides the window lmin..lmax in nm into columns of equal width and
+   finds their pixels in the wavelength table. Returns 0, or -1 if the
+   window contains no pixels or the number of columns is out of range. */
+int prepare_decimation(struct decimation *d, double *wavelength,
+                       double lmin, double lmax, int columns);
+
+/* smallest and largest pixel value of each column. The fastest version for
+   the CPU is chosen at the first call. */
+void decimate_minmax(struct decimation *d, uint16_t *values,
+                     uint16_t *min, uint16_t *max);
+
+/* plain C reference version of the above */
+void decimate_minmax_scalar(struct decimation *d, uint16_t *values,
+                            uint16_t *min, uint16_t *max);
+
+/* the SSE4.1 version on x86, only if the CPU has it */
+#ifdef HAVE_X86_SIMD
+void decimate_minmax_sse41(struct decimation *d, uint16_t *values,
+                           uint16_t *min, uint16_t *max);
+#endif
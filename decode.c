@@ -0,0 +1,134 @@
+/* decode.c: conversion of the raw spectrum data of USB2000/USB2000+ devices
+             into pixel values.
+
+   The USB2000 sends the pixels in 32 blocks of 128 bytes. Each block holds
+   the LSBs of 64 pixels, followed by their MSBs. The USB2000+ sends the
+   pixels as little endian 16 bit words. Both are followed by a sync byte.
+
+   The decoding is done with SSE2 or AVX2 on x86 machines, whichever the CPU
+   offers, and with the plain C versions elsewhere. All versions give
+   identical results; test/decodetest.c checks that.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "decode.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* reference versions */
+void generate_numbers_USB2000_scalar(unsigned char *data, uint16_t *values) {
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS; i++)
+        values[i] = data[(i%64)+(i>>6)*128+64]*256 + data[(i%64)+(i>>6)*128];
+}
+void generate_numbers_USB2000p_scalar(unsigned char *data, uint16_t *values) {
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS; i++)
+        values[i] = data[i*2+1]*256 + data[2*i];
+}
+
+#ifdef HAVE_X86_SIMD
+/* interleaving the LSB and MSB bytes gives little endian words, which is
+   what the CPU uses anyway */
+void generate_numbers_USB2000_sse2(unsigned char *data, uint16_t *values) {
+    int b, j;
+    __m128i lsb, msb;
+    for (b=0; b<SPECTRUM_PIXELS/64; b++, data+=128, values+=64) {
+        for (j=0; j<64; j+=16) {
+            lsb = _mm_loadu_si128((__m128i *)(data+j));
+            msb = _mm_loadu_si128((__m128i *)(data+64+j));
+            _mm_storeu_si128((__m128i *)(values+j),
+                             _mm_unpacklo_epi8(lsb, msb));
+            _mm_storeu_si128((__m128i *)(values+j+8),
+                             _mm_unpackhi_epi8(lsb, msb));
+        }
+    }
+}
+void generate_numbers_USB2000p_sse2(unsigned char *data, uint16_t *values) {
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS*2; i+=16)
+        _mm_storeu_si128((__m128i *)((unsigned char *)values+i),
+                         _mm_loadu_si128((__m128i *)(data+i)));
+}
+
+/* the AVX2 unpack instructions work within 128 bit lanes, so the lanes
+   have to be sorted afterwards */
+__attribute__((target("avx2")))
+void generate_numbers_USB2000_avx2(unsigned char *data, uint16_t *values) {
+    int b, j;
+    __m256i lsb, msb, lo, hi;
+    for (b=0; b<SPECTRUM_PIXELS/64; b++, data+=128, values+=64) {
+        for (j=0; j<64; j+=32) {
+            lsb = _mm256_loadu_si256((__m256i *)(data+j));
+            msb = _mm256_loadu_si256((__m256i *)(data+64+j));
+            lo = _mm256_unpacklo_epi8(lsb, msb);
+            hi = _mm256_unpackhi_epi8(lsb, msb);
+            _mm256_storeu_si256((__m256i *)(values+j),
+                                _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i *)(values+j+16),
+                                _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    }
+}
+__attribute__((target("avx2")))
+void generate_numbers_USB2000p_avx2(unsigned char *data, uint16_t *values) {
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS*2; i+=32)
+        _mm256_storeu_si256((__m256i *)((unsigned char *)values+i),
+                            _mm256_loadu_si256((__m256i *)(data+i)));
+}
+#endif
+
+/* versions used by the dispatchers below */
+static void (*decode_USB2000)(unsigned char *, uint16_t *) = 0;
+static void (*decode_USB2000p)(unsigned char *, uint16_t *) = 0;
+
+static void choose_decoders(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        decode_USB2000 = generate_numbers_USB2000_avx2;
+        decode_USB2000p = generate_numbers_USB2000p_avx2;
+    } else {
+        decode_USB2000 = generate_numbers_USB2000_sse2;
+        decode_USB2000p = generate_numbers_USB2000p_sse2;
+    }
+#else
+    decode_USB2000 = generate_numbers_USB2000_scalar;
+    decode_USB2000p = generate_numbers_USB2000p_scalar;
+#endif
+}
+
+void generate_numbers_USB2000(unsigned char *data, uint16_t *values) {
+    if (!decode_USB2000) choose_decoders();
+    decode_USB2000(data, values);
+}
+void generate_numbers_USB2000p(unsigned char *data, uint16_t *values) {
+    if (!decode_USB2000p) choose_decoders();
+    decode_USB2000p(data, values);
+}
+
+float baselevel_USB2000(uint16_t *values) {
+    int i;
+    int sum=0;
+    for (i=BLACKLEVEL_START;i<=BLACKLEVEL_END;i++) sum += values[i];
+    return ((float) sum)/(BLACKLEVEL_END-BLACKLEVEL_START+1);
+}
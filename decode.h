@@ -0,0 +1,49 @@
+/* decode.h: conversion of the raw spectrum data of USB2000/USB2000+ devices
+             into pixel values. Details see decode.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+
+#define SPECTRUM_PIXELS 2048  /* pixels of a USB2000/USB2000+ CCD */
+#define SPECTRUM_BYTES 4097   /* raw data of one spectrum incl. sync byte */
+
+/* convert the 4097 bytes of a RequestSpectra call into 2048 pixel values.
+   The fastest version for the CPU is chosen at the first call. */
+void generate_numbers_USB2000(unsigned char *data, uint16_t *values);
+void generate_numbers_USB2000p(unsigned char *data, uint16_t *values);
+
+/* plain C reference versions of the above */
+void generate_numbers_USB2000_scalar(unsigned char *data, uint16_t *values);
+void generate_numbers_USB2000p_scalar(unsigned char *data, uint16_t *values);
+
+/* the SIMD versions on x86; the AVX2 ones only if the CPU has it */
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_X86_SIMD
+void generate_numbers_USB2000_sse2(unsigned char *data, uint16_t *values);
+void generate_numbers_USB2000p_sse2(unsigned char *data, uint16_t *values);
+void generate_numbers_USB2000_avx2(unsigned char *data, uint16_t *values);
+void generate_numbers_USB2000p_avx2(unsigned char *data, uint16_t *values);
+#endif
+
+/* the pixels BLACKLEVEL_START to BLACKLEVEL_END are covered; their mean is
+   the dark level of a spectrum */
+#define BLACKLEVEL_START 6
+#define BLACKLEVEL_END 20
+float baselevel_USB2000(uint16_t *values);
@@ -0,0 +1,114 @@
+/* device.c: access to a spectrometer.
+
+   The program talks to the spectrometer through a struct device. For a real
+   device, this is just the file handle of the driver, and the requests go
+   out as ioctl() calls. A device name starting with "sim:" gives a
+   simulated spectrometer instead (see sim.c), which understands the same
+   requests, so everything can be run and measured without the hardware.
+   A name starting with "replay:" plays back a capture file (see capture.c).
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "sim.h"
+#include "capture.h"
+
+/* methods for the device file of the driver */
+static int file_ioctl(struct device *dev, unsigned long request,
+                      unsigned long arg) {
+    return ioctl(dev->fd, request, arg);
+}
+static void file_close(struct device *dev) {
+    close(dev->fd);
+}
+
+struct device *device_open(char *name) {
+    struct device *dev;
+
+    dev = (struct device *)calloc(1, sizeof(struct device));
+    if (!dev) return NULL;
+    dev->fd = -1;
+
+    if (!strncmp(name, SIM_PREFIX, strlen(SIM_PREFIX))) {
+        if (sim_open(dev, name+strlen(SIM_PREFIX))) {
+            free(dev);
+            return NULL;
+        }
+        return dev;
+    }
+    if (!strncmp(name, REPLAY_PREFIX, strlen(REPLAY_PREFIX))) {
+        if (replay_open(dev, name+strlen(REPLAY_PREFIX))) {
+            free(dev);
+            return NULL;
+        }
+        return dev;
+    }
+
+    dev->fd = open(name, O_RDWR);
+    if (dev->fd == -1) {
+        free(dev);
+        return NULL;
+    }
+    dev->ioctl = file_ioctl;
+    dev->close = file_close;
+    return dev;
+}
+
+void device_close(struct device *dev) {
+    dev->close(dev);
+    free(dev);
+}
+
+int device_ioctl(struct device *dev, unsigned long request, ...) {
+    va_list ap;
+    unsigned long arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, unsigned long);
+    va_end(ap);
+    return dev->ioctl(dev, request, arg);
+}
+
+int device_set_integrationtime(struct device *dev, int deviceID, int ms) {
+    return device_ioctl(dev, SetIntegrationTime,
+                        ms * ((deviceID==USB_DEVICE_ID_USB2000)?1:1000));
+}
+
+int device_fullscale(int deviceID) {
+    return deviceID==USB_DEVICE_ID_USB2000 ? 4095 : 65535; /* 12 or 16 bit */
+}
+
+void device_frameinfo(struct device *dev, struct spectrum_frame_info *info,
+                      unsigned long spectrumindex) {
+    struct timespec now;
+    if (device_ioctl(dev, GetFrameInfo, info)) {
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        info->timestamp = now.tv_sec*1000000000ULL + now.tv_nsec;
+        info->sequence = spectrumindex;
+        info->dropped = 0;
+    }
+}
@@ -0,0 +1,60 @@
+/* device.h: access to a spectrometer, either through the device file of the
+   usb2000 driver or through a built-in simulation. Details see device.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "usb2000.h"
+
+#define USB_DEVICE_ID_USB2000 0x1002
+#define USB_DEVICE_ID_USB2PLUS 0x101e
+
+/* name prefix of the simulated devices */
+#define SIM_PREFIX "sim:"
+
+/* name prefix of replayed capture files */
+#define REPLAY_PREFIX "replay:"
+
+/* an open spectrometer. The ioctl method takes the same requests and
+   returns the same values as an ioctl() on the driver. */
+struct device {
+    int (*ioctl)(struct device *dev, unsigned long request, unsigned long arg);
+    void (*close)(struct device *dev);
+    int fd;       /* device file, or -1 */
+    void *priv;   /* state of a simulation or replay */
+};
+
+/* opens a device file, or a simulated device if the name starts with
+   SIM_PREFIX, or a replay if it starts with REPLAY_PREFIX. Returns NULL with errno set on failure. */
+struct device *device_open(char *name);
+void device_close(struct device *dev);
+
+/* use like ioctl(); the argument is a value or a pointer, see usb2000.h */
+int device_ioctl(struct device *dev, unsigned long request, ...);
+
+/* sets the integration time in ms, in the units the device expects */
+int device_set_integrationtime(struct device *dev, int deviceID, int ms);
+
+/* largest count a pixel of the device can have */
+int device_fullscale(int deviceID);
+
+/* gets sequence number and timestamp of the last spectrum. Older drivers
+   don't know about this; then the timestamp is taken here and the sequence
+   number is the given spectrum index. */
+void device_frameinfo(struct device *dev, struct spectrum_frame_info *info,
+                      unsigned long spectrumindex);
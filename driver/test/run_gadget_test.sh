@@ -0,0 +1,83 @@
+#!/bin/sh
+# run_gadget_test.sh: tests the driver against an emulated USB2000+.
+#
+# Needs root and a kernel with the dummy_hcd and raw_gadget modules
+# (CONFIG_USB_DUMMY_HCD, CONFIG_USB_RAW_GADGET). The usb2000 module has to
+# be built in the directory above (make there), and the programs here
+# (make in this directory). spectroread is taken from the top directory.
+#
+# The script loads the modules, plugs in the emulated spectrometer and
+# checks the single spectrum ioctls with spectroread, streaming with read()
+# and mmap(), two readers of a broadcast stream, the transfer statistics,
+# and an unplug while the ring is mapped. It exits with 0 if everything passed.
+
+set -e
+cd "$(dirname "$0")"
+DRIVER=..
+TOP=../..
+GADGET=./usb2000_gadget
+SPECTRA=200
+fail() { echo "FAIL: $*"; exit 1; }
+
+cleanup() {
+    [ -n "$GADGETPID" ] && kill "$GADGETPID" 2>/dev/null || true
+    wait 2>/dev/null || true
+    rmmod usb2000 2>/dev/null || true
+}
+trap cleanup EXIT
+
+modprobe dummy_hcd
+modprobe raw_gadget
+rmmod usb2000 2>/dev/null || true
+insmod $DRIVER/usb2000.ko
+dmesg -C 2>/dev/null || true
+
+# plugs in the emulator with the given options and waits for the device file
+plug() {
+    $GADGET "$@" &
+    GADGETPID=$!
+    for i in $(seq 50); do
+        DEV=$(ls /dev/Spectrometer* 2>/dev/null | head -1)
+        [ -n "$DEV" ] && break
+        sleep 0.1
+    done
+    [ -n "$DEV" ] || fail "no device file after plugging in the emulator"
+    STATS=$(echo /sys/bus/usb/drivers/usb2000/*/statistics)
+    [ -d "$STATS" ] || fail "no statistics in sysfs"
+}
+
+plug
+
+# single spectra through RequestSpectra, wavelengths from QueryInformation
+lines=$($TOP/spectroread -d "$DEV" -i 10 -V 0 | grep -c -v '^#')
+[ "$lines" = 2048 ] || fail "spectroread gave $lines lines"
+echo "spectroread: ok"
+
+# streaming; every transfer gets counted once in the statistics
+before=$(cat $STATS/bytes_received)
+./streamtest read "$DEV" $SPECTRA || fail "streaming with read()"
+after=$(cat $STATS/bytes_received)
+transfers=$(( (after - before) / 4097 ))
+[ $transfers -ge $SPECTRA ] && [ $transfers -le $((SPECTRA + 16)) ] ||
+    fail "$transfers transfers counted for $SPECTRA spectra"
+[ "$(cat $STATS/short_transfers)" = 0 ] || fail "short transfers counted"
+echo "statistics: ok"
+
+./streamtest mmap "$DEV" $SPECTRA || fail "streaming with mmap()"
+
+# two readers share one stream; the slow one must not hold up the fast one
+./streamtest broadcast "$DEV" $SPECTRA || fail "broadcast streaming"
+
+# unplug while the ring is mapped and read
+kill "$GADGETPID"; wait "$GADGETPID" 2>/dev/null || true
+sleep 0.5
+plug -u 50
+./streamtest unplug "$DEV" || fail "unplug"
+wait "$GADGETPID" 2>/dev/null || true
+GADGETPID=
+
+if dmesg | grep -E -q 'BUG|Oops|KASAN|WARNING'; then
+    dmesg | tail -40
+    fail "kernel complained"
+fi
+echo "all passed"
@@ -0,0 +1,308 @@
+/* streamtest.c: exercises the streaming mode of the driver against the
+   emulated spectrometer of usb2000_gadget.c.
+
+   usage: streamtest mode device count
+
+   read:     StartStreaming, count spectra with read()
+   mmap:     StartStreaming, count spectra consumed in the mapped ring; the
+             mapping must not be writable, and StopStreaming must fail as
+             long as it exists
+   unplug:   StartStreaming and map the ring, then read until the device
+             goes away; the mapping has to stay readable afterwards
+   broadcast: two processes join one stream with StartBroadcast and read
+             count spectra each; one reads fast and must not lose any, the
+             other one slowly, so it loses spectra without holding up the
+             fast one
+
+   Every spectrum is checked against the pattern of usb2000_gadget.c, and
+   its number must follow the previous one unless the driver reports
+   dropped spectra. The program prints what it got and exits with 0 if all
+   checks passed.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../usb2000.h"
+
+#define SPECTRUM_LEN 4097
+#define PIXELS 2048
+#define SYNC_BYTE 0x69
+#define BROADCAST_US 10000  /* integration time for the broadcast test */
+#define SLOW_US 50000       /* time the slow reader takes per spectrum */
+
+/* layout of the mapping, see usb2000.h */
+static long pagesize, slotsize, mapsize;
+
+/* checks a spectrum of the emulator; returns its number, or -1 */
+static long check_spectrum(unsigned char *data) {
+    unsigned int n, i, pixel;
+
+    n = data[0] | data[1]<<8 | data[2]<<16 | (unsigned int)data[3]<<24;
+    for (i=2; i<PIXELS; i++) {
+        pixel = data[2*i] | data[2*i+1]<<8;
+        if (pixel != ((7*i + n) & 0x3fff)) {
+            fprintf(stderr, "spectrum %u: pixel %u is %u\n", n, i, pixel);
+            return -1;
+        }
+    }
+    if (data[SPECTRUM_LEN-1] != SYNC_BYTE) {
+        fprintf(stderr, "spectrum %u: no sync byte\n", n);
+        return -1;
+    }
+    return n;
+}
+
+/* keeps track of the spectrum numbers; returns 0, or -1 if a gap does not
+   match the spectra the driver reports as dropped */
+static int follow(long n, long *last, unsigned int dropped,
+                  unsigned int *lastdropped) {
+    if (n < 0) return -1;
+    if (*last >= 0 && n - *last - 1 != dropped - *lastdropped) {
+        fprintf(stderr, "spectrum %ld follows %ld, %u dropped\n",
+                n, *last, dropped - *lastdropped);
+        return -1;
+    }
+    *last = n;
+    *lastdropped = dropped;
+    return 0;
+}
+
+static int test_read(int fd, int count) {
+    unsigned char data[SPECTRUM_LEN];
+    struct spectrum_frame_info info;
+    unsigned int lastdropped = 0;
+    long last = -1;
+    int i;
+
+    if (ioctl(fd, StartStreaming)) {
+        perror("StartStreaming");
+        return -1;
+    }
+    for (i=0; i<count; i++) {
+        if (read(fd, data, SPECTRUM_LEN) != SPECTRUM_LEN) {
+            perror("read");
+            return -1;
+        }
+        ioctl(fd, GetFrameInfo, &info);
+        if (follow(check_spectrum(data), &last, info.dropped, &lastdropped))
+            return -1;
+    }
+    printf("read: %d spectra, %u dropped\n", count, lastdropped);
+    return ioctl(fd, StopStreaming);
+}
+
+/* maps the ring and checks that it cannot be written */
+static struct spectrum_ring_control *map_ring(int fd) {
+    struct spectrum_ring_control *ctl;
+    void *map;
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    slotsize = pagesize > SPECTRUM_SLOT_SIZE ? pagesize : SPECTRUM_SLOT_SIZE;
+    mapsize = pagesize + SPECTRUM_RING_SLOTS*slotsize;
+    if (mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)
+        != MAP_FAILED) {
+        fprintf(stderr, "writable mapping accepted\n");
+        return NULL;
+    }
+    map = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (!mprotect(map, mapsize, PROT_READ|PROT_WRITE)) {
+        fprintf(stderr, "mapping could be made writable\n");
+        return NULL;
+    }
+    ctl = (struct spectrum_ring_control *)map;
+    if (ctl->slots != SPECTRUM_RING_SLOTS || ctl->slotsize != slotsize) {
+        fprintf(stderr, "ring of %u slots of %u bytes\n", ctl->slots,
+                ctl->slotsize);
+        return NULL;
+    }
+    return ctl;
+}
+
+static int test_mmap(int fd, int count) {
+    struct spectrum_ring_control *ctl;
+    struct spectrum_slot_header *hdr;
+    struct pollfd p = {fd, POLLIN, 0};
+    unsigned char *slot;
+    unsigned int head, tail, lastdropped = 0;
+    long last = -1;
+    int got = 0;
+
+    if (ioctl(fd, StartStreaming)) {
+        perror("StartStreaming");
+        return -1;
+    }
+    ctl = map_ring(fd);
+    if (!ctl) return -1;
+    if (!ioctl(fd, StopStreaming) || errno != EBUSY) {
+        fprintf(stderr, "StopStreaming did not refuse a mapped ring\n");
+        return -1;
+    }
+    while (got < count) {
+        if (poll(&p, 1, 5000) != 1) {
+            fprintf(stderr, "no spectrum within 5 s\n");
+            return -1;
+        }
+        head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+        for (tail=ctl->tail; tail!=head && got<count; tail++, got++) {
+            slot = (unsigned char *)ctl + pagesize +
+                ctl->queue[tail % SPECTRUM_RING_SLOTS]*slotsize;
+            hdr = (struct spectrum_slot_header *)slot;
+            if (hdr->length != SPECTRUM_LEN || hdr->status) {
+                fprintf(stderr, "slot header %u/%d\n", hdr->length,
+                        hdr->status);
+                return -1;
+            }
+            if (follow(check_spectrum(slot + SPECTRUM_SLOT_DATA), &last,
+                       ctl->dropped, &lastdropped)) return -1;
+            if (ioctl(fd, ReleaseSpectra, 1)) {
+                perror("ReleaseSpectra");
+                return -1;
+            }
+        }
+    }
+    printf("mmap: %d spectra, %u dropped\n", count, lastdropped);
+    munmap(ctl, mapsize);
+    return ioctl(fd, StopStreaming);
+}
+
+static int test_unplug(int fd) {
+    struct spectrum_ring_control *ctl;
+    unsigned char data[SPECTRUM_LEN];
+    unsigned int i, sum = 0;
+    int n = 0;
+
+    if (ioctl(fd, StartStreaming)) {
+        perror("StartStreaming");
+        return -1;
+    }
+    ctl = map_ring(fd);
+    if (!ctl) return -1;
+    while (read(fd, data, SPECTRUM_LEN) == SPECTRUM_LEN) n++;
+    printf("unplug: %d spectra, then %s\n", n, strerror(errno));
+    sleep(1); /* let the driver tear down the device */
+
+    /* the pages must still be there */
+    for (i=0; i<mapsize; i+=64) sum += ((unsigned char *)ctl)[i];
+    printf("unplug: mapping still readable (%u)\n", sum);
+    munmap(ctl, mapsize);
+    return 0;
+}
+
+/* one reader of the broadcast stream */
+static int broadcast_reader(char *name, int count, int slow) {
+    unsigned char data[SPECTRUM_LEN];
+    struct spectrum_frame_info info;
+    struct timespec t0, t1;
+    unsigned int lastdropped = 0;
+    long last = -1;
+    double seconds;
+    int fd, i;
+
+    fd = open(name, O_RDWR);
+    if (fd < 0 || ioctl(fd, StartBroadcast)) {
+        perror(name);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<count; i++) {
+        if (read(fd, data, SPECTRUM_LEN) != SPECTRUM_LEN) {
+            perror("read");
+            return -1;
+        }
+        ioctl(fd, GetFrameInfo, &info);
+        if (follow(check_spectrum(data), &last, info.dropped, &lastdropped))
+            return -1;
+        if (slow) usleep(SLOW_US);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    seconds = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec)*1e-9;
+    printf("broadcast: %s reader, %d spectra in %.2f s, %u dropped\n",
+           slow ? "slow" : "fast", count, seconds, lastdropped);
+    ioctl(fd, StopStreaming);
+    close(fd);
+
+    if (slow) return lastdropped ? 0 : -1;
+    /* the fast reader must neither lose spectra nor wait for the slow one */
+    return !lastdropped && seconds < 2.0*count*BROADCAST_US*1e-6 + 1 ? 0 : -1;
+}
+
+static int test_broadcast(char *name, int count) {
+    pid_t pid;
+    int fd, status, err;
+
+    /* a short integration time, set before anyone streams */
+    fd = open(name, O_RDWR);
+    if (fd < 0 || ioctl(fd, SetIntegrationTime, BROADCAST_US)) {
+        perror(name);
+        return -1;
+    }
+    close(fd);
+
+    pid = fork();
+    if (pid < 0) return -1;
+    if (!pid) exit(broadcast_reader(name, count, 1) ? 1 : 0);
+    err = broadcast_reader(name, count, 0);
+    waitpid(pid, &status, 0);
+    return err || !WIFEXITED(status) || WEXITSTATUS(status) ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int fd, count, err;
+
+    if (argc < 3) {
+        fprintf(stderr,
+                "usage: streamtest read|mmap|unplug|broadcast device [count]\n");
+        return 2;
+    }
+    count = argc > 3 ? atoi(argv[3]) : 100;
+    if (!strcmp(argv[1], "broadcast"))
+        return test_broadcast(argv[2], count) ? 1 : 0;
+    fd = open(argv[2], O_RDWR);
+    if (fd < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (!strcmp(argv[1], "read")) {
+        err = test_read(fd, count);
+    } else if (!strcmp(argv[1], "mmap")) {
+        err = test_mmap(fd, count);
+    } else if (!strcmp(argv[1], "unplug")) {
+        err = test_unplug(fd);
+    } else {
+        fprintf(stderr, "unknown mode %s\n", argv[1]);
+        return 2;
+    }
+    close(fd);
+    return err ? 1 : 0;
+}
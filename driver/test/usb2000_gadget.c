@@ -0,0 +1,336 @@
+/* usb2000_gadget.c: emulates a USB2000+ spectrometer on a USB device
+   controller, so the driver can be tested without hardware.
+
+   usage: usb2000_gadget [-u count] [-d driver] [-c device]
+
+   -u count:    unplug, i.e. leave the bus, after count spectra
+   -d driver:   name of the UDC driver, default dummy_udc
+   -c device:   name of the UDC, default dummy_udc.0
+
+   The program uses the raw gadget interface (/dev/raw-gadget, needs the
+   raw_gadget module) on the dummy_hcd host/device loopback, which gives the
+   host side exactly the endpoints of the real device: EP1 out for
+   commands, EP1 in for the replies, EP2 in for the spectra and EP6 in.
+   Commands understood are InitializeUSB2000, SetIntegrationTime,
+   QueryInformation, QueryStatus and RequestSpectra; a requested spectrum
+   goes out on EP2 after the integration time.
+
+   Every spectrum carries its own number, so a reader can check what it
+   got: pixels 0 and 1 hold the spectrum number n (low word first), pixel i
+   from 2 on holds (7*i + n) & 0x3fff. The 4097th byte is the sync byte
+   0x69.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define VENDOR_ID 0x2457
+#define PRODUCT_ID 0x101e    /* USB2000+ */
+#define PACKET 512           /* high speed bulk */
+#define SPECTRUM_LEN 4097
+#define PIXELS 2048
+#define SYNC_BYTE 0x69
+#define SERIAL "GADGET01"
+
+/* endpoints of the device, in the order of the configuration */
+#define EP_CMD 0             /* 0x01 out */
+#define EP_REPLY 1           /* 0x81 in */
+#define EP_SPECTRUM 2        /* 0x82 in */
+#define EP_AUX 3             /* 0x86 in */
+#define ENDPOINTS 4
+static const unsigned char epaddr[ENDPOINTS] = {0x01, 0x81, 0x82, 0x86};
+
+/* wavelength coefficients as the device reports them */
+static const char *coeff[4] = {"339.5", "0.3812", "-1.5e-05", "-1.9e-10"};
+
+static int fd;                        /* /dev/raw-gadget */
+static int handle[ENDPOINTS];         /* raw gadget endpoint handles */
+static int unplugcount = 0;           /* 0: stay */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t triggered = PTHREAD_COND_INITIALIZER;
+static int pending = 0;               /* requested spectra */
+static int integration_us = 100000;
+
+static int device_descriptor(unsigned char *buf) {
+    struct usb_device_descriptor d = {
+        .bLength = USB_DT_DEVICE_SIZE,
+        .bDescriptorType = USB_DT_DEVICE,
+        .bDeviceClass = 0xff,
+        .bMaxPacketSize0 = 64,
+        .bNumConfigurations = 1,
+    };
+    d.bcdUSB = htole16(0x0200);
+    d.idVendor = htole16(VENDOR_ID);
+    d.idProduct = htole16(PRODUCT_ID);
+    d.bcdDevice = htole16(0x0100);
+    memcpy(buf, &d, USB_DT_DEVICE_SIZE);
+    return USB_DT_DEVICE_SIZE;
+}
+
+/* configuration, interface and endpoint descriptors in one block */
+static int config_descriptor(unsigned char *buf) {
+    struct usb_config_descriptor c = {
+        .bLength = USB_DT_CONFIG_SIZE,
+        .bDescriptorType = USB_DT_CONFIG,
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .bmAttributes = USB_CONFIG_ATT_ONE,
+        .bMaxPower = 50,
+    };
+    struct usb_interface_descriptor in = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bNumEndpoints = ENDPOINTS,
+        .bInterfaceClass = 0xff,
+    };
+    struct usb_endpoint_descriptor ep;
+    int i, len = 0;
+
+    len += USB_DT_CONFIG_SIZE;
+    memcpy(buf+len, &in, USB_DT_INTERFACE_SIZE);
+    len += USB_DT_INTERFACE_SIZE;
+    for (i=0; i<ENDPOINTS; i++) {
+        memset(&ep, 0, sizeof(ep));
+        ep.bLength = USB_DT_ENDPOINT_SIZE;
+        ep.bDescriptorType = USB_DT_ENDPOINT;
+        ep.bEndpointAddress = epaddr[i];
+        ep.bmAttributes = USB_ENDPOINT_XFER_BULK;
+        ep.wMaxPacketSize = htole16(PACKET);
+        memcpy(buf+len, &ep, USB_DT_ENDPOINT_SIZE);
+        len += USB_DT_ENDPOINT_SIZE;
+    }
+    c.wTotalLength = htole16(len);
+    memcpy(buf, &c, USB_DT_CONFIG_SIZE);
+    return len;
+}
+
+/* transfers on an endpoint; the raw gadget wants the data behind a header */
+struct transfer {
+    struct usb_raw_ep_io io;
+    unsigned char data[SPECTRUM_LEN];
+};
+
+static int ep_write(int ep, const void *data, int len) {
+    struct transfer t;
+    t.io.ep = ep; t.io.flags = 0; t.io.length = len;
+    memcpy(t.data, data, len);
+    return ioctl(fd, ep == -1 ? USB_RAW_IOCTL_EP0_WRITE : USB_RAW_IOCTL_EP_WRITE,
+                 &t);
+}
+
+static int ep_read(int ep, void *data, int len) {
+    struct transfer t;
+    int n;
+    t.io.ep = ep; t.io.flags = 0; t.io.length = len;
+    n = ioctl(fd, ep == -1 ? USB_RAW_IOCTL_EP0_READ : USB_RAW_IOCTL_EP_READ,
+              &t);
+    if (n > 0 && data) memcpy(data, t.data, n);
+    return n;
+}
+
+/* sends the spectra which were asked for */
+static void *spectrum_thread(void *arg) {
+    unsigned char buf[SPECTRUM_LEN];
+    uint16_t pixel;
+    unsigned int n, i;
+
+    for (n=0; ; n++) {
+        pthread_mutex_lock(&lock);
+        while (!pending) pthread_cond_wait(&triggered, &lock);
+        pending--;
+        pthread_mutex_unlock(&lock);
+        usleep(integration_us);
+
+        for (i=0; i<PIXELS; i++) {
+            if (i == 0) pixel = n & 0xffff;
+            else if (i == 1) pixel = n >> 16;
+            else pixel = (7*i + n) & 0x3fff;
+            buf[2*i] = pixel & 0xff;
+            buf[2*i+1] = pixel >> 8;
+        }
+        buf[SPECTRUM_LEN-1] = SYNC_BYTE;
+        if (ep_write(handle[EP_SPECTRUM], buf, SPECTRUM_LEN) < 0) {
+            perror("spectrum");
+            exit(1);
+        }
+        if (unplugcount && n+1 == (unsigned int)unplugcount) {
+            fprintf(stderr, "usb2000_gadget: unplugged after %u spectra\n",
+                    n+1);
+            exit(0); /* closing the raw gadget leaves the bus */
+        }
+    }
+    return NULL;
+}
+
+/* executes the commands from EP1 out */
+static void *command_thread(void *arg) {
+    unsigned char cmd[64], reply[18];
+    int n;
+
+    while ((n = ep_read(handle[EP_CMD], cmd, sizeof(cmd))) > 0) {
+        memset(reply, 0, sizeof(reply));
+        switch (cmd[0]) {
+            case 0x01: /* InitializeUSB2000 */
+                break;
+            case 0x02: /* SetIntegrationTime, in us for the USB2000+ */
+                if (n >= 5)
+                    integration_us = cmd[1] | cmd[2]<<8 | cmd[3]<<16 |
+                        cmd[4]<<24;
+                break;
+            case 0x05: /* QueryInformation */
+                reply[0] = 0x05; reply[1] = n > 1 ? cmd[1] : 0;
+                if (reply[1] == 0) {
+                    strcpy((char *)reply+2, SERIAL);
+                } else if (reply[1] <= 4) {
+                    strcpy((char *)reply+2, coeff[reply[1]-1]);
+                }
+                ep_write(handle[EP_REPLY], reply, 18);
+                break;
+            case 0xfe: /* QueryStatus */
+                reply[0] = PIXELS & 0xff; reply[1] = PIXELS >> 8;
+                ep_write(handle[EP_REPLY], reply, 16);
+                break;
+            case 0x09: /* RequestSpectra */
+                pthread_mutex_lock(&lock);
+                pending++;
+                pthread_cond_signal(&triggered);
+                pthread_mutex_unlock(&lock);
+                break;
+        }
+    }
+    perror("command");
+    exit(1);
+}
+
+/* enables the endpoints and starts serving them */
+static int configure(void) {
+    unsigned char buf[64];
+    struct usb_endpoint_descriptor *ep;
+    pthread_t thread;
+    int i;
+
+    config_descriptor(buf);
+    for (i=0; i<ENDPOINTS; i++) {
+        ep = (struct usb_endpoint_descriptor *)
+            (buf + USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE +
+             i*USB_DT_ENDPOINT_SIZE);
+        handle[i] = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, ep);
+        if (handle[i] < 0) {
+            fprintf(stderr, "usb2000_gadget: the UDC has no endpoint 0x%02x\n",
+                    epaddr[i]);
+            return -1;
+        }
+    }
+    if (ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, 100) < 0 ||
+        ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) return -1;
+    if (pthread_create(&thread, NULL, command_thread, NULL) ||
+        pthread_create(&thread, NULL, spectrum_thread, NULL)) return -1;
+    return 0;
+}
+
+/* answers a request on ep0; returns -1 if it has to be stalled */
+static int control(struct usb_ctrlrequest *req) {
+    unsigned char buf[256];
+    int len = -1, wanted = le16toh(req->wLength);
+    static int configured = 0;
+
+    if ((req->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) return -1;
+    switch (req->bRequest) {
+        case USB_REQ_GET_DESCRIPTOR:
+            switch (le16toh(req->wValue) >> 8) {
+                case USB_DT_DEVICE:
+                    len = device_descriptor(buf);
+                    break;
+                case USB_DT_CONFIG:
+                    len = config_descriptor(buf);
+                    break;
+                default: /* no strings, no other speed */
+                    return -1;
+            }
+            return ep_write(-1, buf, len < wanted ? len : wanted) < 0 ? -1 : 0;
+        case USB_REQ_SET_CONFIGURATION:
+            if (!configured && le16toh(req->wValue) == 1) {
+                if (configure()) return -1;
+                configured = 1;
+            }
+            return ep_read(-1, NULL, 0) < 0 ? -1 : 0;
+        case USB_REQ_SET_INTERFACE:
+            return ep_read(-1, NULL, 0) < 0 ? -1 : 0;
+        case USB_REQ_GET_INTERFACE:
+        case USB_REQ_GET_CONFIGURATION:
+            buf[0] = req->bRequest == USB_REQ_GET_CONFIGURATION ? configured : 0;
+            return ep_write(-1, buf, 1) < 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    struct usb_raw_init init;
+    struct {
+        struct usb_raw_event event;
+        unsigned char data[sizeof(struct usb_ctrlrequest)];
+    } ev;
+    char *driver = "dummy_udc", *udc = "dummy_udc.0";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:d:c:")) != EOF) {
+        switch (opt) {
+            case 'u': unplugcount = atoi(optarg); break;
+            case 'd': driver = optarg; break;
+            case 'c': udc = optarg; break;
+        }
+    }
+
+    fd = open("/dev/raw-gadget", O_RDWR);
+    if (fd < 0) {
+        perror("/dev/raw-gadget");
+        return 1;
+    }
+    memset(&init, 0, sizeof(init));
+    snprintf((char *)init.driver_name, UDC_NAME_LENGTH_MAX, "%s", driver);
+    snprintf((char *)init.device_name, UDC_NAME_LENGTH_MAX, "%s", udc);
+    init.speed = USB_SPEED_HIGH;
+    if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0 ||
+        ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+        perror("raw gadget");
+        return 1;
+    }
+
+    while (1) {
+        ev.event.type = 0;
+        ev.event.length = sizeof(ev.data);
+        if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &ev) < 0) {
+            perror("event");
+            return 1;
+        }
+        if (ev.event.type != USB_RAW_EVENT_CONTROL) continue;
+        if (control((struct usb_ctrlrequest *)ev.event.data))
+            ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+    }
+}
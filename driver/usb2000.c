@@ -30,6 +30,13 @@
            currently made via ioctls, which are described in the usb2000.h file.
 
    STATUS: 26.4.2009 first attempt
+           streaming mode with several queued bulk transfers and a frame
+           ring which is read via read()/poll() or mmap()
+           monotonic timestamps and sequence numbers for every spectrum
+           transfer statistics and a latency histogram in sysfs, in the
+           directory of the USB interface
+           several open files per device; broadcast streaming where every
+           reader has its own cursor into the ring
 
    ToDo: * Implement read/write methods similarly to the proc devices such
            that a read attempt results in a ASCII text spectrum, and write
@@ -47,6 +54,16 @@
 #include <asm/uaccess.h>
 #include <linux/string.h>
 #include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/device.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <asm/io.h>
 
 
 #include "usb2000.h"    /* contains all the ioctls */
@@ -72,9 +89,47 @@ MODULE_LICENSE("GPL");
 /* timeout in milliseconds */
 #define DEFAULT_TIMEOUT 100
 
+/* streaming mode parameters */
+#define SPECTRUM_LEN 4097   /* payload of one spectrum incl. sync byte */
+#define STREAM_URBS 4       /* bulk in transfers kept queued on inpipe1 */
+#define RING_SLOTS SPECTRUM_RING_SLOTS /* spectrum buffers, incl. the ones
+                                          in the URBs */
+#define SLOT_ORDER get_order(SPECTRUM_SLOT_SIZE) /* 2 pages with 4 KiB pages,
+                                                  1 with larger ones */
+#define SLOT_SIZE (PAGE_SIZE << SLOT_ORDER) /* SPECTRUM_SLOT_SIZE or a page */
+#define STREAM_MAX_ERRORS 8 /* failed transfers in a row before giving up */
+
+/* latency histogram of spectrum requests: bucket n counts latencies from
+   2^(n-1) to 2^n - 1 microseconds; the last one collects everything above */
+#define LATENCY_BUCKETS 24
+
+/* transfer statistics; cheap enough to be always on */
+struct transferstats {
+    atomic_long_t commands;        /* command transfers sent to the device */
+    atomic_long_t bytes_received;
+    atomic_long_t timeouts;        /* incl. the ones when emptying the pipe */
+    atomic_long_t short_transfers; /* less data than asked for */
+    atomic_long_t bulk_errors;     /* all other transfer errors */
+    atomic_long_t latency[LATENCY_BUCKETS];
+};
+
+/* the pages of the streaming ring. User mappings keep them alive after the
+   stream has stopped or the device is gone, so they have their own
+   reference count: one for the stream, one per mapping, and one for every
+   reader which is copying a spectrum out. */
+struct spectrum_ring {
+    struct kref ref;
+    atomic_t maps;               /* user mappings */
+    char *slot[RING_SLOTS];      /* DMA capable spectrum buffers, each
+                                    starting with a spectrum_slot_header */
+    struct spectrum_ring_control *ctl; /* one page, mappable by user. The
+                                          driver only writes to it. */
+};
+
 /* local status variables for cards */
 typedef struct cardinfo {
-    int iocard_opened;
+    struct kref ref;   /* USB interface and open files */
+    int iocard_opened; /* number of open files */
     int major;
     int minor;
     struct usb_device *dev;
@@ -90,7 +145,9 @@ typedef struct cardinfo {
     int deviceID;
 
     /* status data */
-    int timeout_value; /* wait for a spectrum request */
+    unsigned int sequence;  /* spectra received since plug-in */
+    struct transferstats stats; /* exported via sysfs */
+    struct mutex iolock; /* serializes commands of the open files */
 
     /* for proper disconnecting behaviour */
     wait_queue_head_t closingqueue; /* for the unload to wait until closed */
@@ -100,8 +157,44 @@ typedef struct cardinfo {
        really not large enough for really justifying a separate kmalloc */
     char returnbuffer[4100];
 
+    /* streaming mode. Every slot is in exactly one of three places: in an
+       URB waiting for data, in the queue waiting for a reader, or in the
+       free list. All of this is protected by ringlock. The queue is kept
+       here and copied to the control page for mmap() users, so nothing
+       user space can see is ever used as an index. */
+    int streaming;
+    struct urb *inurb[STREAM_URBS];
+    int urbslot[STREAM_URBS];    /* slot the URB currently fills */
+    struct urb *triggerurb;
+    unsigned char *triggerbuf;   /* holds the RequestSpectra command byte */
+    ktime_t triggertime;         /* when the last trigger was sent */
+    int trigger_busy, trigger_pending;
+    struct spectrum_ring *ring;
+    unsigned int head, tail;     /* same meaning as in the control page */
+    unsigned int dropped;
+    int queue[RING_SLOTS];       /* slot indices in ring order */
+    int freelist[RING_SLOTS];    /* stack of unused slot indices */
+    int free_count;
+    int broadcast;               /* stream is shared by several readers */
+    int members;                 /* readers of the broadcast stream */
+    struct file *streamowner;    /* the reader of a non-broadcast stream */
+    int stream_errors;           /* failed transfers in a row */
+    int stream_failed;           /* error which stopped the transfers */
+    spinlock_t ringlock;
+    wait_queue_head_t readqueue; /* readers waiting for a spectrum */
+
 } cdi;
 
+/* per open file */
+struct readerinfo {
+    struct cardinfo *cp;
+    int timeout_value; /* wait for a spectrum request */
+    struct spectrum_frame_info lastframe; /* last delivered spectrum */
+    int broadcast;          /* member of the broadcast stream */
+    unsigned int cursor;    /* next spectrum to read, counts like ctl->head */
+    unsigned int dropped;   /* broadcast spectra this reader has lost */
+};
+
 static struct cardinfo *cif=NULL; /* no device registered */
 
 /* search cardlists for a particular minor number */
@@ -112,27 +205,399 @@ static struct cardinfo *search_cardlist(int index) {
 }
 
 
+/* bookkeeping of the transfer statistics */
+static void count_transfer(struct cardinfo *cp, int err, int wanted, int got) {
+    if (err == -ETIMEDOUT) {
+        atomic_long_inc(&cp->stats.timeouts);
+    } else if (err) {
+        atomic_long_inc(&cp->stats.bulk_errors);
+    } else if (got < wanted) {
+        atomic_long_inc(&cp->stats.short_transfers);
+    }
+    atomic_long_add(got, &cp->stats.bytes_received);
+}
+static void count_latency(struct cardinfo *cp, ktime_t start) {
+    s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+    int bucket = us > 0 ? fls64(us) : 0;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS-1;
+    atomic_long_inc(&cp->stats.latency[bucket]);
+}
+
+/* wrapper for synchronous transfers which keeps the statistics */
+static int counted_bulk_msg(struct cardinfo *cp, unsigned int pipe,
+                            void *data, int len, int *atrf, int timeout) {
+    int err;
+    *atrf = 0;
+    err = usb_bulk_msg(cp->dev, pipe, data, len, atrf, timeout);
+    if (pipe == cp->outpipe1) {
+        if (err) count_transfer(cp, err, 0, 0);
+        else atomic_long_inc(&cp->stats.commands);
+    } else {
+        count_transfer(cp, err, len, *atrf);
+    }
+    return err;
+}
+
+/* copies the queue state to the control page of the ring; the slot indices
+   go there as they are queued. head goes last with release semantics, so a
+   user who reads it with acquire semantics also sees the slot headers and
+   queue entries up to there. Needs the ringlock. */
+static void ring_publish(struct cardinfo *cp) {
+    struct spectrum_ring_control *ctl = cp->ring->ctl;
+    ctl->tail = cp->tail;
+    ctl->dropped = cp->dropped;
+    smp_store_release(&ctl->head, cp->head);
+}
+
+/* streaming mode helpers. The device integrates one spectrum at a time, so
+   only one trigger is in flight; the next one is sent as soon as a spectrum
+   has arrived. These get called with the ringlock held. */
+
+/* no more spectra will come; readers get EIO and POLLERR */
+static void stream_fail(struct cardinfo *cp, int err) {
+    if (!cp->stream_failed)
+        printk("%s: stream stopped after error %d\n", USBDEV_NAME, err);
+    cp->stream_failed = err;
+    wake_up_interruptible(&cp->readqueue);
+}
+
+static void stream_trigger(struct cardinfo *cp) {
+    int err;
+
+    if (cp->stream_failed) return;
+    if (cp->trigger_busy) {
+        cp->trigger_pending = 1;
+        return;
+    }
+    cp->trigger_busy = 1;
+    cp->triggertime = ktime_get();
+    err = usb_submit_urb(cp->triggerurb, GFP_ATOMIC);
+    if (err) {
+        cp->trigger_busy = 0;
+        stream_fail(cp, err);
+    }
+}
+
+static void stream_trigger_complete(struct urb *urb) {
+    struct cardinfo *cp = (struct cardinfo *)urb->context;
+    unsigned long flags;
+
+    switch (urb->status) {
+        case 0:
+            atomic_long_inc(&cp->stats.commands);
+            break;
+        case -ENOENT: case -ECONNRESET: case -ESHUTDOWN: /* unlinked */
+            return;
+        default:
+            count_transfer(cp, urb->status, 0, 0);
+            break;
+    }
+
+    spin_lock_irqsave(&cp->ringlock, flags);
+    cp->trigger_busy = 0;
+    if (cp->streaming && urb->status) {
+        /* without a trigger, no spectrum comes; send it again, but not
+           forever */
+        if (++cp->stream_errors > STREAM_MAX_ERRORS)
+            stream_fail(cp, urb->status);
+        else
+            stream_trigger(cp);
+    } else if (cp->trigger_pending && cp->streaming) {
+        cp->trigger_pending = 0;
+        stream_trigger(cp);
+    }
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+}
+
+static void stream_in_complete(struct urb *urb) {
+    struct cardinfo *cp = (struct cardinfo *)urb->context;
+    unsigned long flags;
+    int i, s;
+    struct spectrum_slot_header *hdr;
+    int err;
+
+    switch (urb->status) {
+        case 0:
+            count_transfer(cp, 0, SPECTRUM_LEN, urb->actual_length);
+            count_latency(cp, cp->triggertime);
+            break;
+        case -ENOENT: case -ECONNRESET: case -ESHUTDOWN: /* unlinked */
+            return;
+        default: /* babble or transfer error; the spectrum is not queued,
+                    and the URB goes out again with the same slot */
+            count_transfer(cp, urb->status, SPECTRUM_LEN, urb->actual_length);
+            break;
+    }
+
+    for (i=0; i<STREAM_URBS; i++) if (cp->inurb[i]==urb) break;
+    if (i==STREAM_URBS) return; /* should not happen */
+
+    spin_lock_irqsave(&cp->ringlock, flags);
+    if (!cp->streaming || cp->stream_failed) {
+        spin_unlock_irqrestore(&cp->ringlock, flags);
+        return;
+    }
+    if (urb->status) {
+        /* a device which keeps failing is gone or in trouble. Stop
+           resubmitting, and let the readers know. */
+        if (++cp->stream_errors > STREAM_MAX_ERRORS) {
+            stream_fail(cp, urb->status);
+            spin_unlock_irqrestore(&cp->ringlock, flags);
+            return;
+        }
+    } else {
+        cp->stream_errors = 0;
+    }
+    s = cp->urbslot[i];
+    if (urb->status == 0 && urb->actual_length == SPECTRUM_LEN) {
+        if (!cp->free_count && cp->broadcast) {
+            /* readers don't hold up the device: recycle the oldest one */
+            cp->freelist[cp->free_count++] = cp->queue[cp->tail % RING_SLOTS];
+            cp->tail++;
+        }
+        if (cp->free_count) {
+            /* hand the spectrum to the readers, take a fresh slot */
+            hdr = (struct spectrum_slot_header *)cp->ring->slot[s];
+            hdr->sequence = cp->sequence;
+            hdr->length = urb->actual_length;
+            hdr->status = urb->status;
+            hdr->timestamp = ktime_to_ns(ktime_get());
+            cp->queue[cp->head % RING_SLOTS] = s;
+            cp->ring->ctl->queue[cp->head % RING_SLOTS] = s;
+            cp->head++;
+            s = cp->freelist[--cp->free_count];
+            cp->urbslot[i] = s;
+            urb->transfer_buffer = cp->ring->slot[s] + SPECTRUM_SLOT_DATA;
+            wake_up_interruptible(&cp->readqueue);
+        } else {
+            /* ring full; nobody reads. Overwrite this spectrum. */
+            cp->dropped++;
+        }
+        cp->sequence++;
+        ring_publish(cp);
+    }
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    if (err) stream_fail(cp, err); /* this slot would never be filled */
+    else stream_trigger(cp);
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+}
+
+static void ring_release(struct kref *ref) {
+    struct spectrum_ring *ring = container_of(ref, struct spectrum_ring, ref);
+    int i;
+    for (i=0; i<RING_SLOTS; i++)
+        if (ring->slot[i]) free_pages((unsigned long)ring->slot[i], SLOT_ORDER);
+    if (ring->ctl) free_page((unsigned long)ring->ctl);
+    kfree(ring);
+}
+static void ring_put(struct spectrum_ring *ring) {
+    kref_put(&ring->ref, ring_release);
+}
+
+/* give back all streaming resources; needs the in-URBs to be dead. The ring
+   pages stay until the last mapping is gone. */
+static void stream_free(struct cardinfo *cp) {
+    struct spectrum_ring *ring;
+    unsigned long flags;
+    int i;
+    for (i=0; i<STREAM_URBS; i++) {
+        usb_free_urb(cp->inurb[i]); cp->inurb[i] = NULL;
+    }
+    usb_free_urb(cp->triggerurb); cp->triggerurb = NULL;
+    kfree(cp->triggerbuf); cp->triggerbuf = NULL;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    ring = cp->ring;
+    cp->ring = NULL;
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    if (ring) ring_put(ring);
+    cp->broadcast = 0;
+    cp->members = 0;
+    cp->streamowner = NULL;
+}
+
+/* returns a number of consumed slots from the queue to the free list */
+static int stream_release(struct cardinfo *cp, unsigned int n) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&cp->ringlock, flags);
+    if (!cp->streaming || n > cp->head - cp->tail) {
+        spin_unlock_irqrestore(&cp->ringlock, flags);
+        return -EINVAL;
+    }
+    for (; n; n--) {
+        cp->freelist[cp->free_count++] = cp->queue[cp->tail % RING_SLOTS];
+        cp->tail++;
+    }
+    ring_publish(cp);
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    return 0;
+}
+
+static void stream_stop(struct cardinfo *cp) {
+    unsigned long flags;
+    int i;
+
+    if (!cp->streaming) return;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    cp->streaming = 0;
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+
+    for (i=0; i<STREAM_URBS; i++) usb_kill_urb(cp->inurb[i]);
+    usb_kill_urb(cp->triggerurb);
+    wake_up_interruptible(&cp->readqueue); /* let readers see the stop */
+    stream_free(cp);
+}
+
+static int stream_start(struct cardinfo *cp, int broadcast) {
+    struct spectrum_ring *ring;
+    unsigned long flags;
+    int i, err;
+
+    BUILD_BUG_ON(SPECTRUM_SLOT_DATA + SPECTRUM_LEN > SPECTRUM_SLOT_SIZE);
+    BUILD_BUG_ON(sizeof(struct spectrum_ring_control) > PAGE_SIZE);
+
+    if (cp->streaming) return -EBUSY;
+    cp->broadcast = broadcast;
+    cp->head = 0; cp->tail = 0; cp->dropped = 0;
+    cp->stream_errors = 0; cp->stream_failed = 0;
+
+    /* get buffers and URBs */
+    ring = kzalloc(sizeof(struct spectrum_ring), GFP_KERNEL);
+    if (!ring) return -ENOMEM;
+    kref_init(&ring->ref);
+    atomic_set(&ring->maps, 0);
+    cp->ring = ring;
+    for (i=0; i<RING_SLOTS; i++) {
+        ring->slot[i] = (char *)__get_free_pages(GFP_KERNEL, SLOT_ORDER);
+        if (!ring->slot[i]) goto nomem;
+        memset(ring->slot[i], 0, SPECTRUM_SLOT_DATA);
+    }
+    ring->ctl = (struct spectrum_ring_control *)get_zeroed_page(GFP_KERNEL);
+    if (!ring->ctl) goto nomem;
+    ring->ctl->slots = RING_SLOTS;
+    ring->ctl->slotsize = SLOT_SIZE;
+    for (i=0; i<STREAM_URBS; i++) {
+        cp->inurb[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!cp->inurb[i]) goto nomem;
+    }
+    cp->triggerurb = usb_alloc_urb(0, GFP_KERNEL);
+    cp->triggerbuf = kmalloc(1, GFP_KERNEL);
+    if (!cp->triggerurb || !cp->triggerbuf) goto nomem;
+
+    /* the first STREAM_URBS slots go into the URBs, the rest is free */
+    for (i=0; i<STREAM_URBS; i++) {
+        cp->urbslot[i] = i;
+        usb_fill_bulk_urb(cp->inurb[i], cp->dev, cp->inpipe1,
+                          ring->slot[i] + SPECTRUM_SLOT_DATA,
+                          SPECTRUM_LEN, stream_in_complete, cp);
+    }
+    cp->free_count = 0;
+    for (i=RING_SLOTS-1; i>=STREAM_URBS; i--) cp->freelist[cp->free_count++]=i;
+
+    cp->triggerbuf[0] = RequestSpectra & 0xff;
+    usb_fill_bulk_urb(cp->triggerurb, cp->dev, cp->outpipe1, cp->triggerbuf,
+                      1, stream_trigger_complete, cp);
+    cp->trigger_busy = 0; cp->trigger_pending = 0;
+
+    cp->streaming = 1;
+    for (i=0; i<STREAM_URBS; i++) {
+        err = usb_submit_urb(cp->inurb[i], GFP_KERNEL);
+        if (err) {
+            printk("%s: cannot submit stream urb, err: %d\n",
+                   USBDEV_NAME, err);
+            stream_stop(cp);
+            return -EIO;
+        }
+    }
+    spin_lock_irqsave(&cp->ringlock, flags);
+    stream_trigger(cp);
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    return 0;
+
+ nomem:
+    stream_free(cp);
+    return -ENOMEM;
+}
+
+/* entering and leaving the broadcast stream; called with the iolock held */
+static int stream_join(struct cardinfo *cp, struct readerinfo *rd) {
+    unsigned long flags;
+    int err;
+
+    if (rd->broadcast) return 0;
+    if (cp->streaming && !cp->broadcast) return -EBUSY;
+    if (!cp->streaming) {
+        err = stream_start(cp, 1);
+        if (err) return err;
+    }
+    spin_lock_irqsave(&cp->ringlock, flags);
+    rd->cursor = cp->head; /* no old spectra for newcomers */
+    rd->dropped = 0;
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    rd->broadcast = 1;
+    cp->members++;
+    return 0;
+}
+
+static void stream_leave(struct cardinfo *cp, struct readerinfo *rd) {
+    if (!rd->broadcast) return;
+    rd->broadcast = 0;
+    if (!--cp->members) stream_stop(cp);
+}
+
+/* a reader which the ring has overtaken has lost the recycled spectra.
+   Needs the ringlock. */
+static void reader_catch_up(struct cardinfo *cp, struct readerinfo *rd) {
+    if ((int)(cp->tail - rd->cursor) > 0) {
+        rd->dropped += cp->tail - rd->cursor;
+        rd->cursor = cp->tail;
+    }
+}
+
+/* the card data goes when the device is gone and the last file is closed */
+static void cardinfo_release(struct kref *ref) {
+    kfree(container_of(ref, struct cardinfo, ref));
+}
+
 /* minor device 0 (simple access) structures */
 static int usbdev_flat_open(struct inode *inode, struct file *filp) {
     struct cardinfo *cp;
+    struct readerinfo *rd;
 
     cp= search_cardlist(iminor(inode));
     if (!cp) return -ENODEV;
-    if (cp->iocard_opened)
-        return -EBUSY;
-    cp->iocard_opened = 1;
-    filp->private_data = (void *)cp; /* store card info in file structure */
+
+    /* several files may be open; each has its own settings and cursor */
+    rd = (struct readerinfo *)kmalloc(sizeof(struct readerinfo), GFP_KERNEL);
+    if (!rd) return -ENOMEM;
+    rd->cp = cp;
+    rd->timeout_value = DEFAULT_TIMEOUT;
+    memset(&rd->lastframe, 0, sizeof(rd->lastframe));
+    rd->broadcast = 0;
+    rd->cursor = 0; rd->dropped = 0;
+    filp->private_data = (void *)rd; /* store reader in file structure */
 
     /* USB device is presumably in correct alternate mode, so no action */
 
-    cp->timeout_value = DEFAULT_TIMEOUT;
-   
+    kref_get(&cp->ref);
+    mutex_lock(&cp->iolock);
+    cp->iocard_opened++;
+    mutex_unlock(&cp->iolock);
     return 0;
 }
 static int usbdev_flat_close(struct inode *inode, struct file *filp) {
-    struct cardinfo *cp = (struct cardinfo *)filp->private_data;
- 
-    cp->iocard_opened = 0;
+    struct readerinfo *rd = (struct readerinfo *)filp->private_data;
+    struct cardinfo *cp = rd->cp;
+
+    mutex_lock(&cp->iolock);
+    if (rd->broadcast) {
+        stream_leave(cp, rd);
+    } else if (cp->streamowner == filp) {
+        stream_stop(cp);
+    }
+    cp->iocard_opened--;
+    mutex_unlock(&cp->iolock);
+    kfree(rd);
 
     /* eventually tell the unloader that we are about to close */
     cp->reallygone=0;
@@ -140,6 +605,7 @@ static int usbdev_flat_close(struct inode *inode, struct file *filp) {
     /* don't know if this is necessary but just to make sure that we have
        really left this call */
     cp->reallygone=1;
+    kref_put(&cp->ref, cardinfo_release);
     return 0;
 }
 /* here goes the old version of ioctl, and gets replaced with the new one..
@@ -147,13 +613,17 @@ old definition:
 
 static int usbdev_flat_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
 */
-static int usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    struct cardinfo *cp = (struct cardinfo *)filp->private_data;
+static int usbdev_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct readerinfo *rd = (struct readerinfo *)filp->private_data;
+    struct cardinfo *cp = rd->cp;
     unsigned char data[6]; /* send stuff */
     unsigned char len=1;
     int err;
     int atrf; /* actually transferred data */
     char *argp = NULL;
+    ktime_t start; /* for the latency statistics */
+    unsigned long flags;
+    unsigned int dropped;
        
     if (!cp->dev) return -ENODEV;
 
@@ -176,12 +646,48 @@ static int usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long
             break;
         case SetTimeout: /* internal command: set timeout */
             if (arg>0 && arg<100000) {
-                cp->timeout_value = arg;
+                rd->timeout_value = arg;
                 return 0;
             } else {
                 return -EINVAL;
             }
             break;
+        case StartStreaming: /* internal commands for streaming mode */
+            err = stream_start(cp, 0);
+            if (!err) cp->streamowner = filp;
+            return err;
+        case StartBroadcast:
+            return stream_join(cp, rd);
+        case StopStreaming:
+            if (rd->broadcast) {
+                stream_leave(cp, rd);
+                return 0;
+            }
+            if (cp->streaming && cp->streamowner != filp) return -EBUSY;
+            if (cp->streaming && atomic_read(&cp->ring->maps))
+                return -EBUSY; /* ring is still mapped */
+            stream_stop(cp);
+            return 0;
+        case GetDroppedFrames:
+            if (rd->broadcast) {
+                spin_lock_irqsave(&cp->ringlock, flags);
+                reader_catch_up(cp, rd);
+                dropped = rd->dropped;
+                spin_unlock_irqrestore(&cp->ringlock, flags);
+            } else if (cp->streaming && cp->streamowner == filp) {
+                dropped = cp->dropped;
+            } else {
+                return -EINVAL;
+            }
+            if (copy_to_user(argp, &dropped, sizeof(int))) return -EFAULT;
+            return 0;
+        case ReleaseSpectra: /* slots consumed via mmap */
+            if (cp->streamowner != filp) return -EINVAL;
+            return stream_release(cp, arg);
+        case RequestSpectra: case EmptyPipe: case TriggerPacket:
+            /* the stream owns the spectrum pipe */
+            if (cp->streaming) return -EBUSY;
+            break;
     }
 
     switch (cmd) {
@@ -209,8 +715,9 @@ static int usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long
         case ReadPCBTemperature:/* not confirmed yet */
         case TriggerPacket:     /* confirmed to work */
             data[0]=cmd & 0xff;
+            start=ktime_get();
             /* just send the last significant byte to the device */
-            err=usb_bulk_msg(cp->dev, cp->outpipe1, data, len, &atrf, 100);
+            err=counted_bulk_msg(cp, cp->outpipe1, data, len, &atrf, 100);
             if (err) {
               printk("error in sending cmd 0x%x; err: %d", cmd, err);
                 return -EFAULT;
@@ -220,6 +727,7 @@ static int usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long
            to the USB device. This is to trap illegal ioctls. */
         case EmptyPipe:     /* confirmed to work */
         case GetDeviceID:
+        case GetFrameInfo:
             break;
 
         default:
@@ -229,47 +737,310 @@ static int usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long
     /* continue processing the commands which receive return data */
     switch (cmd) {
         case QueryInformation:    /* confirmed to work */
-            usb_bulk_msg(cp->dev,cp->inpipe2, cp->returnbuffer, 18, &atrf, 100);
+            counted_bulk_msg(cp, cp->inpipe2, cp->returnbuffer, 18, &atrf, 100);
             if (copy_to_user(argp, cp->returnbuffer, 18)) return -EFAULT;
             break;
         case QueryStatus:         /* partly confirmed */
-            usb_bulk_msg(cp->dev,cp->inpipe2, cp->returnbuffer, 16, &atrf, 100);
+            counted_bulk_msg(cp, cp->inpipe2, cp->returnbuffer, 16, &atrf, 100);
             if (copy_to_user(argp, cp->returnbuffer, 16)) return -EFAULT;
             break;
 
         /* commands wich return 3 bytes */
         case ReadRegister:        /* not confirmed yet */  
         case ReadPCBTemperature:  /* not confirmed yet, something comes back */
-            err=usb_bulk_msg(cp->dev,cp->inpipe2, cp->returnbuffer, 3, &atrf, 1000);
+            err=counted_bulk_msg(cp, cp->inpipe2, cp->returnbuffer, 3, &atrf,
+                                 1000);
             if (copy_to_user(argp, cp->returnbuffer, 3)) return -EFAULT;
             break;
 
         /* commands which return 4097 bytes into user mem */
         case RequestSpectra:      /* confirmed to work */
         case EmptyPipe:           /* confirmed to work */
-            err=usb_bulk_msg(cp->dev,cp->inpipe1, cp->returnbuffer,
-                             4097, &atrf, cp->timeout_value);      
+            err=counted_bulk_msg(cp, cp->inpipe1, cp->returnbuffer,
+                                 4097, &atrf, rd->timeout_value);
             if (err) return -err; /* are there better options ? */
+            if (cmd == RequestSpectra) count_latency(cp, start);
+            rd->lastframe.timestamp = ktime_to_ns(ktime_get());
+            rd->lastframe.sequence = cp->sequence++;
             if (copy_to_user(argp, cp->returnbuffer, 4097)) return -EFAULT;
             break;
         /* commands which do not involve a USB interaction */
         case GetDeviceID:
             if (copy_to_user(argp, &cp->deviceID, sizeof(int))) return -EFAULT;
             break;
+        case GetFrameInfo:
+            if (copy_to_user(argp, &rd->lastframe, sizeof(rd->lastframe)))
+                return -EFAULT;
+            break;
     }
 
     return 0; /* went ok... */
 }
 
+/* the files of a device share its pipes and the return buffer, so only one
+   command is processed at a time */
+static long usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct cardinfo *cp = ((struct readerinfo *)filp->private_data)->cp;
+    int err;
+
+    if (mutex_lock_interruptible(&cp->iolock)) return -ERESTARTSYS;
+    err = usbdev_do_ioctl(filp, cmd, arg);
+    mutex_unlock(&cp->iolock);
+    return err;
+}
+
+/* read from the broadcast stream. The slot can get recycled by the device
+   while we copy it, so the cursor is checked again afterwards and the copy
+   is repeated with the next spectrum if it got overwritten. The reference
+   keeps the ring alive if the stream stops meanwhile. */
+static ssize_t broadcast_read(struct file *filp, char __user *buf,
+                              size_t count) {
+    struct readerinfo *rd = (struct readerinfo *)filp->private_data;
+    struct cardinfo *cp = rd->cp;
+    struct spectrum_ring *ring;
+    unsigned long flags;
+    struct spectrum_slot_header hdr;
+    int s, err;
+
+    if (count < SPECTRUM_LEN) return -EINVAL;
+
+    spin_lock_irqsave(&cp->ringlock, flags);
+    while (1) {
+        if (!cp->streaming) {
+            spin_unlock_irqrestore(&cp->ringlock, flags);
+            return -EINVAL;
+        }
+        reader_catch_up(cp, rd);
+        if (rd->cursor == cp->head) {
+            spin_unlock_irqrestore(&cp->ringlock, flags);
+            if (cp->stream_failed) return -EIO;
+            if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+            if (wait_event_interruptible(cp->readqueue, !cp->streaming ||
+                                         cp->stream_failed ||
+                                         rd->cursor != cp->head))
+                return -ERESTARTSYS;
+            spin_lock_irqsave(&cp->ringlock, flags);
+            continue;
+        }
+        s = cp->queue[rd->cursor % RING_SLOTS];
+        ring = cp->ring;
+        kref_get(&ring->ref);
+        spin_unlock_irqrestore(&cp->ringlock, flags);
+
+        hdr = *(struct spectrum_slot_header *)ring->slot[s];
+        err = copy_to_user(buf, ring->slot[s] + SPECTRUM_SLOT_DATA,
+                           SPECTRUM_LEN);
+
+        spin_lock_irqsave(&cp->ringlock, flags);
+        if (err || cp->ring != ring) {
+            spin_unlock_irqrestore(&cp->ringlock, flags);
+            ring_put(ring);
+            return err ? -EFAULT : -EINVAL;
+        }
+        ring_put(ring); /* the stream still holds it */
+        if ((int)(cp->tail - rd->cursor) <= 0) break; /* still valid */
+    }
+    rd->cursor++;
+    rd->lastframe.sequence = hdr.sequence;
+    rd->lastframe.timestamp = hdr.timestamp;
+    rd->lastframe.dropped = rd->dropped;
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    return SPECTRUM_LEN;
+}
+
+/* read method for streaming mode: returns one spectrum per call */
+static ssize_t usbdev_flat_read(struct file *filp, char __user *buf,
+                                size_t count, loff_t *ppos) {
+    struct readerinfo *rd = (struct readerinfo *)filp->private_data;
+    struct cardinfo *cp = rd->cp;
+    struct spectrum_ring *ring;
+    unsigned long flags;
+    int s;
+    struct spectrum_slot_header *hdr;
+
+    if (!cp->dev) return -ENODEV;
+    if (rd->broadcast) return broadcast_read(filp, buf, count);
+    if (!cp->streaming || cp->streamowner != filp) return -EINVAL;
+    if (count < SPECTRUM_LEN) return -EINVAL;
+
+    spin_lock_irqsave(&cp->ringlock, flags);
+    while (cp->streaming && cp->head == cp->tail) {
+        spin_unlock_irqrestore(&cp->ringlock, flags);
+        if (cp->stream_failed) return -EIO;
+        if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+        if (wait_event_interruptible(cp->readqueue, !cp->streaming ||
+                                     cp->stream_failed ||
+                                     cp->head != cp->tail))
+            return -ERESTARTSYS;
+        spin_lock_irqsave(&cp->ringlock, flags);
+    }
+    if (!cp->streaming) {
+        spin_unlock_irqrestore(&cp->ringlock, flags);
+        return -EINVAL;
+    }
+    s = cp->queue[cp->tail % RING_SLOTS];
+    ring = cp->ring;
+    kref_get(&ring->ref);
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+
+    /* the oldest queued slot does not get touched by the URBs; only full
+       spectra get queued */
+    hdr = (struct spectrum_slot_header *)ring->slot[s];
+    if (copy_to_user(buf, ring->slot[s] + SPECTRUM_SLOT_DATA, SPECTRUM_LEN)) {
+        ring_put(ring);
+        return -EFAULT;
+    }
+    rd->lastframe.sequence = hdr->sequence;
+    rd->lastframe.timestamp = hdr->timestamp;
+    rd->lastframe.dropped = cp->dropped;
+    ring_put(ring);
+
+    stream_release(cp, 1);
+    return SPECTRUM_LEN;
+}
+
+static unsigned int usbdev_flat_poll(struct file *filp, poll_table *wait) {
+    struct readerinfo *rd = (struct readerinfo *)filp->private_data;
+    struct cardinfo *cp = rd->cp;
+    unsigned int mask = 0;
+
+    poll_wait(filp, &cp->readqueue, wait);
+    if (rd->broadcast) {
+        if (rd->cursor != cp->head) mask |= POLLIN | POLLRDNORM;
+    } else if (cp->streaming && cp->streamowner == filp &&
+               cp->head != cp->tail) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    if (!cp->dev || (cp->streaming && cp->stream_failed)) mask |= POLLERR;
+    return mask;
+}
+
+/* every mapping holds a reference to the ring, so its pages stay when the
+   stream stops or the device goes away while they are mapped */
+static void usbdev_vma_open(struct vm_area_struct *vma) {
+    struct spectrum_ring *ring = (struct spectrum_ring *)vma->vm_private_data;
+    kref_get(&ring->ref);
+    atomic_inc(&ring->maps);
+}
+static void usbdev_vma_close(struct vm_area_struct *vma) {
+    struct spectrum_ring *ring = (struct spectrum_ring *)vma->vm_private_data;
+    atomic_dec(&ring->maps);
+    ring_put(ring);
+}
+static const struct vm_operations_struct usbdev_vm_ops = {
+    open:  usbdev_vma_open,
+    close: usbdev_vma_close,
+};
+
+/* maps the control page and the spectrum slots of the streaming ring into
+   user space, see usb2000.h for the layout. The mapping is read-only and
+   cannot be made writable later with mprotect(). */
+static int usbdev_flat_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct cardinfo *cp = ((struct readerinfo *)filp->private_data)->cp;
+    struct spectrum_ring *ring = NULL;
+    unsigned long addr = vma->vm_start;
+    unsigned long flags;
+    int i, err;
+
+    if (vma->vm_flags & VM_WRITE) return -EPERM;
+    if (vma->vm_pgoff ||
+        vma->vm_end - vma->vm_start != PAGE_SIZE + RING_SLOTS*SLOT_SIZE)
+        return -EINVAL;
+
+    /* the ring of a broadcast stream gets recycled under the readers */
+    spin_lock_irqsave(&cp->ringlock, flags);
+    if (cp->streaming && cp->streamowner == filp) {
+        ring = cp->ring;
+        kref_get(&ring->ref);
+    }
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    if (!ring) return -EINVAL;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0))
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    err = remap_pfn_range(vma, addr, virt_to_phys(ring->ctl) >> PAGE_SHIFT,
+                          PAGE_SIZE, vma->vm_page_prot);
+    if (err) goto fail;
+    addr += PAGE_SIZE;
+    for (i=0; i<RING_SLOTS; i++) {
+        err = remap_pfn_range(vma, addr,
+                              virt_to_phys(ring->slot[i]) >> PAGE_SHIFT,
+                              SLOT_SIZE, vma->vm_page_prot);
+        if (err) goto fail;
+        addr += SLOT_SIZE;
+    }
+    vma->vm_ops = &usbdev_vm_ops;
+    vma->vm_private_data = ring; /* takes over our reference */
+    atomic_inc(&ring->maps);
+    return 0;
+
+ fail:
+    ring_put(ring);
+    return err;
+}
+
 /* minor device 0 (simple access) file options */
 static struct file_operations usbdev_simple_fops = {
     open:    usbdev_flat_open,
     release: usbdev_flat_close,
+    read:    usbdev_flat_read,
+    poll:    usbdev_flat_poll,
+    mmap:    usbdev_flat_mmap,
     /* new version for ioctl without BKL */
     unlocked_ioctl:   usbdev_flat_ioctl,
 };
 
 
+/* sysfs entries for the transfer statistics */
+static struct cardinfo *dev_to_cardinfo(struct device *dev) {
+    return (struct cardinfo *)usb_get_intfdata(to_usb_interface(dev));
+}
+
+#define STAT_ATTR(field)                                                 \
+static ssize_t field##_show(struct device *dev,                          \
+                            struct device_attribute *attr, char *buf) {  \
+    return sprintf(buf, "%ld\n",                                         \
+                   atomic_long_read(&dev_to_cardinfo(dev)->stats.field)); \
+}                                                                        \
+static DEVICE_ATTR(field, S_IRUGO, field##_show, NULL)
+
+STAT_ATTR(commands);
+STAT_ATTR(bytes_received);
+STAT_ATTR(timeouts);
+STAT_ATTR(short_transfers);
+STAT_ATTR(bulk_errors);
+
+/* one line per bucket: lower and upper limit in us, count */
+static ssize_t latency_histogram_show(struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf) {
+    struct cardinfo *cp = dev_to_cardinfo(dev);
+    int i, n = 0;
+    for (i=0; i<LATENCY_BUCKETS; i++)
+        n += sprintf(buf+n, "%lu %lu %ld\n", i ? 1UL<<(i-1) : 0UL,
+                     i<LATENCY_BUCKETS-1 ? (1UL<<i)-1 : ~0UL,
+                     atomic_long_read(&cp->stats.latency[i]));
+    return n;
+}
+static DEVICE_ATTR(latency_histogram, S_IRUGO, latency_histogram_show, NULL);
+
+static struct attribute *stats_attrs[] = {
+    &dev_attr_commands.attr,
+    &dev_attr_bytes_received.attr,
+    &dev_attr_timeouts.attr,
+    &dev_attr_short_transfers.attr,
+    &dev_attr_bulk_errors.attr,
+    &dev_attr_latency_histogram.attr,
+    NULL,
+};
+static struct attribute_group stats_group = {
+    name:  "statistics",
+    attrs: stats_attrs,
+};
+
 /* static structures for the class  entries for udev */
 static char classname[]="Spectrometer%d";
 
@@ -301,11 +1072,28 @@ static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_i
         return -ENOMEM;
     }
 
+    kref_init(&cp->ref);
+
     /* store device ID in a device variable for later */
     cp->deviceID = id->idProduct;
    
     cp->iocard_opened = 0; /* no open */
 
+    /* no spectra so far */
+    cp->sequence = 0;
+    memset(&cp->stats, 0, sizeof(cp->stats));
+    mutex_init(&cp->iolock);
+
+    /* streaming mode is off initially */
+    cp->streaming = 0;
+    cp->triggerurb = NULL; cp->triggerbuf = NULL;
+    memset(cp->inurb, 0, sizeof(cp->inurb));
+    cp->ring = NULL;
+    cp->broadcast = 0; cp->members = 0;
+    cp->streamowner = NULL;
+    spin_lock_init(&cp->ringlock);
+    init_waitqueue_head(&cp->readqueue);
+
     retval=usb_register_dev(intf, &spectrometerclass);
     if (retval) { /* coul not get minor */
         printk("%s: could not get minor for a device.\n",USBDEV_NAME);
@@ -371,6 +1159,10 @@ static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_i
     cif=cp;/* link into chain */
     usb_set_intfdata(intf, cp); /* save private data */
 
+    /* statistics are nice to have, so don't fail if that does not work */
+    if (sysfs_create_group(&intf->dev.kobj, &stats_group))
+        printk("%s: cannot create statistics in sysfs\n", USBDEV_NAME);
+
     return 0; /* everything is fine */
  out1:
     usb_deregister_dev(intf, &spectrometerclass);
@@ -392,11 +1184,16 @@ static void usbdev_remove_one(struct usb_interface *interface) {
         return;
     }
 
-    /* try to find out if it is running */
+    /* try to find out if it is running. Open files keep the card data
+       until they are closed, but see no device any more. */
+    mutex_lock(&cp->iolock);
     if (cp->iocard_opened) {
         printk("%s: device got unplugged while open. How messy.....\n",
                USBDEV_NAME);
+        stream_stop(cp); /* don't leave URBs pointing to freed memory */
     }
+    cp->dev = NULL;
+    mutex_unlock(&cp->iolock);
 
     /* remove from local device list */
     if (cp->previous) {
@@ -407,11 +1204,11 @@ static void usbdev_remove_one(struct usb_interface *interface) {
     if (cp->next) cp->next->previous = cp->previous;
 
     /* mark interface as dead */
+    sysfs_remove_group(&interface->dev.kobj, &stats_group);
     usb_set_intfdata(interface, NULL);
     usb_deregister_dev(interface, &spectrometerclass);
 
-    kfree(cp); /* give back card data container structure */
-   
+    kref_put(&cp->ref, cardinfo_release); /* give back card data */
 }
 
 /* driver description info for registration; more details?  */
@@ -94,3 +94,85 @@
 
 #define GetDeviceID         _IO(0xab, 0x99) /* retrieve the USB device ID */
 
+
+/* streaming mode: the driver keeps several bulk transfers queued and
+   re-triggers the device by itself. Spectra are then obtained with read()
+   calls on the device file, 4097 bytes per spectrum, and poll()/select() can
+   be used to wait for them. RequestSpectra and EmptyPipe are not available
+   while streaming. If the transfers or the triggers keep failing, or a
+   transfer cannot be sent again, the driver stops them; read() then
+   returns EIO when the queued spectra are used up, and poll() signals
+   POLLERR. */
+#define StartStreaming      _IO(0xab, 0x10)  /* starts continuous acquisition */
+#define StopStreaming       _IO(0xab, 0x11)  /* stops it and discards frames
+                                                which have not been read */
+#define GetDroppedFrames    _IOR(0xab, 0x12, int) /* number of frames lost
+                                                     since StartStreaming
+                                                     because nobody read them
+                                                     in time. Argument is a
+                                                     pointer to int. */
+#define ReleaseSpectra      _IO(0xab, 0x13)  /* hands the given number of
+                                                spectra which were consumed
+                                                in the mmap()ed ring back to
+                                                the driver. Takes the count
+                                                directly as argument. */
+
+/* broadcast streaming: the device file may be opened several times, and all
+   files which called StartBroadcast share one stream. Each of them gets
+   every spectrum through its own read() cursor. Readers never hold up the
+   device; when the ring is full, the oldest spectrum is overwritten, and a
+   reader which had not got it yet loses it. For such a file,
+   GetDroppedFrames and the dropped field of GetFrameInfo count the spectra
+   lost by this file only. StopStreaming or closing the file leaves the
+   broadcast, and the acquisition stops when the last reader has left.
+   mmap() and ReleaseSpectra are only available with StartStreaming, which
+   gives the stream to a single file. */
+#define StartBroadcast      _IO(0xab, 0x15)  /* starts or joins a broadcast
+                                                stream */
+
+/* The spectrum ring of the streaming mode can also be consumed in place with
+   mmap(). The mapping consists of one control page, followed by
+   SPECTRUM_RING_SLOTS slots of slotsize bytes each. slotsize is the larger
+   of SPECTRUM_SLOT_SIZE and the page size (sysconf(_SC_PAGESIZE)), and the
+   control page gives it as well. A slot starts
+   with a spectrum_slot_header; the spectrum itself follows at offset
+   SPECTRUM_SLOT_DATA. Spectra ready for consumption are the slots
+   queue[tail % SPECTRUM_RING_SLOTS] up to queue[(head-1) % SPECTRUM_RING_SLOTS].
+   After processing them, ReleaseSpectra advances tail. poll() signals when
+   head has moved. The driver writes head after the slots and queue entries
+   it covers, so it has to be read with acquire semantics, e.g. with
+   __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE). The mapping has to be
+   read-only and cannot be made writable later. It stays readable until it is unmapped, also when the
+   device is unplugged meanwhile. */
+#define SPECTRUM_RING_SLOTS 16
+#define SPECTRUM_SLOT_SIZE  8192
+#define SPECTRUM_SLOT_DATA  64
+
+struct spectrum_slot_header {
+    unsigned int sequence;  /* device sequence number, see GetFrameInfo */
+    unsigned int length;    /* number of valid bytes in the slot */
+    int status;             /* 0, or the USB error of that transfer */
+    unsigned int reserved;
+    unsigned long long timestamp; /* CLOCK_MONOTONIC in ns at completion */
+};
+
+struct spectrum_ring_control {
+    unsigned int head;      /* number of spectra put into the queue so far */
+    unsigned int tail;      /* number of spectra released so far */
+    unsigned int dropped;   /* same as GetDroppedFrames */
+    unsigned int slots;     /* SPECTRUM_RING_SLOTS */
+    unsigned int slotsize;  /* bytes per slot in the mapping */
+    unsigned int queue[SPECTRUM_RING_SLOTS]; /* slot indices in ring order */
+};
+
+/* every spectrum received from the device gets a sequence number which
+   counts from the plug-in of the device, and a CLOCK_MONOTONIC timestamp
+   taken when its transfer has completed. A gap in the sequence numbers means
+   that spectra were lost. GetFrameInfo returns the values of the spectrum
+   which was delivered last by RequestSpectra, EmptyPipe or read(). */
+struct spectrum_frame_info {
+    unsigned int sequence;
+    unsigned int dropped;   /* spectra lost in streaming mode so far */
+    unsigned long long timestamp; /* in ns */
+};
+#define GetFrameInfo        _IOR(0xab, 0x14, struct spectrum_frame_info)
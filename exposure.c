@@ -0,0 +1,97 @@
+/* exposure.c: automatic integration time.
+
+   Instead of guessing an integration time, spectroread -A sets it such
+   that the brightest part of the spectrum fills a given fraction of the
+   range of the device. The level of a spectrum is the highest median of
+   three neighbouring uncovered pixels, so a single hot pixel does not
+   count, minus the dark level of the covered ones. Since the signal
+   grows with the integration time, the time which gives the target level
+   follows from one spectrum; clipping, dark current and noise make this
+   inexact, so it takes a few spectra to get there:
+
+   - if a pixel is at the full count, the spectrum is saturated and the
+     time is cut to a quarter;
+   - if the level is within EXPOSURE_HYSTERESIS of the target, the time
+     stays, so noise does not make it jump back and forth;
+   - otherwise, the time is scaled by target/level, by at most a factor
+     EXPOSURE_MAXSTEP, within 1 ms and the given maximum.
+
+   The maximum keeps the cycle time of the acquisition bounded. After a
+   change, the spectra which were already under way are not used for the
+   control. Integration times are in ms here; device.c converts them into
+   the units of the device (ms for the USB2000, us for the USB2000+), and
+   the full count is 4095 or 65535. Whether the first spectrum after a
+   change is taken with the old or the new time depends on the device, so
+   these spectra are not written out.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "exposure.h"
+
+void prepare_exposure(struct exposure *e, double target, int maximum,
+                      int fullscale, int ms, int delay) {
+    e->target = target;
+    e->minimum = 1;
+    e->maximum = maximum;
+    e->fullscale = fullscale;
+    e->current = e->frametime = ms;
+    e->settle = 0;
+    e->delay = delay;
+}
+
+static inline int median3(int a, int b, int c) {
+    int lo = a < b ? a : b, hi = a < b ? b : a;
+    return c < lo ? lo : c > hi ? hi : c;
+}
+
+int control_exposure(struct exposure *e, uint16_t *values, float baselevel) {
+    int i, m, peak = 0, ms;
+    double level, factor;
+
+    if (e->settle) { /* may still be taken with the time before */
+        e->settle--;
+        return -1;
+    }
+    e->frametime = e->current;
+
+    for (i=BLACKLEVEL_END+2; i<SPECTRUM_PIXELS-1; i++) {
+        m = median3(values[i-1], values[i], values[i+1]);
+        if (m > peak) peak = m;
+    }
+    level = (peak - baselevel) / (e->fullscale - baselevel);
+
+    if (peak >= e->fullscale) {
+        factor = 0.25;
+    } else if (level < e->target*(1.0-EXPOSURE_HYSTERESIS)) {
+        factor = level > e->target/EXPOSURE_MAXSTEP ?
+            e->target/level : EXPOSURE_MAXSTEP;
+    } else if (level > e->target*(1.0+EXPOSURE_HYSTERESIS)) {
+        factor = e->target/level;
+    } else {
+        return 0;
+    }
+
+    ms = (int)(e->current*factor + 0.5);
+    if (ms < e->minimum) ms = e->minimum;
+    if (ms > e->maximum) ms = e->maximum;
+    if (ms == e->current) return 0;
+    e->current = ms;
+    e->settle = e->delay;
+    return ms;
+}
@@ -0,0 +1,47 @@
+/* exposure.h: automatic integration time. Details see exposure.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+#define EXPOSURE_HYSTERESIS 0.15  /* relative deviation which is tolerated */
+#define EXPOSURE_MAXSTEP 8        /* largest change of the time at once */
+
+/* exposure control of one device */
+struct exposure {
+    double target;       /* fill level to reach, fraction of full range */
+    int minimum, maximum; /* integration time range in ms */
+    int fullscale;       /* largest count of the device */
+    int current;         /* integration time in ms set in the device */
+    int frametime;       /* the one the last spectrum was taken with */
+    int settle;          /* spectra to skip until the new time is in effect */
+    int delay;           /* ...after each change */
+};
+
+/* prepares the control for a device, starting with integration time ms.
+   delay is the number of spectra which may still come with the old time
+   after a change. */
+void prepare_exposure(struct exposure *e, double target, int maximum,
+                      int fullscale, int ms, int delay);
+
+/* looks at a spectrum and returns a new integration time in ms, 0 if the
+   current one is fine, or -1 if the spectrum may have been taken with the
+   time before the last change */
+int control_exposure(struct exposure *e, uint16_t *values, float baselevel);
@@ -0,0 +1,250 @@
+/* output.c: output formats for spectra.
+
+   The text format consists of one line per pixel with pixel index,
+   wavelength in nm, raw value and baseline corrected value, as it was
+   written with fprintf(..."%d %7.2f %d %d\n"...) before. Since index and
+   wavelength never change for a device, the beginning of each line is
+   prepared once, and only the two numbers are converted for each spectrum.
+   The whole spectrum then goes out with one write() call; test/outputtest.c
+   compares the result with fprintf(). An envelope for display (see
+   decimate.c) is written the same way, with one line per screen column,
+   and so are dark corrected values, transmittances and absorbances (see
+   correct.c), with a fixed number of decimals. With
+   wavelength windows or binning (see region.c), there is one line per bin,
+   which starts with the index of its first pixel.
+
+   The binary format has a file header and fixed size records with the raw
+   pixel values; see output.h. A record is about a tenth of the text.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <math.h>
+
+#include "decode.h"
+#include "output.h"
+
+#define MAX_PREFIX 40  /* index and wavelength with separators */
+#define MAX_NUMBERS 32 /* two numbers with separators */
+#define FIXED_LIMIT 1e12f /* largest value written with decimals */
+
+/* the line beginnings are MAX_PREFIX bytes apart in tf->prefix */
+int prepare_indexed_text_format(struct textformat *tf, int *index,
+                                double *wavelength, int lines) {
+    int i, n;
+
+    if (!tf->prefix) tf->prefix = malloc(SPECTRUM_PIXELS*MAX_PREFIX);
+    if (!tf->buffer)
+        tf->buffer = malloc(SPECTRUM_PIXELS*(MAX_PREFIX+MAX_NUMBERS));
+    if (!tf->prefix || !tf->buffer) return -1;
+
+    tf->lines = lines;
+    for (i=0; i<lines; i++) {
+        n = snprintf(tf->prefix+i*MAX_PREFIX, MAX_PREFIX, "%d %7.2f ",
+                     index ? index[i] : i, wavelength[i]);
+        tf->prefixlen[i] = n < MAX_PREFIX ? n : MAX_PREFIX-1;
+    }
+    return 0;
+}
+
+int prepare_text_format(struct textformat *tf, double *wavelength, int lines) {
+    return prepare_indexed_text_format(tf, NULL, wavelength, lines);
+}
+
+/* converts an integer into decimal ASCII; returns number of characters */
+static inline int itoa_fast(int value, char *out) {
+    char tmp[12];
+    int n = 0, len;
+    unsigned int v = value < 0 ? -(unsigned int)value : value;
+
+    do {
+        tmp[n++] = '0' + v%10;
+        v /= 10;
+    } while (v);
+    len = 0;
+    if (value < 0) out[len++] = '-';
+    while (n) out[len++] = tmp[--n];
+    return len;
+}
+
+int format_spectrum_text(struct textformat *tf, uint16_t *rawvalues,
+                         int offset, char **text) {
+    int i;
+    char *p = tf->buffer;
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        memcpy(p, tf->prefix+i*MAX_PREFIX, tf->prefixlen[i]);
+        p += tf->prefixlen[i];
+        p += itoa_fast(rawvalues[i], p);
+        *p++ = ' ';
+        p += itoa_fast(rawvalues[i]-offset, p);
+        *p++ = '\n';
+    }
+    *text = tf->buffer;
+    return p-tf->buffer;
+}
+
+/* converts a value with a fixed number of decimals; returns the number of
+   characters */
+static inline int ftoa_fixed(float value, int decimals, char *out) {
+    static const float power[] = {1, 10, 100, 1000, 1e4, 1e5, 1e6};
+    long long v;
+    char tmp[24];
+    int n = 0, len = 0;
+
+    if (value > FIXED_LIMIT) value = FIXED_LIMIT;
+    if (value < -FIXED_LIMIT) value = -FIXED_LIMIT;
+    v = llrintf(value*power[decimals]);
+    if (v < 0) {
+        out[len++] = '-';
+        v = -v;
+    }
+    do {
+        tmp[n++] = '0' + v%10;
+        v /= 10;
+        if (n == decimals) tmp[n++] = '.';
+    } while (v || n <= decimals+1);
+    while (n) out[len++] = tmp[--n];
+    return len;
+}
+
+int format_values_text(struct textformat *tf, uint16_t *rawvalues,
+                       float *values, int decimals, char **text) {
+    int i;
+    char *p = tf->buffer;
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        memcpy(p, tf->prefix+i*MAX_PREFIX, tf->prefixlen[i]);
+        p += tf->prefixlen[i];
+        p += itoa_fast(rawvalues[i], p);
+        *p++ = ' ';
+        p += ftoa_fixed(values[i], decimals, p);
+        *p++ = '\n';
+    }
+    *text = tf->buffer;
+    return p-tf->buffer;
+}
+
+int format_sums_text(struct textformat *tf, int32_t *sums, int binning,
+                     int offset, char **text) {
+    int i;
+    char *p = tf->buffer;
+
+    offset *= binning;
+    for (i=0; i<tf->lines; i++) {
+        memcpy(p, tf->prefix+i*MAX_PREFIX, tf->prefixlen[i]);
+        p += tf->prefixlen[i];
+        p += itoa_fast(sums[i], p);
+        *p++ = ' ';
+        p += itoa_fast(sums[i]-offset, p);
+        *p++ = '\n';
+    }
+    *text = tf->buffer;
+    return p-tf->buffer;
+}
+
+int format_envelope_text(struct textformat *tf, uint16_t *min, uint16_t *max,
+                         int offset, char **text) {
+    int i;
+    char *p = tf->buffer;
+
+    for (i=0; i<tf->lines; i++) {
+        memcpy(p, tf->prefix+i*MAX_PREFIX, tf->prefixlen[i]);
+        p += tf->prefixlen[i];
+        p += itoa_fast(min[i]-offset, p);
+        *p++ = ' ';
+        p += itoa_fast(max[i]-offset, p);
+        *p++ = '\n';
+    }
+    *text = tf->buffer;
+    return p-tf->buffer;
+}
+
+void fill_binary_header(struct spectrum_file_header *h, int deviceID,
+                        char *serial, double *lam_coeff, int integrationtime,
+                        int device, int devices) {
+    union { double d; uint64_t u; } c;
+    int i;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SPECTRUM_FILE_MAGIC, sizeof(h->magic));
+    h->version = htole32(SPECTRUM_FILE_VERSION);
+    h->deviceID = htole32(deviceID);
+    memcpy(h->serial, serial, strnlen(serial, sizeof(h->serial)));
+    for (i=0; i<4; i++) {
+        c.d = lam_coeff[i]; c.u = htole64(c.u);
+        memcpy(&h->lam_coeff[i], &c.u, sizeof(double));
+    }
+    h->integrationtime = htole32(integrationtime);
+    h->pixels = htole32(SPECTRUM_PIXELS);
+    h->recordsize = htole32(SPECTRUM_RECORD_SIZE);
+    h->device = htole16(device);
+    h->devices = htole16(devices);
+}
+
+int write_binary_header(int fd, int deviceID, char *serial, double *lam_coeff,
+                        int integrationtime, int device, int devices) {
+    struct spectrum_file_header h;
+
+    fill_binary_header(&h, deviceID, serial, lam_coeff, integrationtime,
+                       device, devices);
+    return write_all(fd, (char *)&h, sizeof(h));
+}
+
+void fill_binary_record(void *record, uint16_t *rawvalues, uint64_t timestamp,
+                        uint32_t sequence, int device) {
+    struct spectrum_record_header *h = (struct spectrum_record_header *)record;
+    uint16_t *pixels = (uint16_t *)((char *)record + sizeof(*h));
+
+    h->timestamp = htole64(timestamp);
+    h->sequence = htole32(sequence);
+    h->device = htole32(device);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    memcpy(pixels, rawvalues, SPECTRUM_PIXELS*sizeof(uint16_t));
+#else
+    int i;
+    for (i=0; i<SPECTRUM_PIXELS; i++) pixels[i] = htole16(rawvalues[i]);
+#endif
+}
+
+int write_binary_record(int fd, uint16_t *rawvalues, uint64_t timestamp,
+                        uint32_t sequence, int device) {
+    uint64_t record[SPECTRUM_RECORD_SIZE/sizeof(uint64_t)];
+
+    fill_binary_record(record, rawvalues, timestamp, sequence, device);
+    return write_all(fd, (char *)record, SPECTRUM_RECORD_SIZE);
+}
+
+int write_all(int fd, char *buffer, int len) {
+    int n;
+    while (len > 0) {
+        n = write(fd, buffer, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += n; len -= n;
+    }
+    return 0;
+}
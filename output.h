@@ -0,0 +1,110 @@
+/* output.h: output formats for spectra. Details see output.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+/* text formatter of one device */
+struct textformat {
+    int lines;     /* pixels, or columns of an envelope */
+    char *prefix;  /* prepared line beginnings, see output.c */
+    int prefixlen[SPECTRUM_PIXELS];
+    char *buffer;  /* text of one spectrum */
+};
+
+/* prepares the text formatter for a number of lines with the given
+   wavelengths; these are the pixels, or the columns of an envelope. Returns
+   0 on success, or -1 if no memory could be allocated. */
+int prepare_text_format(struct textformat *tf, double *wavelength, int lines);
+
+/* same with the line indices given, for bins of pixels */
+int prepare_indexed_text_format(struct textformat *tf, int *index,
+                                double *wavelength, int lines);
+
+/* writes the text lines "index wavelength raw corrected" for all pixels into
+   the buffer of the formatter and returns the number of bytes. The corrected
+   value is the raw value minus offset. */
+int format_spectrum_text(struct textformat *tf, uint16_t *rawvalues,
+                         int offset, char **text);
+
+/* same with the corrected values given as floats, written with up to 6
+   decimals */
+int format_values_text(struct textformat *tf, uint16_t *rawvalues,
+                       float *values, int decimals, char **text);
+
+/* same for bins of pixels: lines "first wavelength sum corrected", where
+   the corrected value is the sum minus binning times offset */
+int format_sums_text(struct textformat *tf, int32_t *sums, int binning,
+                     int offset, char **text);
+
+/* same for an envelope: lines "column wavelength min max", where min and
+   max are the smallest and largest value in the column minus offset */
+int format_envelope_text(struct textformat *tf, uint16_t *min, uint16_t *max,
+                         int offset, char **text);
+
+/* binary format: a spectrum_file_header, followed by fixed size records,
+   each consisting of a spectrum_record_header and the pixel values. All
+   numbers are little endian; the pixels are uint16_t. Record n starts at
+   byte sizeof(struct spectrum_file_header) + n * recordsize.
+   A file with the spectra of several devices starts with one header per
+   device; devices in the headers tells how many, and the device field of a
+   record tells which header it belongs to. Record n then starts at byte
+   devices * sizeof(struct spectrum_file_header) + n * recordsize. */
+#define SPECTRUM_FILE_MAGIC "USB2KSPC"
+#define SPECTRUM_FILE_VERSION 1
+
+struct spectrum_file_header {
+    char magic[8];             /* SPECTRUM_FILE_MAGIC, not 0 terminated */
+    uint32_t version;          /* SPECTRUM_FILE_VERSION */
+    uint32_t deviceID;         /* USB device ID */
+    char serial[16];           /* serial number, 0 padded */
+    double lam_coeff[4];       /* lam = sum_i c_i index**i */
+    uint32_t integrationtime;  /* in ms */
+    uint32_t pixels;           /* number of pixels per record */
+    uint32_t recordsize;       /* in bytes, incl. record header */
+    uint16_t device;           /* index of this device in the file */
+    uint16_t devices;          /* number of headers at the file start */
+};
+
+struct spectrum_record_header {
+    uint64_t timestamp;        /* CLOCK_MONOTONIC in ns */
+    uint32_t sequence;         /* sequence number from the driver */
+    uint32_t device;           /* index of the device header */
+};
+
+#define SPECTRUM_RECORD_SIZE (sizeof(struct spectrum_record_header) \
+                              + SPECTRUM_PIXELS*sizeof(uint16_t))
+
+/* prepares a file header / one record of SPECTRUM_RECORD_SIZE bytes in
+   memory; record must be aligned for uint64_t */
+void fill_binary_header(struct spectrum_file_header *h, int deviceID,
+                        char *serial, double *lam_coeff, int integrationtime,
+                        int device, int devices);
+void fill_binary_record(void *record, uint16_t *rawvalues, uint64_t timestamp,
+                        uint32_t sequence, int device);
+
+/* writes the file header / one record. Return 0 or -1 on error. */
+int write_binary_header(int fd, int deviceID, char *serial, double *lam_coeff,
+                        int integrationtime, int device, int devices);
+int write_binary_record(int fd, uint16_t *rawvalues, uint64_t timestamp,
+                        uint32_t sequence, int device);
+
+/* writes the whole buffer to a file descriptor; returns 0 or -1 on error */
+int write_all(int fd, char *buffer, int len);
@@ -0,0 +1,153 @@
+/* peaks.c: peak finding in spectra.
+
+   For measurements which only follow a few lines, spectroread -P writes a
+   list of the peaks of each spectrum instead of all pixels. A peak is a
+   pixel which is at least a threshold above the baseline and the highest
+   within PEAK_NEIGHBOURHOOD pixels. Its center, height and width follow
+   from a Gaussian through the pixel and its two neighbours (a parabola
+   through their logarithms); where that does not work since a neighbour is
+   not above the baseline, a parabola through the values is used. The
+   center is converted into a wavelength with the calibration polynomial at
+   the fractional pixel position, and the width with the local dispersion.
+   The area is that of the Gaussian.
+
+   Lines stay where they are from one spectrum to the next, so the search
+   starts from the peaks of the last spectrum and only looks PEAK_TRACKING
+   pixels around each; such a peak keeps its id. The whole spectrum is
+   searched again every PEAK_RESCAN spectra, or when a peak got lost, to
+   find new ones.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "peaks.h"
+
+void prepare_peaks(struct peakfinder *p, int threshold, double *lam_coeff) {
+    memset(p, 0, sizeof(*p));
+    p->threshold = threshold;
+    memcpy(p->lam_coeff, lam_coeff, sizeof(p->lam_coeff));
+    p->sincesearch = PEAK_RESCAN; /* start with a full search */
+}
+
+/* wavelength at a fractional pixel position, and its derivative */
+static double lambda(double *c, double x, double *dispersion) {
+    *dispersion = c[1] + x*(2*c[2] + x*3*c[3]);
+    return c[0] + x*(c[1] + x*(c[2] + x*c[3]));
+}
+
+/* is pixel i a peak of the corrected values? */
+static int is_peak(struct peakfinder *p, uint16_t *values, int offset,
+                   int i) {
+    int j, v = values[i];
+
+    if (v-offset < p->threshold) return 0;
+    for (j=i-PEAK_NEIGHBOURHOOD; j<=i+PEAK_NEIGHBOURHOOD; j++) {
+        if (j<BLACKLEVEL_END+1 || j>=SPECTRUM_PIXELS || j==i) continue;
+        /* of a flat top, the first pixel is the peak */
+        if (values[j] > v || (j < i && values[j] == v)) return 0;
+    }
+    return 1;
+}
+
+/* center, height, width and area of the peak at pixel i */
+static void fit_peak(struct peakfinder *p, uint16_t *values, int offset,
+                     int i, struct peak *k) {
+    double a, b, c, curvature, delta, sigma, dispersion;
+
+    k->pixel = i;
+    b = values[i]-offset;
+    a = i > 0 ? values[i-1]-offset : b;
+    c = i < SPECTRUM_PIXELS-1 ? values[i+1]-offset : b;
+
+    if (a > 0 && c > 0 && (curvature = log(a) - 2*log(b) + log(c)) < 0) {
+        /* Gaussian: parabola through the logarithms */
+        delta = 0.5*(log(a)-log(c))/curvature;
+        k->height = exp(log(b) - 0.25*(log(a)-log(c))*delta);
+        sigma = sqrt(-1.0/curvature);
+    } else if ((curvature = a - 2*b + c) < 0) {
+        delta = 0.5*(a-c)/curvature;
+        k->height = b - 0.25*(a-c)*delta;
+        /* half height of the parabola, as the sigma of a Gaussian */
+        sigma = 2*sqrt(-k->height/curvature) / 2.3548;
+    } else { /* flat */
+        delta = 0;
+        k->height = b;
+        sigma = 0.5;
+    }
+    k->position = i + delta;
+    k->wavelength = lambda(p->lam_coeff, k->position, &dispersion);
+    k->fwhm = 2.3548*sigma*fabs(dispersion);
+    k->area = k->height*sigma*fabs(dispersion)*sqrt(2*M_PI);
+}
+
+/* looks for the peaks of the last spectrum near where they were. Returns 0,
+   or -1 if one of them is gone. */
+static int track_peaks(struct peakfinder *p, uint16_t *values, int offset) {
+    int n, i, best, lo, hi, count = 0;
+
+    for (n=0; n<p->count; n++) {
+        lo = p->peak[n].pixel - PEAK_TRACKING;
+        hi = p->peak[n].pixel + PEAK_TRACKING;
+        if (lo < BLACKLEVEL_END+1) lo = BLACKLEVEL_END+1;
+        if (hi > SPECTRUM_PIXELS-1) hi = SPECTRUM_PIXELS-1;
+        for (best=lo, i=lo+1; i<=hi; i++)
+            if (values[i] > values[best]) best = i;
+        if (!is_peak(p, values, offset, best)) return -1;
+        /* two peaks which ran into each other are one */
+        if (count && p->peak[count-1].pixel == best) continue;
+        p->peak[count].id = p->peak[n].id;
+        fit_peak(p, values, offset, best, &p->peak[count]);
+        count++;
+    }
+    p->count = count;
+    return 0;
+}
+
+/* searches the whole spectrum; known peaks keep their id */
+static void search_peaks(struct peakfinder *p, uint16_t *values, int offset) {
+    struct peak found[MAX_PEAKS];
+    int i, count = 0, old = 0;
+
+    for (i=BLACKLEVEL_END+1; i<SPECTRUM_PIXELS && count<MAX_PEAKS; i++) {
+        if (!is_peak(p, values, offset, i)) continue;
+        fit_peak(p, values, offset, i, &found[count]);
+        /* the old peaks are in order as well */
+        while (old < p->count &&
+               p->peak[old].pixel < i - PEAK_TRACKING) old++;
+        if (old < p->count && p->peak[old].pixel <= i + PEAK_TRACKING) {
+            found[count].id = p->peak[old++].id;
+        } else {
+            found[count].id = p->nextid++;
+        }
+        count++;
+    }
+    memcpy(p->peak, found, count*sizeof(struct peak));
+    p->count = count;
+}
+
+int find_peaks(struct peakfinder *p, uint16_t *values, int offset) {
+    if (++p->sincesearch >= PEAK_RESCAN ||
+        track_peaks(p, values, offset)) {
+        search_peaks(p, values, offset);
+        p->sincesearch = 0;
+    }
+    return p->count;
+}
@@ -0,0 +1,55 @@
+/* peaks.h: peak finding in spectra. Details see peaks.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+#define MAX_PEAKS 64        /* peaks reported per spectrum */
+#define PEAK_NEIGHBOURHOOD 2 /* a peak is the highest pixel this far around */
+#define PEAK_TRACKING 3     /* pixels a peak may move between spectra */
+#define PEAK_RESCAN 16      /* spectra between full searches */
+
+struct peak {
+    int id;                 /* stays the same while the peak is tracked */
+    int pixel;              /* highest pixel */
+    double position;        /* center in pixels */
+    double wavelength;      /* center in nm */
+    double height;          /* above the baseline, in counts */
+    double fwhm;            /* in nm */
+    double area;            /* in counts*nm */
+};
+
+/* peak finder of one device */
+struct peakfinder {
+    int threshold;          /* smallest height in counts */
+    double lam_coeff[4];
+    int count;              /* peaks of the last spectrum */
+    struct peak peak[MAX_PEAKS];
+    int nextid;
+    int sincesearch;        /* spectra since the last full search */
+};
+
+/* prepares a peak finder for peaks of at least threshold counts above the
+   baseline, on a device with the given wavelength coefficients */
+void prepare_peaks(struct peakfinder *p, int threshold, double *lam_coeff);
+
+/* finds the peaks of a spectrum with the given baseline; they are left in
+   p->peak in the order of their wavelength. Returns their number. */
+int find_peaks(struct peakfinder *p, uint16_t *values, int offset);
@@ -0,0 +1,73 @@
+/* region.c: wavelength regions and pixel binning.
+
+   Many measurements only look at a few bands of the spectrum. With
+   spectroread -r, only the pixels within the given wavelength windows are
+   written out, and with -b, the pixels are summed up in bins of a few
+   pixels each, which also improves the signal to noise ratio. The windows
+   are found once, by binary search in the wavelength table, which rises
+   with the pixel index. Pixels at the upper end of a window which do not
+   fill a whole bin are left out, so all bins have the same size. Windows
+   must not overlap, so there are never more lines than pixels.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "region.h"
+
+/* first pixel with a wavelength of at least lambda */
+static int first_pixel(double *wavelength, double lambda) {
+    int lo = 0, hi = SPECTRUM_PIXELS, mid;
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (wavelength[mid] < lambda) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+int prepare_selection(struct selection *s, double *wavelength, double *lo,
+                      double *hi, int regions, int binning) {
+    int r, i, j, start, end;
+    double sum;
+
+    s->lines = 0;
+    s->binning = binning;
+    for (r=0; r<(regions ? regions : 1); r++) {
+        start = regions ? first_pixel(wavelength, lo[r]) : 0;
+        end = regions ? first_pixel(wavelength, hi[r]) : SPECTRUM_PIXELS;
+        /* hi itself belongs to the window */
+        if (end < SPECTRUM_PIXELS && wavelength[end] == hi[r]) end++;
+        for (i=start; i+binning<=end; i+=binning) {
+            if (s->lines == SPECTRUM_PIXELS) return -1; /* windows overlap */
+            for (j=0, sum=0; j<binning; j++) sum += wavelength[i+j];
+            s->first[s->lines] = i;
+            s->lambda[s->lines] = sum/binning;
+            s->lines++;
+        }
+    }
+    return s->lines ? 0 : -1;
+}
+
+void sum_selection(struct selection *s, uint16_t *values, int32_t *sums) {
+    int l, j;
+    int32_t sum;
+
+    for (l=0; l<s->lines; l++) {
+        for (j=0, sum=0; j<s->binning; j++) sum += values[s->first[l]+j];
+        sums[l] = sum;
+    }
+}
@@ -0,0 +1,43 @@
+/* region.h: wavelength regions and pixel binning. Details see region.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+#include "decode.h"
+
+#define MAX_REGIONS 16      /* wavelength windows */
+
+/* output lines of the selected pixels. Line l is the sum of the pixels
+   first[l] to first[l]+binning-1. */
+struct selection {
+    int lines;
+    int binning;
+    int first[SPECTRUM_PIXELS];
+    double lambda[SPECTRUM_PIXELS]; /* mean wavelength of the pixels */
+};
+
+/* finds the pixels of the wavelength windows lo[r]..hi[r] in nm, or of the
+   whole spectrum if there are no windows, and groups them into bins of
+   binning pixels. Returns 0, or -1 if no pixel is selected or the windows
+   select more than SPECTRUM_PIXELS lines. */
+int prepare_selection(struct selection *s, double *wavelength, double *lo,
+                      double *hi, int regions, int binning);
+
+/* sums of the pixels of every line */
+void sum_selection(struct selection *s, uint16_t *values, int32_t *sums);
@@ -0,0 +1,280 @@
+/* serve.c: spectrum server.
+
+   Keeps one spectrometer open and hands its spectra to any number of
+   clients on a Unix domain socket, so programs which show or log spectra
+   don't initialize the device again for every frame, and several of them
+   can use one device. The protocol is described in serve.h.
+
+   Everything runs in one thread. Requests of the clients are handled
+   between two spectra, so a change of the integration time never
+   interferes with a running exposure. Output to the clients goes through
+   non-blocking sockets; a client which still has a message in its buffer
+   does not get the next spectrum, so a slow client never holds up the
+   device or the others.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "decode.h"
+#include "output.h"
+#include "serve.h"
+
+#define SERVE_MAX_CLIENTS 32
+#define SERVE_BACKLOG 8
+#define MAX_MESSAGE (sizeof(struct serve_message) + SPECTRUM_RECORD_SIZE)
+#define OUTBUF_SIZE (4*MAX_MESSAGE) /* room for a spectrum and some answers */
+
+struct client {
+    int fd;                    /* -1 for an unused entry */
+    int subscribed;            /* wants spectra */
+    unsigned long remaining;   /* ...this many, or 0 for no limit */
+    char request[sizeof(struct serve_request)];
+    int requestlen;            /* bytes of an incomplete request */
+    char outbuf[OUTBUF_SIZE];  /* messages not yet sent */
+    int outlen;
+};
+
+static struct client clients[SERVE_MAX_CLIENTS];
+
+static void drop_client(struct client *c) {
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* sends as much of the output buffer as the socket takes */
+static void flush_client(struct client *c) {
+    int n;
+    while (c->outlen) {
+        n = send(c->fd, c->outbuf, c->outlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) drop_client(c);
+            return;
+        }
+        memmove(c->outbuf, c->outbuf+n, c->outlen-n);
+        c->outlen -= n;
+    }
+}
+
+/* puts a message into the output buffer of a client. Spectra are skipped
+   if the client has not taken the previous message yet; a client which
+   does not even take the answers to its requests gets disconnected.
+   Returns 0 if the message is on its way. */
+static int send_message(struct client *c, int type, void *payload, int len) {
+    struct serve_message m;
+
+    if (type == SERVE_SPECTRUM && c->outlen) return -1;
+    if (c->outlen + sizeof(m) + len > OUTBUF_SIZE) {
+        drop_client(c);
+        return -1;
+    }
+    m.type = htole32(type);
+    m.length = htole32(len);
+    memcpy(c->outbuf+c->outlen, &m, sizeof(m));
+    memcpy(c->outbuf+c->outlen+sizeof(m), payload, len);
+    c->outlen += sizeof(m) + len;
+    flush_client(c);
+    return 0;
+}
+
+static void send_ack(struct client *c, int command, int status) {
+    struct serve_ack a;
+    a.command = htole32(command);
+    a.status = htole32(status);
+    send_message(c, SERVE_ACK, &a, sizeof(a));
+}
+
+/* reads requests of a client and executes them */
+static void handle_requests(struct client *c, struct device *dev,
+                            int deviceID, char *serial, double *lam_coeff,
+                            int *integrationtime) {
+    struct serve_request *r = (struct serve_request *)c->request;
+    struct spectrum_file_header h;
+    int n, command, argument;
+
+    while (c->fd >= 0) {
+        n = recv(c->fd, c->request+c->requestlen,
+                 sizeof(c->request)-c->requestlen, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) { /* closed by the client, or broken */
+            drop_client(c);
+            return;
+        }
+        c->requestlen += n;
+        if (c->requestlen < (int)sizeof(c->request)) continue;
+        c->requestlen = 0;
+
+        command = le32toh(r->command);
+        argument = le32toh(r->argument);
+        switch (command) {
+            case SERVE_SUBSCRIBE:
+                c->subscribed = 1;
+                c->remaining = argument;
+                send_ack(c, command, 0);
+                break;
+            case SERVE_UNSUBSCRIBE:
+                c->subscribed = 0;
+                send_ack(c, command, 0);
+                break;
+            case SERVE_SET_INTEGRATIONTIME:
+                if (argument<1 || argument>10000) {
+                    send_ack(c, command, EINVAL);
+                    break;
+                }
+                if (device_set_integrationtime(dev, deviceID, argument)) {
+                    send_ack(c, command, EIO);
+                    break;
+                }
+                *integrationtime = argument;
+                send_ack(c, command, 0);
+                break;
+            case SERVE_GET_CALIBRATION:
+                fill_binary_header(&h, deviceID, serial, lam_coeff,
+                                   *integrationtime, 0, 1);
+                send_message(c, SERVE_CALIBRATION, &h, sizeof(h));
+                break;
+            default:
+                send_ack(c, command, EINVAL);
+        }
+    }
+}
+
+static int open_socket(char *socketname) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(socketname) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketname);
+
+    /* a socket may be left over from an earlier run; anything else under
+       that name is not ours to remove */
+    if (!lstat(socketname, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(socketname);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, SERVE_BACKLOG)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+int serve_spectra(char *socketname, struct device *dev, int deviceID,
+                  char *serial, double *lam_coeff, int integrationtime) {
+    struct pollfd pfd[SERVE_MAX_CLIENTS+1];
+    int who[SERVE_MAX_CLIENTS+1]; /* client of a pollfd entry */
+    unsigned char data[4100];
+    uint16_t rawvalues[SPECTRUM_PIXELS];
+    uint64_t record[SPECTRUM_RECORD_SIZE/sizeof(uint64_t)];
+    struct spectrum_frame_info frameinfo;
+    unsigned long spectrumindex = 0;
+    struct client *c;
+    int listenfd, fd, i, n, subscribers;
+
+    listenfd = open_socket(socketname);
+    if (listenfd < 0) {
+        perror(socketname);
+        return 18;
+    }
+    for (i=0; i<SERVE_MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    while (1) {
+        /* who wants what */
+        pfd[0].fd = listenfd; pfd[0].events = POLLIN;
+        n = 1; subscribers = 0;
+        for (i=0; i<SERVE_MAX_CLIENTS; i++) {
+            c = &clients[i];
+            if (c->fd < 0) continue;
+            if (c->subscribed) subscribers++;
+            pfd[n].fd = c->fd;
+            pfd[n].events = POLLIN | (c->outlen ? POLLOUT : 0);
+            who[n++] = i;
+        }
+
+        /* only wait for the clients if no spectra are needed */
+        if (poll(pfd, n, subscribers ? 0 : -1) < 0 && errno != EINTR) {
+            perror("spectroread");
+            return 18;
+        }
+        for (i=1; i<n; i++) {
+            c = &clients[who[i]];
+            if (pfd[i].revents & POLLOUT) flush_client(c);
+            if (c->fd >= 0 && pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                handle_requests(c, dev, deviceID, serial, lam_coeff,
+                                &integrationtime);
+        }
+        if (pfd[0].revents & POLLIN) {
+            while ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+                for (i=0; i<SERVE_MAX_CLIENTS; i++)
+                    if (clients[i].fd < 0) break;
+                if (i == SERVE_MAX_CLIENTS) { /* full house */
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                memset(&clients[i], 0, sizeof(struct client));
+                clients[i].fd = fd;
+            }
+        }
+        if (!subscribers) continue;
+
+        /* take a spectrum and hand it out */
+        if (device_ioctl(dev, RequestSpectra, data)) {
+            perror("spectroread");
+            return 8;
+        }
+        device_frameinfo(dev, &frameinfo, spectrumindex++);
+        if (deviceID==USB_DEVICE_ID_USB2000) {
+            generate_numbers_USB2000(data, rawvalues);
+        } else {
+            generate_numbers_USB2000p(data, rawvalues);
+        }
+        fill_binary_record(record, rawvalues, frameinfo.timestamp,
+                           frameinfo.sequence, 0);
+        for (i=0; i<SERVE_MAX_CLIENTS; i++) {
+            c = &clients[i];
+            if (c->fd < 0 || !c->subscribed) continue;
+            if (send_message(c, SERVE_SPECTRUM, record, SPECTRUM_RECORD_SIZE))
+                continue;
+            if (c->remaining && !--c->remaining) c->subscribed = 0;
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/* serve.h: protocol of the spectrum server. Details see serve.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdint.h>
+
+/* A client connects to the Unix domain stream socket and sends requests,
+   each a struct serve_request. The server sends messages, each a
+   struct serve_message followed by length bytes of payload. All numbers are
+   little endian.
+
+   request                    argument             answer
+   SERVE_SUBSCRIBE            number of spectra,   SERVE_ACK, then one
+                              0 for no limit       SERVE_SPECTRUM per spectrum
+   SERVE_UNSUBSCRIBE          -                    SERVE_ACK
+   SERVE_SET_INTEGRATIONTIME  in ms                SERVE_ACK
+   SERVE_GET_CALIBRATION      -                    SERVE_CALIBRATION
+
+   The payload of SERVE_SPECTRUM is a record of the binary file format,
+   SPECTRUM_RECORD_SIZE bytes, and the one of SERVE_CALIBRATION is a
+   struct spectrum_file_header (see output.h). The integration time applies
+   to all clients. Spectra are only taken while somebody is subscribed. A
+   client which does not read its spectra in time loses some; this shows up
+   as a gap in the sequence numbers. */
+
+#define SERVE_SUBSCRIBE 1
+#define SERVE_UNSUBSCRIBE 2
+#define SERVE_SET_INTEGRATIONTIME 3
+#define SERVE_GET_CALIBRATION 4
+
+#define SERVE_SPECTRUM 1
+#define SERVE_CALIBRATION 2
+#define SERVE_ACK 3
+
+struct serve_request {
+    uint32_t command;
+    uint32_t argument;
+};
+
+struct serve_message {
+    uint32_t type;
+    uint32_t length;           /* of the payload */
+};
+
+struct serve_ack {
+    uint32_t command;          /* the request this answers */
+    int32_t status;            /* 0, or an errno value */
+};
+
+struct device; /* see device.h */
+
+/* serves the spectra of an initialized device on a socket until an error
+   occurs. Returns an error code of spectroread. */
+int serve_spectra(char *socketname, struct device *dev, int deviceID,
+                  char *serial, double *lam_coeff, int integrationtime);
@@ -0,0 +1,291 @@
+/* sim.c: simulated spectrometer.
+
+   Answers the driver requests like a USB2000 or USB2000+ would, so the
+   programs can be run and benchmarked without a device. The device name
+   selects the model and optionally some parameters, separated by commas:
+     sim:usb2000p  or  sim:   USB2000+, pixels as little endian words
+     sim:usb2000              USB2000, LSB and MSB in alternating blocks of
+                              64 bytes
+     ,seed=n                  seed of everything random below (default 1)
+     ,peaks=n                 number of random peaks in addition to the
+                              mercury lines (default 5)
+     ,noise=x                 read noise in counts rms (default 3); shot
+                              noise of the signal comes on top. 0 switches
+                              all noise off.
+     ,dark=x                  dark level in counts (default 90)
+     ,pace=real|max           real: a spectrum is ready one integration time
+                              after the request or trigger, as with the real
+                              device (default). max: right away, to measure
+                              the rest of the chain.
+   e.g. sim:usb2000,seed=7,pace=max
+
+   A spectrum consists of the dark level with a fixed pattern, a dark
+   current, the mercury lines and the random peaks, whose height scales with
+   the integration time, and noise. The first 21 pixels are blocked like on
+   the CCD and only see the dark part. Everything is a function of the seed
+   and the sequence number of the spectrum, so a run gives the same spectra
+   every time, independent of the timing.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "device.h"
+#include "decode.h"
+#include "sim.h"
+
+#define SIM_DARKLEVEL 90.0      /* counts */
+#define SIM_READNOISE 3.0       /* counts rms */
+#define SIM_DARKCURRENT 0.05    /* counts per ms */
+#define SIM_PATTERN 3.0         /* fixed pattern of the dark level, counts */
+#define SIM_PEAKS 5             /* random peaks */
+#define SIM_LINEWIDTH 1.2       /* FWHM of the mercury lines in nm */
+#define SIM_BLOCKED 21          /* pixels without light */
+#define SYNC_BYTE 0x69          /* last byte of a spectrum */
+#define MAX_SIM_PEAKS 100
+
+static double sim_coeff[4] = {339.1234, 0.3771, -1.5e-05, -2.2e-09};
+
+/* mercury lines: wavelength in nm, counts per ms of integration */
+static struct { double lambda, rate; } sim_lines[] = {
+    {404.66, 40.0}, {435.83, 120.0}, {546.07, 200.0}, {576.96, 60.0},
+    {579.07, 60.0},
+};
+#define SIM_LINES (sizeof(sim_lines)/sizeof(sim_lines[0]))
+
+struct simdevice {
+    int deviceID;
+    int maxcount;            /* full scale of the A/D converter */
+    unsigned long long seed;
+    double noise;            /* read noise, or 0 for none at all */
+    int realtime;            /* pace spectra with the integration time */
+    char serial[16];
+    float dark[SPECTRUM_PIXELS];   /* dark level incl. fixed pattern */
+    float signal[SPECTRUM_PIXELS]; /* counts per ms */
+    long integration_us;
+    int pending;             /* triggered, but not read yet */
+    struct timespec ready;   /* when the pending spectrum is complete */
+    unsigned int sequence;   /* spectra delivered so far */
+    struct spectrum_frame_info lastframe;
+};
+
+/* splitmix64; small, fast, and the same on every machine */
+static unsigned long long next_random(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+static double uniform(unsigned long long *state) { /* in [0,1) */
+    return (next_random(state) >> 11) * (1.0/9007199254740992.0);
+}
+static double gaussian(unsigned long long *state) {
+    double u = uniform(state), v = uniform(state);
+    return sqrt(-2.0*log(1.0-u)) * cos(2*M_PI*v);
+}
+
+/* adds a line of given FWHM and rate to the signal */
+static void add_line(struct simdevice *s, double *wavelength, double lambda,
+                     double fwhm, double rate) {
+    double x, sigma = fwhm/2.3548;
+    int i;
+    for (i=SIM_BLOCKED; i<SPECTRUM_PIXELS; i++) {
+        x = (wavelength[i]-lambda)/sigma;
+        if (x > -6 && x < 6) s->signal[i] += rate*exp(-0.5*x*x);
+    }
+}
+
+/* the noise free part of the spectra */
+static void sim_prepare(struct simdevice *s, int peaks, double darklevel) {
+    double wavelength[SPECTRUM_PIXELS];
+    unsigned long long state = s->seed;
+    int i;
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        wavelength[i] = sim_coeff[0] +
+            i*(sim_coeff[1]+i*(sim_coeff[2]+i*sim_coeff[3]));
+        s->dark[i] = darklevel + SIM_PATTERN*(2*uniform(&state)-1);
+        s->signal[i] = 0;
+    }
+    for (i=0; i<SIM_LINES; i++)
+        add_line(s, wavelength, sim_lines[i].lambda, SIM_LINEWIDTH,
+                 sim_lines[i].rate);
+    for (i=0; i<peaks; i++)
+        add_line(s, wavelength,
+                 wavelength[SIM_BLOCKED] + uniform(&state) *
+                 (wavelength[SPECTRUM_PIXELS-1]-wavelength[SIM_BLOCKED]),
+                 0.8 + 2.5*uniform(&state), 5.0 + 300.0*uniform(&state));
+}
+
+static void add_us(struct timespec *t, long us) {
+    t->tv_sec += us/1000000;
+    t->tv_nsec += (us%1000000)*1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++; t->tv_nsec -= 1000000000;
+    }
+}
+
+static void sim_trigger(struct simdevice *s) {
+    clock_gettime(CLOCK_MONOTONIC, &s->ready);
+    if (s->realtime) add_us(&s->ready, s->integration_us);
+    s->pending = 1;
+}
+
+/* waits for the pending spectrum and fills in the payload */
+static void sim_spectrum(struct simdevice *s, unsigned char *data) {
+    double ms = s->integration_us/1000.0;
+    double v, light;
+    unsigned long long state;
+    int i, value;
+    struct timespec now;
+
+    if (s->realtime)
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &s->ready,
+                               NULL) == EINTR);
+    s->pending = 0;
+
+    /* noise depends on seed and sequence number only */
+    state = s->seed ^ (0x5851f42d4c957f2dULL * (s->sequence+1ULL));
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        light = s->signal[i]*ms;
+        v = s->dark[i] + SIM_DARKCURRENT*ms + light;
+        if (s->noise > 0)
+            v += sqrt(s->noise*s->noise + light) * gaussian(&state);
+        value = v < 0 ? 0 : v > s->maxcount ? s->maxcount : (int)(v+0.5);
+        if (s->deviceID == USB_DEVICE_ID_USB2000) {
+            data[(i%64)+(i>>6)*128] = value & 0xff;
+            data[(i%64)+(i>>6)*128+64] = value >> 8;
+        } else {
+            data[2*i] = value & 0xff;
+            data[2*i+1] = value >> 8;
+        }
+    }
+    data[SPECTRUM_BYTES-1] = SYNC_BYTE;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s->lastframe.timestamp = now.tv_sec*1000000000ULL + now.tv_nsec;
+    s->lastframe.sequence = s->sequence++;
+}
+
+static int sim_ioctl(struct device *dev, unsigned long request,
+                     unsigned long arg) {
+    struct simdevice *s = (struct simdevice *)dev->priv;
+    unsigned char *data = (unsigned char *)arg;
+    int index;
+
+    switch (request) {
+        case GetDeviceID:
+            *(int *)arg = s->deviceID;
+            return 0;
+        case QueryInformation: /* serial number and wavelength coefficients */
+            index = data[0];
+            memset(data, 0, 18);
+            data[0] = QueryInformation & 0xff; data[1] = index;
+            if (index == 0) {
+                strcpy((char *)data+2, s->serial);
+            } else if (index <= 4) {
+                snprintf((char *)data+2, 16, "%.8g", sim_coeff[index-1]);
+            }
+            return 0;
+        case SetIntegrationTime:
+            s->integration_us = (int)arg;
+            if (s->deviceID == USB_DEVICE_ID_USB2000) s->integration_us *= 1000;
+            return 0;
+        case InitializeUSB2000:
+        case SetTimeout:
+            return 0;
+        case TriggerPacket:
+            sim_trigger(s);
+            return 0;
+        case RequestSpectra:
+            sim_trigger(s);
+            sim_spectrum(s, data);
+            return 0;
+        case EmptyPipe:
+            if (!s->pending) return ETIMEDOUT; /* like the driver */
+            sim_spectrum(s, data);
+            return 0;
+        case GetFrameInfo:
+            memcpy(data, &s->lastframe, sizeof(s->lastframe));
+            return 0;
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+static void sim_close(struct device *dev) {
+    free(dev->priv);
+}
+
+/* parses model and parameters; returns 0 or -1 */
+int sim_open(struct device *dev, char *model) {
+    struct simdevice *s;
+    char name[100], *p, *next;
+    int peaks = SIM_PEAKS;
+    double darklevel = SIM_DARKLEVEL;
+
+    s = (struct simdevice *)calloc(1, sizeof(struct simdevice));
+    if (!s) return -1;
+    s->seed = 1;
+    s->noise = SIM_READNOISE;
+    s->realtime = 1;
+    s->integration_us = 100000;
+
+    snprintf(name, sizeof(name), "%s", model);
+    next = strchr(name, ',');
+    if (next) *next++ = 0;
+    if (!name[0] || !strcmp(name, "usb2000p")) {
+        s->deviceID = USB_DEVICE_ID_USB2PLUS;
+    } else if (!strcmp(name, "usb2000")) {
+        s->deviceID = USB_DEVICE_ID_USB2000;
+    } else {
+        goto bad;
+    }
+    s->maxcount = s->deviceID==USB_DEVICE_ID_USB2000 ? 4095 : 65535;
+
+    for (p=next; p; p=next) {
+        next = strchr(p, ',');
+        if (next) *next++ = 0;
+        if (sscanf(p, "seed=%llu", &s->seed)==1) continue;
+        if (sscanf(p, "peaks=%d", &peaks)==1 &&
+            peaks>=0 && peaks<=MAX_SIM_PEAKS) continue;
+        if (sscanf(p, "noise=%lf", &s->noise)==1) continue;
+        if (sscanf(p, "dark=%lf", &darklevel)==1) continue;
+        if (!strcmp(p, "pace=real")) { s->realtime = 1; continue; }
+        if (!strcmp(p, "pace=max")) { s->realtime = 0; continue; }
+        goto bad;
+    }
+    snprintf(s->serial, sizeof(s->serial), "SIM%05llu", s->seed % 100000);
+    sim_prepare(s, peaks, darklevel);
+
+    dev->priv = s;
+    dev->ioctl = sim_ioctl;
+    dev->close = sim_close;
+    return 0;
+
+ bad:
+    free(s);
+    errno = EINVAL;
+    return -1;
+}
@@ -6,9 +6,8 @@ set dataroot [pwd]
 set programroot [pwd]
 set sd [pwd] ; set sdl $sd ; # saving directory
 set program "$programroot/spectroread"
-set tmpfile "$dataroot/.tempspectrum"
+set tmpfile "$dataroot/.tempspectrum" ; # for saving and printing
 set gnucontrol "$dataroot/monitor.gnu" ; # for gnu file
-set gnucanvas "$dataroot/gcan" ; # canvas file
 set XMIN 350
 set XMAX 1000
 set YMIN ""
@@ -18,6 +17,10 @@ set tipeb $TIMEPERBIN
 set VERBOSITY 31 ; # verbosity for spectrum
 set RUNNING 0
 set YSCALE 1
+set PIPE "" ; # channel from the streaming spectroread
+set PARTIAL "" ; # lines of the spectrum being received
+set LASTSPECTRUM "" ; # text of the last complete spectrum
+set AXES "" ; # ranges the axes were drawn for
 
 # title text
 set FNT "-*-Helvetica-*-r-*-*-18-180-*-*-*-*-*-*"
@@ -56,6 +59,7 @@ if {($tipeb >= 10000) || ($tipeb < 1)} {
 set tipeb $TIMEPERBIN
 }
 set TIMEPERBIN $tipeb
+if {$RUNNING != 0} { stopstream ; startstream }
 }
 pack .tiperbin.txt .tiperbin.entry -side left
 pack .tiperbin
@@ -71,8 +75,9 @@ pack .axops.taxis .axops.yaxis -side left
 pack .axops -anchor w
 
 # canvas for display
-canvas .1 ; # -bg white -width 500 -height 300
-pack .1
+canvas .1 -bg white -width 600 -height 360
+pack .1 -fill both -expand 1
+bind .1 <Configure> { plotspectrum }
 
 # -------------------------------------------------------------
 # working procedures
@@ -129,52 +134,87 @@ pack .yax.1 .yax.2 ; pack .yax
 # procedure for halt button
 proc haltbutton {} {
 global RUNNING
-set RUNNING 0
+if {$RUNNING == 0} return
+stopstream
+runstopped
+}
+
+# live view: one spectroread keeps running and sends its spectra through a
+# pipe; every complete spectrum just moves the points of the plot line
+proc startstream {} {
+global program TIMEPERBIN VERBOSITY PIPE PARTIAL
+set PARTIAL ""
+set PIPE [open "|$program -n 0 -i $TIMEPERBIN -V $VERBOSITY" r]
+fconfigure $PIPE -blocking 0 -buffering line
+fileevent $PIPE readable readstream
 }
 
+proc stopstream {} {
+global PIPE
+if {$PIPE == ""} return
+fileevent $PIPE readable {}
+catch { exec kill [pid $PIPE] }
+catch { close $PIPE }
+set PIPE ""
+}
+
+proc readstream {} {
+global PIPE PARTIAL LASTSPECTRUM
+while {[gets $PIPE line] >= 0} {
+if {[string match "# end of spectrum*" $line]} {
+set LASTSPECTRUM $PARTIAL ; set PARTIAL ""
+plotspectrum
+} elseif {$line != ""} {
+append PARTIAL $line "\n"
+}
+}
+if {[eof $PIPE]} { ; # spectroread gave up
+stopstream
+runstopped
+label .axops.etxt -text "Spectrometer error. Try again." -foreground red
+pack .axops.etxt -side left
+}
+}
 
-# procedure to loop during run - start button
+proc runstopped {} {
+global RUNNING
+set RUNNING 0
+.mainknobs.save configure -state normal
+.mainknobs.print configure -state normal
+.mainknobs.start configure -relief raised
+.mainknobs.single configure -state normal
+}
+
+# procedure for the start button
 proc runproc {} {
-global program RUNNING TIMEPERBIN tmpfile VERBOSITY
+global RUNNING
 if {$RUNNING != 0} return
 set RUNNING 1
-set returnvalue 0
 .mainknobs.single configure -state disabled
 .mainknobs.start configure -relief sunken
 .mainknobs.save configure -state disabled
 .mainknobs.print configure -state disabled
 if {[winfo exist .axops.etxt]} {destroy .axops.etxt}
-
-while {[expr ($RUNNING != 0) ]} {
-set returnvalue [ catch { exec $program -o $tmpfile -i $TIMEPERBIN -V $VERBOSITY } evar ]
-
-if {$returnvalue == 0 } { ; # we can safely plot now
-updategraphics;
-} else {
-set RUNNING 0
+if {[catch startstream]} {
+runstopped
 label .axops.etxt -text "Spectrometer error. Try again." -foreground red
 pack .axops.etxt -side left
 }
-update
-}
-.mainknobs.save configure -state normal
-.mainknobs.print configure -state normal
-.mainknobs.start configure -relief raised
-.mainknobs.single configure -state normal
 }
 
 proc singlebutton {} {
-global program RUNNING TIMEPERBIN tmpfile VERBOSITY
+global program RUNNING TIMEPERBIN VERBOSITY LASTSPECTRUM
 if {$RUNNING != 0} return
 set returnvalue 0
 .mainknobs.start configure -state disabled
 .mainknobs.single configure -relief sunken
 if {[winfo exist .axops.etxt]} {destroy .axops.etxt}
 
-set returnvalue [ catch { exec $program -o $tmpfile -i $TIMEPERBIN -V $VERBOSITY } ]
+set returnvalue [ catch { exec $program -i $TIMEPERBIN -V $VERBOSITY } result ]
 
 if {$returnvalue == 0 } { ; # we can safely plot now
-updategraphics;
+set LASTSPECTRUM "$result\n"
+plotspectrum
 } else {
 label .axops.etxt -text "Spectrometer Error. Try again" -foreground red
 pack .axops.etxt -side left
@@ -193,7 +233,7 @@ global sd tmpfile
 if {[winfo exists .fsel]} return
 global fname COMMENT SAVED TIMEPERBIN BINNUM nru
 if {[getfilename] == ""} return
-exec cat $tmpfile >$sd/$fname
+storespectrum $sd/$fname
 set outfile [open $sd/$fname a+ ]
 puts $outfile "# comment on this run: $COMMENT"
 close $outfile
@@ -275,9 +315,9 @@ pack .pri
 
 # procedure exit button
 proc exitbutton {} {
-global tmpfile gnucanvas gnucontrol
+global tmpfile gnucontrol
+stopstream
 exec rm -f $tmpfile
-exec rm -f $gnucanvas
 exec rm -f $gnucontrol
 exit
 }
@@ -285,33 +325,86 @@ bind .mainknobs.exit <Return> exit
 
 
 
-# procedure to update paramters on canvas control file
-proc updatecontrolfile { } {
-global gnucontrol gnucanvas XMIN XMAX YMIN YMAX YSCALE tmpfile
-exec echo "set terminal tkcanvas" >$gnucontrol
-exec echo "set output \"$gnucanvas\" " >>$gnucontrol
-exec echo "set xrange \[$XMIN:$XMAX\]" >>$gnucontrol
-exec echo "set yrange \[$YMIN:$YMAX\]" >>$gnucontrol
-if { $YSCALE == 2 } { exec echo "set logscale y " >>$gnucontrol }
-exec echo "plot \'$tmpfile\' using 2:4 w l notitle " >>$gnucontrol
+# writes the last spectrum into a file
+proc storespectrum {file} {
+global LASTSPECTRUM
+set outfile [open $file w]
+puts -nonewline $outfile $LASTSPECTRUM
+close $outfile
 }
-updatecontrolfile
 
-proc updategraphics { } {
-global gnucanvas gnucontrol
-catch {exec gnuplot $gnucontrol }
-source $gnucanvas ; # load canvas source
-gnuplot .1
-update
+# plots wavelength against the corrected amplitude of the last spectrum.
+# The axes are only redrawn if the ranges have changed.
+proc plotspectrum {} {
+global LASTSPECTRUM XMIN XMAX YMIN YMAX YSCALE AXES
+set xs {} ; set ys {}
+foreach line [split $LASTSPECTRUM "\n"] {
+if {[scan $line "%d %f %d %d" i x raw y] != 4} continue
+if {($XMIN != "" && $x < $XMIN) || ($XMAX != "" && $x > $XMAX)} continue
+if {$YSCALE == 2} { set y [expr {$y < 1 ? 0 : log10($y)}] }
+lappend xs $x ; lappend ys $y
+}
+if {[llength $xs] < 2} return
+
+# ranges
+set sx [lsort -real $xs] ; set sy [lsort -real $ys]
+set x0 [expr {$XMIN != "" ? $XMIN : [lindex $sx 0]}]
+set x1 [expr {$XMAX != "" ? $XMAX : [lindex $sx end]}]
+set y0 [lindex $sy 0] ; set y1 [lindex $sy end]
+if {$YMIN != ""} { set y0 [expr {$YSCALE == 2 ? log10($YMIN) : $YMIN}] }
+if {$YMAX != ""} { set y1 [expr {$YSCALE == 2 ? log10($YMAX) : $YMAX}] }
+if {$x1 <= $x0} { set x1 [expr {$x0 + 1}] }
+if {$y1 <= $y0} { set y1 [expr {$y0 + 1}] }
+
+# canvas geometry with room for the tick labels
+set w [winfo width .1] ; set h [winfo height .1]
+if {$w <= 1} { set w [.1 cget -width] ; set h [.1 cget -height] }
+set left 70 ; set right [expr {$w - 15}] ; set top 15
+set bottom [expr {$h - 30}]
+set mx [expr {($right - $left) / ($x1 - $x0)}]
+set my [expr {($bottom - $top) / ($y1 - $y0)}]
+
+set key "$x0 $x1 $y0 $y1 $w $h $YSCALE"
+if {$key != $AXES} {
+set AXES $key
+.1 delete axes
+.1 create rectangle $left $top $right $bottom -tags axes
+for {set i 0} {$i <= 5} {incr i} {
+set x [expr {$left + $i * ($right - $left) / 5.0}]
+.1 create line $x $bottom $x [expr {$bottom - 5}] -tags axes
+.1 create text $x [expr {$bottom + 4}] -anchor n -tags axes \
+-text [format "%.0f" [expr {$x0 + $i * ($x1 - $x0) / 5.0}]]
+set y [expr {$bottom - $i * ($bottom - $top) / 5.0}]
+set v [expr {$y0 + $i * ($y1 - $y0) / 5.0}]
+if {$YSCALE == 2} { set v [expr {pow(10, $v)}] }
+.1 create line $left $y [expr {$left + 5}] $y -tags axes
+.1 create text [expr {$left - 4}] $y -anchor e -tags axes \
+-text [format "%.4g" $v]
+}
+}
+
+# move the points of the spectrum line
+set coords {}
+foreach x $xs y $ys {
+if {$y < $y0} { set y $y0 } elseif {$y > $y1} { set y $y1 }
+lappend coords [expr {$left + ($x - $x0) * $mx}] \
+[expr {$bottom - ($y - $y0) * $my}]
+}
+if {[.1 find withtag spectrum] == ""} {
+.1 create line $coords -tags spectrum -fill red
+} else {
+.1 coords spectrum $coords
+}
 }
 
 proc updateboth {} {
-updatecontrolfile
-updategraphics
+plotspectrum
 }
 
+# gnuplot is only used for printing and eps files
 proc gnups {printer} {
-global gnucontrol gnucanvas XMIN XMAX YMIN YMAX YSCALE tmpfile
+global gnucontrol XMIN XMAX YMIN YMAX YSCALE tmpfile
+storespectrum $tmpfile
 exec echo "set terminal postscript color \"Helvetica\" 18 " >$gnucontrol
 exec echo "set output \"|lpr -P$printer \" " >>$gnucontrol
 exec echo "set xrange \[$XMIN:$XMAX\]" >>$gnucontrol
@@ -319,12 +412,11 @@ exec echo "set yrange \[$YMIN:$YMAX\]" >>$gnucontrol
 if { $YSCALE == 2 } { exec echo "set logscale y " >>$gnucontrol }
 exec echo "plot \'$tmpfile\' using 2:4 w l notitle " >>$gnucontrol
 catch { exec gnuplot $gnucontrol }
-# restore control file
-updatecontrolfile
 }
 
 proc gnueps {file} {
-global gnucontrol gnucanvas XMIN XMAX YMIN YMAX YSCALE tmpfile sd
+global gnucontrol XMIN XMAX YMIN YMAX YSCALE tmpfile sd
+storespectrum $tmpfile
 exec echo "set terminal postscript eps color size 12cm,8cm \"Helvetica\" 14 " >$gnucontrol
 exec echo "set output \"$sd/$file\"" >>$gnucontrol
 exec echo "set xrange \[$XMIN:$XMAX\]" >>$gnucontrol
@@ -332,6 +424,4 @@ exec echo "set yrange \[$YMIN:$YMAX\]" >>$gnucontrol
 if { $YSCALE == 2 } { exec echo "set logscale y " >>$gnucontrol }
 exec echo "plot \'$tmpfile\' using 2:4 w l notitle " >>$gnucontrol
 catch { exec gnuplot $gnucontrol }
-# restore control file
-updatecontrolfile
 }
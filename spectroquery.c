@@ -0,0 +1,594 @@
+/* program to evaluate spectra recorded with spectroread -F bin or -F archive.
+
+   usage: spectroquery [-f from] [-t to] [-q query]... [-e device] [-s]
+                       [-j threads] file
+
+   -f from, -t to:      time range to evaluate. Times are given in seconds
+                        or as h:mm:ss, counted from the first spectrum in the
+                        file, since the recorded timestamps come from the
+                        monotonic clock. Default is the whole file.
+   -q query:            what to compute for each spectrum, from the baseline
+                        corrected values of the pixels with a wavelength
+                        from lo to hi nm:
+                        band:lo:hi   sum of the values (band integral)
+                        mean:lo:hi   mean value per pixel
+                        peak:lo:hi   wavelength of the highest pixel
+                        The option can be given up to MAX_QUERIES times; each
+                        query gives one column of the output.
+   -e device:           only look at the spectra of this device, in a file
+                        with the spectra of several devices.
+   -s                   summary. Instead of one line per spectrum, the
+                        queries are applied once per device to the sum of
+                        all spectra in the time range. A band then gives
+                        the total integral, a mean the mean per pixel and
+                        spectrum, and a peak the highest pixel of the sum.
+   -j threads:          number of threads. Default is one per CPU.
+
+   The program emits to stdout one line per spectrum with the time in s
+   since the first spectrum, the sequence number, the device index and one
+   column per query; in summary mode, one line per device with the time
+   range, the number of spectra, the device index and the query columns.
+
+   The file is mapped into memory. spectroread writes the spectra of each
+   device in time order, but with several devices, their records and chunks
+   are interleaved in the order they were ready, so the timestamps across
+   the file only rise per device. In a binary file of one device, the
+   records of the time range are found by binary search on their
+   timestamps; the workers check that the records they get are in order.
+   With several devices, all records are handed out, and the time range is
+   applied to every record. An archive is indexed by walking from chunk
+   header to chunk header; damaged chunk headers and chunks of a device
+   which go back in time are rejected there, and only the chunks which
+   overlap with the time range are decoded. The records or chunks are then
+   handed out in small batches to a pool of threads, which store the result
+   of each spectrum at its place in the output. The output follows the
+   order of the file.
+
+   Status: first version
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "decode.h"
+#include "output.h"
+#include "calib.h"
+#include "archive.h"
+
+#define MAX_QUERIES 16
+#define MAX_SOURCES 16      /* device headers in one file */
+#define BATCH_RECORDS 1024  /* records of a binary file per work item */
+
+/* query types */
+#define QUERY_BAND 0
+#define QUERY_MEAN 1
+#define QUERY_PEAK 2
+
+/* error handling */
+char *errormessage[] = {
+  "No error.",
+  "Error parsing time range option.", /* 1 */
+  "Error parsing query option.",
+  "Too many queries.",
+  "Error parsing device option.",
+  "Error parsing thread count option.", /* 5 */
+  "No file given.",
+  "Error opening file.",
+  "Not a binary or archive spectrum file.",
+  "No query given.",
+  "Cannot allocate memory.", /* 10 */
+  "Cannot start worker thread.",
+  "Damaged archive chunk.",
+  "Spectra of a device are not in time order.",
+};
+
+int emsg(int code) {
+  fprintf(stderr,"%s\n",errormessage[code]);
+  return code;
+};
+
+/* one query, and its pixel range for every device */
+struct query {
+    int type;
+    double lo, hi;                /* in nm */
+    int first[MAX_SOURCES], last[MAX_SOURCES]; /* pixels, last < first: none */
+};
+
+/* one device header of the file */
+struct source {
+    double lam_coeff[4];
+    double wavelength[SPECTRUM_PIXELS];
+};
+
+/* a batch of work: records of a binary file, or a chunk of an archive */
+struct workitem {
+    size_t offset;   /* of the first record or the chunk */
+    int count;       /* records in the batch */
+    long slot;       /* result slot of its first spectrum */
+};
+
+/* per spectrum result */
+struct result {
+    int valid;       /* in the time range and of the right device */
+    int device;
+    uint32_t sequence;
+    uint64_t timestamp;
+    double value[MAX_QUERIES];
+};
+
+/* per thread sums for summary mode */
+struct worker {
+    pthread_t thread;
+    int64_t sum[MAX_SOURCES][SPECTRUM_PIXELS];
+    long spectra[MAX_SOURCES];
+    uint64_t firsttime[MAX_SOURCES], lasttime[MAX_SOURCES];
+    uint16_t *frames; /* decoded chunk */
+};
+
+/* some global variables */
+struct query query[MAX_QUERIES];
+int queries = 0;
+struct source source[MAX_SOURCES];
+int sources;
+int onlydevice = -1;      /* all devices */
+int summary = 0;
+unsigned char *file;      /* mapped file */
+size_t filesize;
+int archive;              /* file is an archive, not binary */
+uint64_t tfrom, tto;      /* time range in ns of the monotonic clock */
+struct workitem *item;
+long items;
+long nextitem = 0;        /* next work item to hand out */
+struct result *result;
+long results;
+int outoforder = 0;       /* a worker found records going back in time */
+
+/* seconds, or h:mm:ss */
+int parse_time(char *text, double *seconds) {
+    int h, m;
+    double s;
+    if (sscanf(text, "%d:%d:%lf", &h, &m, &s)==3) {
+        *seconds = h*3600.0 + m*60.0 + s;
+        return 0;
+    }
+    return sscanf(text, "%lf", seconds)==1 ? 0 : -1;
+}
+
+int parse_query(char *text, struct query *q) {
+    char type[10];
+    if (sscanf(text, "%9[a-z]:%lf:%lf", type, &q->lo, &q->hi)!=3) return -1;
+    if (!strcmp(type, "band")) {
+        q->type = QUERY_BAND;
+    } else if (!strcmp(type, "mean")) {
+        q->type = QUERY_MEAN;
+    } else if (!strcmp(type, "peak")) {
+        q->type = QUERY_PEAK;
+    } else {
+        return -1;
+    }
+    return q->lo <= q->hi ? 0 : -1;
+}
+
+/* applies a query to baseline corrected values of a device */
+double evaluate(struct query *q, int device, int64_t *values, double scale) {
+    int i, best;
+    int64_t sum = 0;
+
+    if (q->last[device] < q->first[device]) return 0;
+    switch (q->type) {
+        case QUERY_BAND:
+        case QUERY_MEAN:
+            for (i=q->first[device]; i<=q->last[device]; i++) sum += values[i];
+            if (q->type==QUERY_BAND) return sum*scale;
+            return sum*scale/(q->last[device]-q->first[device]+1);
+        case QUERY_PEAK:
+            best = q->first[device];
+            for (i=best+1; i<=q->last[device]; i++)
+                if (values[i] > values[best]) best = i;
+            return source[device].wavelength[best];
+    }
+    return 0;
+}
+
+/* takes one spectrum into account */
+void take_spectrum(struct worker *w, uint16_t *values, uint64_t timestamp,
+                   uint32_t sequence, int device, long slot) {
+    int64_t corrected[SPECTRUM_PIXELS];
+    struct result *r = &result[slot];
+    int i, offset;
+
+    /* the device comes from the file; a damaged 32 bit field may be
+       negative as an int */
+    if (timestamp < tfrom || timestamp > tto ||
+        (unsigned int)device >= (unsigned int)sources ||
+        (onlydevice >= 0 && device != onlydevice)) return;
+    offset = (int)(baselevel_USB2000(values)+0.5);
+
+    if (summary) {
+        for (i=0; i<SPECTRUM_PIXELS; i++)
+            w->sum[device][i] += values[i]-offset;
+        if (!w->spectra[device]++) w->firsttime[device] = timestamp;
+        if (timestamp < w->firsttime[device]) w->firsttime[device] = timestamp;
+        if (timestamp > w->lasttime[device]) w->lasttime[device] = timestamp;
+        return;
+    }
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) corrected[i] = values[i]-offset;
+    r->valid = 1;
+    r->device = device;
+    r->sequence = sequence;
+    r->timestamp = timestamp;
+    for (i=0; i<queries; i++)
+        r->value[i] = evaluate(&query[i], device, corrected, 1.0);
+}
+
+void do_binary_item(struct worker *w, struct workitem *it) {
+    struct spectrum_record_header h;
+    uint16_t values[SPECTRUM_PIXELS];
+    unsigned char *record = file + it->offset;
+    uint64_t previous = 0;
+    int k;
+
+    /* the binary search needs the records of one device in time order */
+    if (sources == 1 && it->offset >= sizeof(struct spectrum_file_header)
+                                       + SPECTRUM_RECORD_SIZE) {
+        memcpy(&previous, record - SPECTRUM_RECORD_SIZE, sizeof(previous));
+        previous = le64toh(previous);
+    }
+    for (k=0; k<it->count; k++, record += SPECTRUM_RECORD_SIZE) {
+        memcpy(&h, record, sizeof(h));
+        if (sources == 1) {
+            if (le64toh(h.timestamp) < previous)
+                __sync_fetch_and_or(&outoforder, 1);
+            previous = le64toh(h.timestamp);
+        }
+        memcpy(values, record+sizeof(h), sizeof(values));
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+        int i;
+        for (i=0; i<SPECTRUM_PIXELS; i++) values[i] = le16toh(values[i]);
+#endif
+        take_spectrum(w, values, le64toh(h.timestamp), le32toh(h.sequence),
+                      le32toh(h.device), it->slot+k);
+    }
+}
+
+void do_archive_item(struct worker *w, struct workitem *it) {
+    struct archive_chunk_header h;
+    struct archive_frame_index ix;
+    unsigned char *chunk = file + it->offset;
+    int k, frames;
+
+    memcpy(&h, chunk, sizeof(h));
+    frames = archive_decode_chunk(chunk, filesize - it->offset, w->frames);
+    if (frames < 0) {
+        fprintf(stderr, "# damaged chunk at byte %zu skipped\n", it->offset);
+        return;
+    }
+    for (k=0; k<frames; k++) {
+        memcpy(&ix, chunk + sizeof(h) + k*sizeof(ix), sizeof(ix));
+        take_spectrum(w, w->frames + k*SPECTRUM_PIXELS,
+                      le64toh(ix.timestamp), le32toh(ix.sequence),
+                      le16toh(h.device), it->slot+k);
+    }
+}
+
+void *worker_thread(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    long i;
+
+    while ((i = __sync_fetch_and_add(&nextitem, 1)) < items) {
+        if (archive) {
+            do_archive_item(w, &item[i]);
+        } else {
+            do_binary_item(w, &item[i]);
+        }
+    }
+    return NULL;
+}
+
+/* timestamp of record n of a binary file */
+uint64_t record_time(size_t start, long n) {
+    uint64_t t;
+    memcpy(&t, file + start + n*SPECTRUM_RECORD_SIZE, sizeof(t));
+    return le64toh(t);
+}
+
+/* work items for the records of a binary file in the time range. Returns 0
+   or an error code. */
+int index_binary(size_t start, double from, double to) {
+    long records = (filesize-start)/SPECTRUM_RECORD_SIZE;
+    long lo, hi, mid, first, last, i;
+    uint64_t t0;
+
+    if (!records) return 0;
+    t0 = record_time(start, 0);
+    if (sources > 1) /* the first record need not be the earliest one */
+        for (i=1; i<records; i++)
+            if (record_time(start, i) < t0) t0 = record_time(start, i);
+    tfrom = t0 + (uint64_t)(from*1e9);
+    tto = to < 0 ? UINT64_MAX : t0 + (uint64_t)(to*1e9);
+
+    if (sources > 1) {
+        /* records are in order only per device, so all of them go out */
+        first = 0;
+        last = records;
+    } else {
+        /* first record at or after tfrom, first one after tto */
+        for (lo=0, hi=records; lo<hi; ) {
+            mid = (lo+hi)/2;
+            if (record_time(start, mid) < tfrom) lo = mid+1; else hi = mid;
+        }
+        first = lo;
+        for (hi=records; lo<hi; ) {
+            mid = (lo+hi)/2;
+            if (record_time(start, mid) <= tto) lo = mid+1; else hi = mid;
+        }
+        last = lo;
+    }
+
+    results = last-first;
+    items = (results+BATCH_RECORDS-1)/BATCH_RECORDS;
+    item = calloc(items ? items : 1, sizeof(struct workitem));
+    if (!item) return 10;
+    for (i=0; i<items; i++) {
+        item[i].offset = start + (first+i*BATCH_RECORDS)*SPECTRUM_RECORD_SIZE;
+        item[i].count = i<items-1 ? BATCH_RECORDS : results-i*BATCH_RECORDS;
+        item[i].slot = i*BATCH_RECORDS;
+    }
+    return 0;
+}
+
+/* work items for the chunks of an archive which overlap with the time
+   range. Returns 0 or an error code. */
+int index_archive(size_t start, double from, double to) {
+    struct archive_chunk_header h;
+    size_t pos, end;
+    long size, allocated = 0;
+    uint64_t t0 = UINT64_MAX, lasttime[MAX_SOURCES] = {0};
+    int device;
+    struct workitem *more;
+
+    /* check all chunk headers, and find the earliest spectrum and the end
+       of the complete chunks */
+    for (pos=start; pos<filesize; pos+=size) {
+        size = archive_chunk_size(file+pos, filesize-pos);
+        if (size==-1) {
+            fprintf(stderr, "# incomplete chunk at byte %zu ignored\n", pos);
+            break;
+        }
+        memcpy(&h, file+pos, sizeof(h));
+        device = le16toh(h.device);
+        if (size<0 || device>=sources) {
+            fprintf(stderr, "# damaged chunk header at byte %zu\n", pos);
+            return 12;
+        }
+        if (le64toh(h.firsttime) > le64toh(h.lasttime) ||
+            le64toh(h.firsttime) < lasttime[device]) {
+            fprintf(stderr, "# chunk at byte %zu goes back in time\n", pos);
+            return 13;
+        }
+        lasttime[device] = le64toh(h.lasttime);
+        if (le64toh(h.firsttime) < t0) t0 = le64toh(h.firsttime);
+    }
+    end = pos;
+    if (t0 == UINT64_MAX) t0 = 0; /* no chunks */
+    tfrom = t0 + (uint64_t)(from*1e9);
+    tto = to < 0 ? UINT64_MAX : t0 + (uint64_t)(to*1e9);
+
+    for (pos=start; pos<end; pos+=size) {
+        size = archive_chunk_size(file+pos, filesize-pos);
+        memcpy(&h, file+pos, sizeof(h));
+        if (le64toh(h.lasttime) < tfrom || le64toh(h.firsttime) > tto)
+            continue;
+        if (items==allocated) {
+            allocated = allocated ? 2*allocated : 1024;
+            more = realloc(item, allocated*sizeof(struct workitem));
+            if (!more) return 10;
+            item = more;
+        }
+        item[items].offset = pos;
+        item[items].count = le16toh(h.frames);
+        item[items].slot = results;
+        results += item[items].count;
+        items++;
+    }
+    return 0;
+}
+
+/* pixels of every query for every device */
+void prepare_queries(void) {
+    int q, d, i;
+    for (q=0; q<queries; q++) {
+        for (d=0; d<sources; d++) {
+            query[q].first[d] = SPECTRUM_PIXELS;
+            query[q].last[d] = -1;
+            for (i=0; i<SPECTRUM_PIXELS; i++) {
+                if (source[d].wavelength[i] < query[q].lo ||
+                    source[d].wavelength[i] > query[q].hi) continue;
+                if (i < query[q].first[d]) query[q].first[d] = i;
+                query[q].last[d] = i;
+            }
+        }
+    }
+}
+
+void print_values(double *value) {
+    int i;
+    for (i=0; i<queries; i++) {
+        switch (query[i].type) {
+            case QUERY_BAND: printf(" %.0f", value[i]); break;
+            case QUERY_MEAN: printf(" %.3f", value[i]); break;
+            case QUERY_PEAK: printf(" %.2f", value[i]); break;
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt; /* for parsing options */
+    double from = 0, to = -1; /* in s, -1: no limit */
+    int threads = 0;
+    int fd, i, d, k, retval;
+    struct stat st;
+    struct spectrum_file_header h;
+    union { double d; uint64_t u; } c;
+    size_t start;
+    uint64_t t0;
+    struct worker *worker;
+    double value[MAX_QUERIES];
+    long spectra;
+    uint64_t first, last;
+
+    /* parsing options */
+    opterr=0; /* be quiet when there are no options */
+    while ((opt=getopt(argc, argv, "f:t:q:e:sj:")) != EOF) {
+        switch (opt) {
+            case 'f': /* start of time range */
+                if (parse_time(optarg, &from) || from<0) return -emsg(1);
+                break;
+            case 't': /* end of time range */
+                if (parse_time(optarg, &to) || to<0) return -emsg(1);
+                break;
+            case 'q': /* query */
+                if (queries==MAX_QUERIES) return -emsg(3);
+                if (parse_query(optarg, &query[queries])) return -emsg(2);
+                queries++;
+                break;
+            case 'e': /* one device only */
+                if (sscanf(optarg,"%d",&onlydevice)!=1 || onlydevice<0)
+                    return -emsg(4);
+                break;
+            case 's': /* summary */
+                summary = 1;
+                break;
+            case 'j': /* number of threads */
+                if (sscanf(optarg,"%d",&threads)!=1 || threads<1)
+                    return -emsg(5);
+                break;
+        }
+    }
+    if (optind >= argc) return -emsg(6);
+    if (!queries) return -emsg(9);
+    if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+
+    /* map the file */
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st)) {
+        perror(argv[optind]);
+        return -emsg(7);
+    }
+    filesize = st.st_size;
+    if (filesize < sizeof(h)) return -emsg(8);
+    file = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        perror(argv[optind]);
+        return -emsg(7);
+    }
+    close(fd);
+
+    /* device headers */
+    memcpy(&h, file, sizeof(h));
+    if (!memcmp(h.magic, ARCHIVE_FILE_MAGIC, sizeof(h.magic))) {
+        archive = 1;
+    } else if (memcmp(h.magic, SPECTRUM_FILE_MAGIC, sizeof(h.magic)) ||
+               le32toh(h.recordsize) != SPECTRUM_RECORD_SIZE) {
+        return -emsg(8);
+    }
+    sources = le16toh(h.devices);
+    if (!sources) sources = 1; /* files from before several devices */
+    if (sources > MAX_SOURCES || filesize < sources*sizeof(h))
+        return -emsg(8);
+    for (d=0; d<sources; d++) {
+        memcpy(&h, file + d*sizeof(h), sizeof(h));
+        for (i=0; i<4; i++) {
+            memcpy(&c.u, &h.lam_coeff[i], sizeof(double));
+            c.u = le64toh(c.u);
+            source[d].lam_coeff[i] = c.d;
+        }
+        wavelength_table(source[d].lam_coeff, source[d].wavelength,
+                         SPECTRUM_PIXELS);
+    }
+    prepare_queries();
+
+    /* find what to look at */
+    start = sources*sizeof(h);
+    retval = archive ? index_archive(start, from, to)
+                     : index_binary(start, from, to);
+    if (retval) return -emsg(retval);
+    t0 = tfrom - (uint64_t)(from*1e9);
+    madvise(file, filesize, MADV_WILLNEED);
+
+    /* evaluate with a pool of threads */
+    result = calloc(results ? results : 1, sizeof(struct result));
+    worker = calloc(threads, sizeof(struct worker));
+    if (!result || !worker) return -emsg(10);
+    for (i=0; i<threads; i++) {
+        if (archive) {
+            worker[i].frames = malloc(ARCHIVE_CHUNK_FRAMES*SPECTRUM_PIXELS*
+                                      sizeof(uint16_t));
+            if (!worker[i].frames) return -emsg(10);
+        }
+        if (pthread_create(&worker[i].thread, NULL, worker_thread,
+                           &worker[i])) return -emsg(11);
+    }
+    for (i=0; i<threads; i++) pthread_join(worker[i].thread, NULL);
+    if (outoforder) return -emsg(13);
+
+    if (!summary) {
+        for (i=0; i<results; i++) {
+            if (!result[i].valid) continue;
+            printf("%.6f %u %d", (result[i].timestamp-t0)*1e-9,
+                   result[i].sequence, result[i].device);
+            print_values(result[i].value);
+        }
+        return 0;
+    }
+
+    /* add up what the threads found */
+    for (d=0; d<sources; d++) {
+        spectra = 0; first = UINT64_MAX; last = 0;
+        for (i=0; i<threads; i++) {
+            if (!worker[i].spectra[d]) continue;
+            if (i) {
+                for (k=0; k<SPECTRUM_PIXELS; k++)
+                    worker[0].sum[d][k] += worker[i].sum[d][k];
+            }
+            spectra += worker[i].spectra[d];
+            if (worker[i].firsttime[d] < first) first = worker[i].firsttime[d];
+            if (worker[i].lasttime[d] > last) last = worker[i].lasttime[d];
+        }
+        if (!spectra) continue;
+        for (i=0; i<queries; i++)
+            value[i] = evaluate(&query[i], d, worker[0].sum[d],
+                                query[i].type==QUERY_MEAN ? 1.0/spectra : 1.0);
+        printf("%.6f %.6f %ld %d", (first-t0)*1e-9, (last-t0)*1e-9, spectra,
+               d);
+        print_values(value);
+    }
+    return 0;
+}
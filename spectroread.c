@@ -1,14 +1,34 @@
 /* program to read a spectrum from the ocean optics USB2000/USB2000+ device.
 
-   usage: spectroread [-o fnam] [-i integrationtime] [-d devicefile] [-s serial]
-                      [-v verbosity]
+   usage: spectroread [-o fnam] [-i integrationtime] [-d devicefile]...
+                      [-s serial] [-v verbosity] [-n count] [-F format]
+                      [-c] [-T] [-p] [-S socket] [-D lmin:lmax:width]
+                      [-R capturefile] [-C kind] [-X correction] [-a count]
+                      [-e timeconstant] [-m kernel:width] [-A fill[:maxtime]]
+                      [-P threshold]
 
    -o fnam:             output file name. if the name - is specified, output
                         is sent to stdout - this is also the default.
    -i integrationtime:  specifies the integration time in ms. Default value
                         is 100.
    -d devicefile        specifies a USB device file. Default is
-                        /dev/ioboards/Spectrometer0
+                        /dev/ioboards/Spectrometer0. The option can be given
+                        several times; the devices are then read out
+                        concurrently, each in its own thread. -d auto adds
+                        all devices matching /dev/Spectrometer*. With several
+                        devices, a %d in the output file name is replaced by
+                        the device index to give one file per device.
+                        Otherwise, the output must be binary, and all devices
+                        share one file in which every record carries the
+                        index of its device.
+                        A device name sim:usb2000 or sim:usb2000p gives a
+                        simulated device of that type. Seed, peaks, noise,
+                        dark level and pacing can be appended, e.g.
+                        sim:usb2000p,seed=3,pace=max; see sim.c.
+                        A device name replay:capturefile plays back a file
+                        recorded with -R at the recorded pace, or as fast as
+                        possible with replay:capturefile,pace=max. The run
+                        ends at the end of the file.
    -s serial:           select a specific serial number (not implemented yet)
 
    -V verbosity:        commenting level. adds details at the end of a spectrum
@@ -20,35 +40,186 @@
                         16: ccd dark pixel level
                         32: stored wavelength coefficients
                         64: USB device ID
+                        128: sequence number and monotonic timestamp of the
+                             spectrum as recorded by the driver, and the
+                             number of spectra lost since the previous one
+   -n count:            number of spectra to take. Default is 1. With a value
+                        of 0, spectra are taken until the program is killed.
+                        The device is opened and initialized only once, and
+                        the spectra are retrieved back-to-back.
+   -F format:           output format. text (default) gives the list described
+                        below, bin gives a compact binary file with a header
+                        and one fixed size record of raw pixel values per
+                        spectrum, as described in output.h. archive stores
+                        the same values as differences to the previous
+                        spectrum in bit packed chunks, which is several times
+                        smaller for long recordings; see archive.c. The
+                        verbosity option has no effect on these formats.
+   -c                   read the wavelength coefficients from the device even
+                        if they are in the calibration cache, and refresh the
+                        cache. Normally, they are taken from the cache in
+                        $HOME/.spectroread if the serial number of the device
+                        is found there.
+   -T                   timing report. The durations of the setup steps and
+                        of the phases of every spectrum (request, decode,
+                        baseline, format, flush) are measured with the
+                        monotonic clock and sent to stderr as comment lines at
+                        the end, and every 100 spectra in continuous mode.
+                        For every spectrum phase, min, mean and 99th
+                        percentile cover the last 1000 spectra.
+   -p                   pipelined acquisition. A separate thread triggers the
+                        next exposure with TriggerPacket as soon as a spectrum
+                        has been read with EmptyPipe, and hands the raw data
+                        over to the decoding and output through a queue of
+                        PIPELINE_DEPTH spectra. If the output falls behind
+                        and the queue is full, spectra are dropped rather than
+                        delaying the device; this shows up as lost spectra.
+   -D lmin:lmax:width   envelope for display. Instead of all pixels, only
+                        the wavelength window from lmin to lmax (in nm) is
+                        written, divided into width columns of equal width.
+                        Each column gives a line with column index, center
+                        wavelength, and the smallest and largest baseline
+                        corrected value of its pixels, so narrow peaks keep
+                        their height. A column narrower than a pixel shows
+                        the nearest pixel. Text output only.
+   -R capturefile       record the raw data of every spectrum as it comes
+                        from the device, with timestamp and sequence number,
+                        and device ID, serial number and wavelength
+                        coefficients, in a capture file (see capture.h). With
+                        several devices, the name needs a %d as for -o.
+   -C kind              take a dark or reference frame: with kind dark (light
+                        blocked) or reference (light source without the
+                        sample), the mean of the -n spectra is stored in
+                        the calibration cache for this device and
+                        integration time, and nothing is written out; a -o
+                        file is not touched. See correct.c.
+   -X correction        replaces the baselevel corrected column of the text
+                        output: dark gives the raw value minus the dark
+                        frame of each pixel, transmittance gives
+                        (raw-dark)/(reference-dark), and absorbance gives
+                        -log10 of the transmittance. Dark and reference
+                        frame for the integration time must have been taken
+                        with -C before. Text output only, and not together
+                        with -D.
+   -a count             co-adding. The mean of every count spectra is written
+                        out instead of the single spectra; -n then counts
+                        these means.
+   -e timeconstant      exponential running average over about timeconstant
+                        spectra, which must be a power of two up to 256.
+                        Every spectrum is written out as the current average.
+   -m kernel:width      smoothing across width neighbouring pixels (odd, 3 to
+                        41), with kernel boxcar or savgol (quadratic
+                        Savitzky-Golay). Co-adding, running average and
+                        smoothing are applied in this order, before any other
+                        processing; see average.c.
+   -A fill[:maxtime]    automatic exposure. Starting from the -i value, the
+                        integration time is adjusted such that the bright
+                        part of the spectrum reaches fill (0 to 1) of the
+                        full range of the device, but never beyond maxtime
+                        ms (default 10000). The integration time comment
+                        gives the time of each spectrum; spectra taken while
+                        the time changes are skipped, so there may be fewer
+                        than -n. With -a or -e, the sum or running average
+                        starts anew after each change. Text output only,
+                        not together with -C, -X and -S; see exposure.c.
+   -P threshold         peak list. Instead of all pixels, each spectrum gives
+                        one line per peak of at least threshold counts above
+                        the baseline, with peak number, wavelength in nm,
+                        height in counts, FWHM in nm and area in counts*nm.
+                        A peak keeps its number as long as it is followed
+                        from spectrum to spectrum. Text output only, not
+                        together with -D and -X; see peaks.c.
+   -r lmin:lmax         wavelength window. Only the pixels from lmin to lmax
+                        (in nm) are written. The option can be given up to 16
+                        times for several windows, which are written in that
+                        order and must not overlap. Text output only, not
+                        together with -D, -X and -P; see region.c.
+   -b binning           pixel binning. The pixels of each window, or of the
+                        whole spectrum, are summed up in bins of binning
+                        pixels, giving one line with the first pixel index,
+                        mean wavelength, sum of the raw values and sum of the
+                        baseline corrected values per bin. Pixels at the end
+                        of a window which do not fill a bin are left out.
+   -S socket            server mode. The device is set up once, and the
+                        program keeps running and serves spectra, the
+                        calibration and integration time changes to any
+                        number of clients on the Unix domain socket of that
+                        name. The protocol is described in serve.h. A
+                        socket left there is replaced; any other file of
+                        that name is an error.
 
    The program emits to stdout or the target file name a space-separated list
    with the following entries:
    pixel index, wavelength in nm, raw amplitude and a few comment options
 
+   If more than one spectrum is requested, each spectrum (including its
+   comment lines) is terminated with a line
+   # end of spectrum <n>
+   followed by two empty lines, so gnuplot sees every spectrum as a separate
+   data block which can be selected with the index keyword.
 
    Status: first version 26.4.09chk
            translation to work also with usb2000+ 17.7.09chk
+           continuous acquisition on one open device handle (-n option)
+           driver timestamps and sequence numbers
+           binary output format
+           calibration cache per device, wavelength table
+           phase timing (-T option)
+           pipelined acquisition thread (-p option)
+           several spectrometers at once
+           simulated devices, server mode (-S option)
+           min/max envelope for display (-D option)
+           raw capture and replay (-R option)
+           compressed archive format
+           dark and reference frames, transmittance and absorbance
+           co-adding, running average and smoothing
+           automatic exposure (-A option)
+           peak finding (-P option)
+           wavelength windows and pixel binning (-r, -b options)
 
    ToDo: Keep it so general that a usb200+ or 400+ can be used as well.
 
  */
 
-#include <fcntl.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include <glob.h>
 
-#include "usb2000.h"
-
-#define USB_DEVICE_ID_USB2000 0x1002
+#include "device.h"
+#include "decode.h"
+#include "output.h"
+#include "calib.h"
+#include "timing.h"
+#include "serve.h"
+#include "decimate.h"
+#include "capture.h"
+#include "archive.h"
+#include "correct.h"
+#include "average.h"
+#include "exposure.h"
+#include "peaks.h"
+#include "region.h"
 
 #define DEFAULT_DEVICENAME "/dev/Spectrometer0"
 #define DEFAULT_INTEGRATIONTIME 100
 #define DEFAULT_VERBOSITY 31 /* sernum, date/time, integtime, gencomment */
 #define FILENAMLEN 100
+#define DEFAULT_SPECTRUMCOUNT 1
+#define TIMING_REPORT_INTERVAL 100 /* spectra between timing reports */
+#define PIPELINE_DEPTH 8 /* raw spectra queued between the threads */
+#define MAX_DEVICES 16
+#define PEAK_LINE 80 /* longest line of a peak list */
+#define DISCOVERY_PATTERN "/dev/Spectrometer*"
+
+/* output formats */
+#define FORMAT_TEXT 0
+#define FORMAT_BINARY 1
+#define FORMAT_ARCHIVE 2
 
 /* error handling */
 char *errormessage[] = {
@@ -61,6 +232,37 @@ char *errormessage[] = {
   "; error opening spectrometer device.",
   "Error opening target file.",
   "; error when retreiving spectrum from device.",
+  "Error parsing spectrum count option.",
+  "Spectrum count out of range (must not be negative).", /* 10 */
+  "Cannot allocate output buffer.",
+  "Error writing to target file.",
+  "Unknown output format (must be text, bin or archive).",
+  "Cannot start acquisition thread.",
+  "Too many devices.", /* 15 */
+  "Cannot find any spectrometer devices.",
+  "Text output of several devices needs %d in the target file name.",
+  "Cannot set up the server socket.",
+  "Only one device can be served.",
+  "Error parsing decimation option.", /* 20 */
+  "Decimation window contains no pixels, or width out of range.",
+  "Decimation needs text output.",
+  "Several devices need %d in the capture file name.",
+  "Error writing to capture file.",
+  "Error parsing frame option (must be dark or reference).", /* 25 */
+  "Error parsing correction option (must be dark, transmittance or absorbance).",
+  "No dark or reference frame for this device and integration time; take one with -C.",
+  "Correction needs text output and cannot be combined with decimation.",
+  "Cannot store the frame in the calibration cache.",
+  "Error parsing averaging option.", /* 30 */
+  "Averaging parameter out of range.",
+  "Error parsing exposure option, or out of range.",
+  "Automatic exposure needs text output and cannot be combined with -C, -X or -S.",
+  "Error parsing peak threshold option.",
+  "Peak finding needs text output and cannot be combined with -D or -X.", /* 35 */
+  "Error parsing wavelength window option, too many windows, or windows overlap.",
+  "Error parsing binning option, or out of range.",
+  "Wavelength windows and binning need text output and cannot be combined with -D, -X or -P.",
+  "Wavelength windows contain no pixels, or are narrower than a bin.",
 };
 
 int emsg(int code) {
@@ -69,107 +271,470 @@ int emsg(int code) {
 };
 
 /* some global variables */
-FILE* outhandle; /* for output of data */
-double lam_coeff[4]; /* coefficients to convert into wavelength */
+int integrationtime = DEFAULT_INTEGRATIONTIME; /* currently in millisec */
+int verbositylevel = DEFAULT_VERBOSITY;
+int spectrumcount = DEFAULT_SPECTRUMCOUNT; /* 0 means no limit */
+int acquirecount; /* spectra to take from a device for that */
+int outputformat = FORMAT_TEXT;
+int refreshcalibration = 0; /* ignore cached wavelength coefficients */
+int timingreport = 0; /* send phase durations to stderr */
+int pipelined = 0; /* separate acquisition thread */
+int devices = 0; /* number of spectrometers in use */
+int decimating = 0; /* write min/max envelope instead of all pixels */
+double decimation_lmin, decimation_lmax; /* its wavelength window in nm */
+int decimation_columns; /* ...and its width */
+int correctionmode = CORRECT_NONE; /* what goes into the last text column */
+char *framekind = NULL; /* "dark" or "reference" while taking a frame */
+int coadd = 1; /* spectra per output */
+int emashift = 0; /* running average over 2**emashift spectra */
+int smoothing = SMOOTH_NONE, smoothingwidth; /* kernel across pixels */
+int averaging = 0; /* any of the above */
+int autoexposure = 0; /* adjust the integration time */
+double exposuretarget; /* ...to reach this fill level */
+int exposuremax = 10000; /* ...within this time in ms */
+int peakfinding = 0; /* write peak lists */
+int peakthreshold; /* ...of peaks higher than this */
+int selecting = 0; /* write wavelength windows or bins only */
+double regionlo[MAX_REGIONS], regionhi[MAX_REGIONS]; /* windows in nm */
+int regions = 0; /* ...and their number; 0 is the whole spectrum */
+int binning = 1; /* pixels summed per line */
+pthread_mutex_t outputlock = PTHREAD_MUTEX_INITIALIZER; /* for shared file */
+
+/* queue between acquisition thread and output in pipelined mode. The
+   acquisition thread fills slot (head+count)%PIPELINE_DEPTH, the output
+   works on slot head and releases it when done. */
+struct rawspectrum {
+    unsigned char data[4100];
+    struct spectrum_frame_info info;
+};
+struct rawqueue {
+    struct rawspectrum slot[PIPELINE_DEPTH];
+    int head, count;
+    int done;   /* acquisition thread has finished */
+    int error;  /* ...and this is why, or 0 */
+    unsigned long dropped; /* spectra which did not fit into the queue */
+    int newtime; /* integration time in ms to set before the next exposure,
+                    0 if none */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/* everything we know about one spectrometer */
+struct spectrometer {
+    char devicename[FILENAMLEN];
+    int index;    /* position in the device list */
+    struct device *dev; /* usb device or simulation */
+    int deviceID; /* stores the usb deviceID of the spectrometer */
+    char serial[20]; /* serial number of the device */
+    double lam_coeff[4]; /* coefficients to convert into wavelength */
+    double wavelength[SPECTRUM_PIXELS]; /* wavelength of every pixel in nm */
+    FILE *outhandle; /* for output of data */
+    int capturefd; /* raw data goes there too if not -1 */
+    int sharedoutput; /* outhandle is used by several devices */
+    struct textformat text;
+    struct archive_writer archive; /* chunk being collected */
+    struct decimation decimation; /* screen columns for the envelope */
+    struct correction correction; /* dark and reference frame */
+    struct frameaverage average; /* while taking a frame */
+    struct averaging averaging; /* co-adding and smoothing */
+    struct exposure exposure; /* automatic integration time */
+    struct peakfinder peaks; /* peaks of the last spectrum */
+    struct selection selection; /* pixels in the wavelength windows */
+    unsigned int lastsequence; /* of the last spectrum */
+    struct rawqueue queue; /* for pipelined mode */
+    pthread_t thread; /* when running several devices */
+    int error; /* result of that thread */
+} spectrometer[MAX_DEVICES];
 
-/*function to convert the return string of a USB2000 into a list of integers */
-void generate_numbers_USB2000(unsigned char *data, int *values) {
+/* writes one spectrum with its comments to the output file. Returns 0 on
+   success or -1 if the spectrum could not be written. */
+int output_spectrum(struct spectrometer *sp, uint16_t *rawvalues,
+                    float baselevel, struct spectrum_frame_info *frameinfo,
+                    unsigned int lost) {
     int i;
-    for (i=0; i<2048; i++)
-        values[i] = data[(i%64)+(i>>6)*128+64]*256 + data[(i%64)+(i>>6)*128];
+    time_t tme;
+    char timestring[30];
+    char *text;
+    int textlen;
+    uint16_t minvalues[SPECTRUM_PIXELS], maxvalues[SPECTRUM_PIXELS];
+    int32_t sums[SPECTRUM_PIXELS];
+    float values[SPECTRUM_PIXELS];
+    FILE *outhandle = sp->outhandle;
+    struct peak *k;
+    int n;
+    static char *column4[] = {"baselevel-corrected ampl",
+                              "dark-corrected ampl", "transmittance",
+                              "absorbance"};
+    static int decimals[] = {0, 1, 5, 5};
+
+    /* generate first header */
+    if ((verbositylevel & 8) && peakfinding)
+        fprintf(outhandle,"# peaks of the ocean optics spectrometer.\n# column 1: peak number, column 2: wavelength in nm\n# column 3: height 4: FWHM in nm 5: area in counts*nm\n\n");
+    else if ((verbositylevel & 8) && selecting)
+        fprintf(outhandle,"# output of the ocean optics spectrometer, bins of %d pixels.\n# column 1: first pixel index, column 2: mean wavelength in nm\n# column 3: raw amplitude sum 4: baselevel-corrected sum\n\n",
+                binning);
+    else if (verbositylevel & 8) /* generic header */
+        fprintf(outhandle,"# output of the ocean optics spectrometer.\n# comumn 1: pixel index, column 2: wavelength in nm\n# column 3: raw amplitude 4: %s\n\n",
+                column4[correctionmode]);
+
+    /* output main spectrum in one go, bypassing stdio */
+    if (peakfinding) {
+        n = find_peaks(&sp->peaks, rawvalues, (int)(baselevel+0.5));
+        for (i=0, textlen=0; i<n; i++) {
+            k = &sp->peaks.peak[i];
+            textlen += snprintf(sp->text.buffer+textlen, PEAK_LINE,
+                                "%d %.3f %.1f %.3f %.1f\n", k->id,
+                                k->wavelength, k->height, k->fwhm, k->area);
+        }
+        text = sp->text.buffer;
+    } else if (correctionmode!=CORRECT_NONE) {
+        apply_correction(&sp->correction, rawvalues, values);
+        textlen = format_values_text(&sp->text, rawvalues, values,
+                                     decimals[correctionmode], &text);
+    } else if (decimating) {
+        decimate_minmax(&sp->decimation, rawvalues, minvalues, maxvalues);
+        textlen = format_envelope_text(&sp->text, minvalues, maxvalues,
+                                       (int)(baselevel+0.5), &text);
+    } else if (selecting) {
+        sum_selection(&sp->selection, rawvalues, sums);
+        textlen = format_sums_text(&sp->text, sums, binning,
+                                   (int)(baselevel+0.5), &text);
+    } else {
+        textlen = format_spectrum_text(&sp->text, rawvalues,
+                                       (int)(baselevel+0.5), &text);
+    }
+    timing_lap(T_FORMAT);
+    fflush(outhandle);
+    if (write_all(fileno(outhandle), text, textlen)) return -1;
+
+    if (verbositylevel & 8) fprintf(outhandle,"\n"); /* some space */
+    /* output the rest of the comments */
+    if (verbositylevel & 1) {
+        fprintf(outhandle,"# Serial No. %s\n",sp->serial);
+    }
+    if (verbositylevel & 2 ) {
+        tme=time(NULL);
+        strftime(timestring,30,"%a %d %b %y %X %Z",localtime(&tme));
+        fprintf(outhandle,"# %s\n",timestring);
+    }
+    if (verbositylevel & 4) {
+        fprintf(outhandle,"# Integration time: %d ms\n",
+                autoexposure ? sp->exposure.frametime : integrationtime);
+    }
+    if (verbositylevel & 16) {
+        fprintf(outhandle,
+                "# Black level from blocked pixels (%d to %d): %8.2f\n",
+                BLACKLEVEL_START, BLACKLEVEL_END, baselevel);
+    }
+    if (verbositylevel & 32) {
+        fprintf(outhandle, "# wavelength conversion coefficients, lam = sum_i c_i index**i\n");
+        for (i=0;i<4;i++ ) fprintf(outhandle, "#  c%1d = %lf\n",
+                                   i, sp->lam_coeff[i]);
+    }
+    if (verbositylevel & 64) {
+        fprintf(outhandle, "# USB device ID: 0x%x\n",sp->deviceID);
+    }
+    if (verbositylevel & 128) {
+        fprintf(outhandle, "# Sequence number: %u, timestamp: %llu.%09llu s\n",
+                frameinfo->sequence, frameinfo->timestamp/1000000000ULL,
+                frameinfo->timestamp%1000000000ULL);
+        if (lost) fprintf(outhandle, "# Spectra lost before this one: %u\n",
+                          lost);
+    }
+    return 0;
 }
-void generate_numbers_USB2000p(unsigned char *data, int *values) {
-    int i;
-    for (i=0; i<2048; i++)
-        values[i] = data[i*2+1]*256 + data[2*i];
+
+/* changes the integration time of a device to ms. In pipelined mode, only
+   the acquisition thread talks to the device; it sets the new time between
+   two exposures. Returns 0 or -1. */
+int change_integrationtime(struct spectrometer *sp, int ms) {
+    if (!pipelined)
+        return device_set_integrationtime(sp->dev, sp->deviceID, ms);
+    pthread_mutex_lock(&sp->queue.lock);
+    sp->queue.newtime = ms;
+    pthread_mutex_unlock(&sp->queue.lock);
+    return 0;
 }
 
+/* decodes a raw spectrum and writes it to the output in the chosen format.
+   Returns 0, or an error code for emsg(). */
+int process_spectrum(struct spectrometer *sp, unsigned char *data,
+                     struct spectrum_frame_info *frameinfo,
+                     unsigned long spectrumindex) {
+    unsigned int lost; /* spectra missing between two retrieved ones */
+    uint16_t rawvalues[SPECTRUM_PIXELS];  /* for storing numerical values */
+    float baselevel;  /* generated out of beginning pxels */
+    int err, ms;
 
-#define BLACKLEVEL_START 6
-#define BLACKLEVEL_END 20
-float baselevel_USB2000( int *values) {
-    int i;
-    int sum=0;
-    for (i=BLACKLEVEL_START;i<=BLACKLEVEL_END;i++) sum += values[i];
-    return ((float) sum)/(BLACKLEVEL_END-BLACKLEVEL_START+1);
+    timing_cycle();
+    if (timingreport && spectrumindex &&
+        !(spectrumindex % TIMING_REPORT_INTERVAL))
+        timing_report(stderr);
+    timing_begin();
+
+    if (sp->capturefd != -1 &&
+        write_capture_record(sp->capturefd, data, frameinfo->timestamp,
+                             frameinfo->sequence)) {
+        perror("spectroread");
+        return 24;
+    }
+
+    lost = spectrumindex ? frameinfo->sequence-sp->lastsequence-1 : 0;
+    sp->lastsequence = frameinfo->sequence;
+
+    /* convert return string into a list of numbers */
+    if (sp->deviceID==USB_DEVICE_ID_USB2000) {
+        generate_numbers_USB2000(data, rawvalues);
+    } else {
+        generate_numbers_USB2000p(data, rawvalues);
+    }
+    if (autoexposure) {
+        ms = control_exposure(&sp->exposure, rawvalues,
+                              baselevel_USB2000(rawvalues));
+        if (ms<0) return 0; /* integration time unknown */
+        if (ms) {
+            if (change_integrationtime(sp, ms)) return 8;
+            /* a sum or average must not mix integration times */
+            if (averaging) {
+                restart_averaging(&sp->averaging);
+                return 0;
+            }
+        }
+    }
+    if (averaging && !average_spectrum(&sp->averaging, rawvalues))
+        return 0; /* wait for more */
+    timing_lap(T_DECODE);
+    baselevel=baselevel_USB2000(rawvalues);
+    timing_lap(T_BASELINE);
+
+    if (framekind) { /* only collect */
+        add_to_average(&sp->average, rawvalues);
+        return 0;
+    }
+
+    if (outputformat==FORMAT_BINARY) {
+        /* records are written in one piece, but may be larger than what a
+           pipe takes atomically */
+        if (sp->sharedoutput) pthread_mutex_lock(&outputlock);
+        err = write_binary_record(fileno(sp->outhandle), rawvalues,
+                                  frameinfo->timestamp, frameinfo->sequence,
+                                  sp->index);
+        if (sp->sharedoutput) pthread_mutex_unlock(&outputlock);
+        if (err) {
+            perror("spectroread");
+            return 12;
+        }
+        timing_lap(T_FLUSH);
+        return 0;
+    }
+
+    if (outputformat==FORMAT_ARCHIVE) {
+        err = 0;
+        if (archive_add_frame(&sp->archive, rawvalues, frameinfo->timestamp,
+                              frameinfo->sequence)) {
+            if (sp->sharedoutput) pthread_mutex_lock(&outputlock);
+            err = archive_flush(&sp->archive, fileno(sp->outhandle));
+            if (sp->sharedoutput) pthread_mutex_unlock(&outputlock);
+        }
+        if (err) {
+            perror("spectroread");
+            return 12;
+        }
+        timing_lap(T_FLUSH);
+        return 0;
+    }
+
+    if (output_spectrum(sp, rawvalues, baselevel, frameinfo, lost)) {
+        perror("spectroread");
+        return 12;
+    }
+
+    /* frame delimiter for continuous mode */
+    if (spectrumcount!=1)
+        fprintf(sp->outhandle,"# end of spectrum %lu\n\n\n",
+                spectrumindex/coadd);
+    fflush(sp->outhandle); /* make spectrum visible to a reading pipe */
+    timing_lap(T_FLUSH);
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    int handle; /* file handle for usb device */
-    int retval;
-    int i;
-    int opterr, opt; /* for parsing options */
-    unsigned char data2[4100];
-    char *data = (char *) data2;
-    int rawvalues[2048];  /* for storing numerical values */
-    int integrationtime = DEFAULT_INTEGRATIONTIME; /* currently in millisec */
-    char devicename[FILENAMLEN] = DEFAULT_DEVICENAME;
-    int verbositylevel = DEFAULT_VERBOSITY;
-    char outfilename[FILENAMLEN] = "-";
-    float baselevel;  /* generated out of beginning pxels */
-    double lambda;   /* for generating wavelength */
-    time_t tme;
-    int deviceID; /* stores the usb deviceID of the spectrometer */
-   
+/* acquisition thread of the pipelined mode. The next exposure is triggered
+   right after a spectrum has been read, before the spectrum is handed over,
+   so the device never waits for the output. */
+void *acquisition_thread(void *arg) {
+    struct spectrometer *sp = (struct spectrometer *)arg;
+    struct rawqueue *q = &sp->queue;
+    unsigned char data[4100];
+    struct spectrum_frame_info info;
+    unsigned long accepted = 0; /* spectra put into the queue */
+    struct rawspectrum *r;
+    int retval, room, newtime;
 
-    /* parsing options */
-    opterr=0; /* be quiet when there are no options */
-    while ((opt=getopt(argc, argv, "V:o:d:i:")) != EOF) {
-        switch (opt) {
-            case 'V': /* set verbosity level */
-                if (sscanf(optarg,"%d",&verbositylevel)!=1 ) return -emsg(1);
-                break;
-            case 'o': /* set outout file name */
-                if (sscanf(optarg,"%99s",outfilename)!=1 ) return -emsg(2);
-                outfilename[FILENAMLEN-1]=0; /* close string */
-                break;
-            case 'd': /*enter device file name */
-                if (sscanf(optarg,"%99s",devicename)!=1 ) return -emsg(3);
-                outfilename[FILENAMLEN-1]=0; /* close string */
+    if (device_ioctl(sp->dev,TriggerPacket,0)) {
+        retval = 8;
+        goto out;
+    }
+    while (1) {
+        timing_begin();
+        retval=device_ioctl(sp->dev,EmptyPipe,data);
+        timing_lap(T_REQUEST);
+        if (retval) {
+            retval = errno==ENODATA ? 0 : 8; /* end of a replay */
+            break;
+        }
+        device_frameinfo(sp->dev, &info, accepted+q->dropped);
+
+        /* the output only frees slots, so a free slot stays free */
+        pthread_mutex_lock(&q->lock);
+        room = q->count < PIPELINE_DEPTH;
+        newtime = q->newtime;
+        q->newtime = 0;
+        pthread_mutex_unlock(&q->lock);
+        if (room) accepted++;
+
+        /* start the next exposure, unless we have enough */
+        if (!acquirecount || accepted<acquirecount) {
+            if ((newtime &&
+                 device_set_integrationtime(sp->dev, sp->deviceID, newtime)) ||
+                device_ioctl(sp->dev,TriggerPacket,0)) {
+                retval = 8;
                 break;
-            case 'i': /* set integration time */
-                if (sscanf(optarg,"%d",&integrationtime)!=1 ) return -emsg(4);
-                if (integrationtime<1 || integrationtime >10000)
-                    return -emsg(5); /* out of range */
-                break;          
+            }
+        }
+
+        pthread_mutex_lock(&q->lock);
+        if (room) {
+            r = &q->slot[(q->head+q->count)%PIPELINE_DEPTH];
+            memcpy(r->data, data, sizeof(r->data));
+            r->info = info;
+            q->count++;
+            pthread_cond_signal(&q->changed);
+        } else {
+            q->dropped++;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (acquirecount && accepted>=acquirecount) {
+            retval = 0;
+            break;
         }
     }
+ out:
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    q->error = retval;
+    pthread_cond_signal(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
 
-    /* opening device file */
-    handle=open(devicename,O_RDWR);
-    if (handle==-1) {
+/* output side of the pipelined mode; returns 0 or an error code */
+int run_pipelined(struct spectrometer *sp) {
+    struct rawqueue *q = &sp->queue;
+    pthread_t thread;
+    struct rawspectrum *r;
+    unsigned long spectrumindex = 0;
+    int retval = 0;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+    if (pthread_create(&thread, NULL, acquisition_thread, sp)) return 14;
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->count && !q->done)
+            pthread_cond_wait(&q->changed, &q->lock);
+        if (!q->count) { /* done and nothing left */
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        r = &q->slot[q->head];
+        pthread_mutex_unlock(&q->lock);
+
+        retval = process_spectrum(sp, r->data, &r->info, spectrumindex++);
+
+        pthread_mutex_lock(&q->lock);
+        q->head = (q->head+1) % PIPELINE_DEPTH;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+        if (retval) break;
+    }
+    if (retval) pthread_cancel(thread);
+    pthread_join(thread, NULL);
+
+    if (q->dropped)
+        fprintf(stderr, "# %s: %lu spectra dropped, output too slow\n",
+                sp->devicename, q->dropped);
+    if (!retval && q->error) {
         perror("spectroread");
-        return -emsg(6);
+        retval = q->error;
     }
+    return retval;
+}
 
-    /* open target file */
-    if (strcmp(outfilename,"-")) {
-        outhandle = fopen(outfilename,"w+");
-        if (!outhandle) return -emsg(7);
-    } else {
-        outhandle=stdout;
+/* opens and prepares a spectrometer. Returns 0, or an error code. */
+int setup_device(struct spectrometer *sp) {
+    unsigned char data2[4100];
+    float dark[SPECTRUM_PIXELS], reference[SPECTRUM_PIXELS];
+    int i, retval;
+
+    /* opening device file */
+    timing_begin();
+    sp->dev=device_open(sp->devicename);
+    timing_lap(T_OPEN);
+    if (!sp->dev) {
+        perror(sp->devicename);
+        return 6;
     }
 
     /* get device ID */
-    ioctl(handle,GetDeviceID,&deviceID);
+    timing_begin();
+    device_ioctl(sp->dev,GetDeviceID,&sp->deviceID);
+    timing_lap(T_DEVICEID);
 
     /* prepare device */
-    ioctl(handle,SetIntegrationTime,
-          integrationtime * ((deviceID==USB_DEVICE_ID_USB2000)?1:1000));
-    ioctl(handle,InitializeUSB2000);
+    device_set_integrationtime(sp->dev, sp->deviceID, integrationtime);
+    device_ioctl(sp->dev,InitializeUSB2000,0);
+    timing_lap(T_INIT);
+
+    /* the serial number identifies the device in the calibration cache */
+    data2[0]=0; /* query serial no */
+    device_ioctl(sp->dev,QueryInformation,&data2); data2[17]=0;
+    memcpy(sp->serial, &data2[2], 16); /* string is closed at data2[17] */
 
     /* get wavelength conversion coefficients */
-    for (i=0;i<4;i++) {
-        data2[0]=i+1;
-        ioctl(handle,QueryInformation,&data2);
-        data2[17]=0;
-        sscanf((char *)&data2[2],"%lf",&lam_coeff[i]);
+    if (refreshcalibration ||
+        load_calibration(sp->serial, sp->deviceID, sp->lam_coeff)) {
+        for (i=0;i<4;i++) {
+            data2[0]=i+1;
+            device_ioctl(sp->dev,QueryInformation,&data2);
+            data2[17]=0;
+            sscanf((char *)&data2[2],"%lf",&sp->lam_coeff[i]);
+        }
+        /* fine if this fails */
+        store_calibration(sp->serial, sp->deviceID, sp->lam_coeff);
     }
-   
+    timing_lap(T_QUERY);
+    wavelength_table(sp->lam_coeff, sp->wavelength, SPECTRUM_PIXELS);
+
+    /* dark and reference frame are taken with the same integration time */
+    if (correctionmode!=CORRECT_NONE && !framekind) {
+        if (load_frame("dark", sp->serial, sp->deviceID, integrationtime,
+                       dark, SPECTRUM_PIXELS)) return 27;
+        if (correctionmode!=CORRECT_DARK &&
+            load_frame("reference", sp->serial, sp->deviceID,
+                       integrationtime, reference, SPECTRUM_PIXELS))
+            return 27;
+        prepare_correction(&sp->correction, correctionmode, dark,
+                           correctionmode!=CORRECT_DARK ? reference : NULL);
+    }
+
     /* clear input pipeline - this is still a bit dirty */
-    ioctl(handle,SetTimeout,20); /* Let's not waste too much time */
+    device_ioctl(sp->dev,SetTimeout,20); /* Let's not waste too much time */
+    timing_begin();
     do {
-        retval=ioctl(handle,EmptyPipe,&data2);
+        retval=device_ioctl(sp->dev,EmptyPipe,&data2);
+        timing_lap(T_DRAIN);
     } while (retval!=ETIMEDOUT);  /* wait until line is empty */
 
    
@@ -179,70 +744,388 @@ int main(int argc, char *argv[]) {
        information is actually available with the integration time.
        As there is no reason why the call should fail, the timeout
        could be reasonably long as well.... */
-    ioctl(handle,SetTimeout,10000);
+    device_ioctl(sp->dev,SetTimeout,10000);
 
-    /* do the actuall spectrum retrieval */
-    retval=ioctl(handle,RequestSpectra,&data2);
-   
-    if (retval) {
-        perror("specroread");
-        return -emsg(8);
-    } else {
-        /* convert return string into a list of numbers */
-        if (deviceID==USB_DEVICE_ID_USB2000) {
-            generate_numbers_USB2000(data2, rawvalues);
+    /* index and wavelength columns of the text output are fixed from now */
+    if (outputformat==FORMAT_TEXT) {
+        if (selecting) {
+            if (prepare_selection(&sp->selection, sp->wavelength, regionlo,
+                                  regionhi, regions, binning)) return 39;
+            if (prepare_indexed_text_format(&sp->text, sp->selection.first,
+                                            sp->selection.lambda,
+                                            sp->selection.lines)) return 11;
+        } else if (!decimating) {
+            if (prepare_text_format(&sp->text, sp->wavelength,
+                                    SPECTRUM_PIXELS)) return 11;
         } else {
-            generate_numbers_USB2000p(data2, rawvalues);
+            if (prepare_decimation(&sp->decimation, sp->wavelength,
+                                   decimation_lmin, decimation_lmax,
+                                   decimation_columns)) return 21;
+            if (prepare_text_format(&sp->text, sp->decimation.lambda,
+                                    decimation_columns)) return 11;
         }
-        baselevel=baselevel_USB2000(rawvalues);
+    }
+    if (peakfinding) /* the lists go into the buffer of sp->text */
+        prepare_peaks(&sp->peaks, peakthreshold, sp->lam_coeff);
+    /* in pipelined mode, the queue and the exposure under way may still
+       hold spectra of the old time */
+    if (autoexposure)
+        prepare_exposure(&sp->exposure, exposuretarget, exposuremax,
+                         device_fullscale(sp->deviceID), integrationtime,
+                         pipelined ? PIPELINE_DEPTH+1 : 1);
+    if (averaging &&
+        prepare_averaging(&sp->averaging, coadd, emashift, smoothing,
+                          smoothingwidth)) return 31;
+    if (outputformat==FORMAT_ARCHIVE &&
+        archive_init(&sp->archive, sp->sharedoutput ? sp->index : 0))
+        return 11;
+    return 0;
+}
+
+/* acquisition loop of one device; the device stays open and initialized.
+   Returns 0 or an error code. */
+int run_device(struct spectrometer *sp) {
+    unsigned char data2[4100];
+    unsigned long spectrumindex; /* counts the retrieved spectra */
+    struct spectrum_frame_info frameinfo; /* sequence and time of spectrum */
+    int retval;
+
+    if (pipelined) return run_pipelined(sp);
 
-        /* generate first header */
-        if (verbositylevel & 8) /* generic header */
-            fprintf(outhandle,"# output of the ocean optics spectrometer.\n# comumn 1: pixel index, column 2: wavelength in nm\n# column 3: raw amplitude 4: baselevel-corrected ampl\n\n");
+    for (spectrumindex=0;
+         !acquirecount || spectrumindex<acquirecount; spectrumindex++) {
+        /* do the actuall spectrum retrieval */
+        timing_begin();
+        retval=device_ioctl(sp->dev,RequestSpectra,&data2);
+        timing_lap(T_REQUEST);
 
-        /* output main spectrum */
-        for (i=0;i<2048;i++) {
-            lambda = lam_coeff[0] + i * (lam_coeff[1] +
-                                         i*(lam_coeff[2]+i*lam_coeff[3]));
-            fprintf(outhandle,"%d %7.2f %d %d\n",
-                    i, lambda, rawvalues[i], rawvalues[i]-(int)(baselevel+0.5));
+        if (retval) {
+            if (errno==ENODATA) break; /* end of a replay */
+            perror(sp->devicename);
+            return 8;
         }
+        device_frameinfo(sp->dev, &frameinfo, spectrumindex);
+
+        retval = process_spectrum(sp, data2, &frameinfo, spectrumindex);
+        if (retval) return retval;
+    }
+    return 0;
+}
+
+/* thread running one of several devices */
+void *device_thread(void *arg) {
+    struct spectrometer *sp = (struct spectrometer *)arg;
+    sp->error = run_device(sp);
+    return NULL;
+}
+
+/* file name of device n: the first %d of pattern becomes n, and the rest
+   is copied as it is. The pattern is never used as a printf format, so
+   other % signs in it are harmless. */
+void device_filename(char *name, int size, char *pattern, int n) {
+    char *d = strstr(pattern, "%d");
 
-        if (verbositylevel & 8) fprintf(outhandle,"\n"); /* some space */
-        /* output the rest of the comments */
-        if (verbositylevel & 1) {
-            data2[0]=0; /* query serial no */
-            ioctl(handle,QueryInformation,&data2); data2[17]=0;
-            fprintf(outhandle,"# Serial No. %s\n",&data2[2]);
+    if (d) snprintf(name, size, "%.*s%d%s", (int)(d-pattern), pattern, n, d+2);
+    else snprintf(name, size, "%s", pattern);
+}
+
+/* adds all /dev/Spectrometer* devices to the device list */
+int discover_devices(void) {
+    glob_t g;
+    int i;
+
+    if (glob(DISCOVERY_PATTERN, 0, NULL, &g)) return -1;
+    for (i=0; i<(int)g.gl_pathc && devices<MAX_DEVICES; i++) {
+        snprintf(spectrometer[devices].devicename, FILENAMLEN, "%s",
+                 g.gl_pathv[i]);
+        devices++;
+    }
+    globfree(&g);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int retval;
+    int i;
+    int opt; /* for parsing options */
+    char outfilename[FILENAMLEN] = "-";
+    char socketname[FILENAMLEN] = ""; /* serve spectra there */
+    char capturename[FILENAMLEN] = ""; /* record raw data there */
+    char name[FILENAMLEN+10];
+    struct spectrometer *sp;
+    int perdevicefiles; /* output file name contains %d */
+    float dark[SPECTRUM_PIXELS]; /* or reference */
+
+    /* parsing options */
+    opterr=0; /* be quiet when there are no options */
+    while ((opt=getopt(argc, argv, "V:o:d:i:n:F:cTpS:D:R:C:X:a:e:m:A:P:r:b:")) != EOF) {
+        switch (opt) {
+            case 'V': /* set verbosity level */
+                if (sscanf(optarg,"%d",&verbositylevel)!=1 ) return -emsg(1);
+                break;
+            case 'o': /* set outout file name */
+                if (sscanf(optarg,"%99s",outfilename)!=1 ) return -emsg(2);
+                outfilename[FILENAMLEN-1]=0; /* close string */
+                break;
+            case 'd': /*enter device file name */
+                if (!strcmp(optarg,"auto")) {
+                    if (discover_devices()) return -emsg(16);
+                    break;
+                }
+                if (devices==MAX_DEVICES) return -emsg(15);
+                if (sscanf(optarg,"%99s",spectrometer[devices].devicename)!=1)
+                    return -emsg(3);
+                devices++;
+                break;
+            case 'i': /* set integration time */
+                if (sscanf(optarg,"%d",&integrationtime)!=1 ) return -emsg(4);
+                if (integrationtime<1 || integrationtime >10000)
+                    return -emsg(5); /* out of range */
+                break;
+            case 'n': /* number of spectra */
+                if (sscanf(optarg,"%d",&spectrumcount)!=1 ) return -emsg(9);
+                if (spectrumcount<0) return -emsg(10);
+                break;
+            case 'F': /* output format */
+                if (!strcmp(optarg,"text")) {
+                    outputformat = FORMAT_TEXT;
+                } else if (!strcmp(optarg,"bin")) {
+                    outputformat = FORMAT_BINARY;
+                } else if (!strcmp(optarg,"archive")) {
+                    outputformat = FORMAT_ARCHIVE;
+                } else {
+                    return -emsg(13);
+                }
+                break;
+            case 'c': /* don't trust the calibration cache */
+                refreshcalibration = 1;
+                break;
+            case 'T': /* report phase durations */
+                timingreport = 1;
+                timing_enable();
+                break;
+            case 'p': /* pipelined acquisition */
+                pipelined = 1;
+                break;
+            case 'D': /* decimation for display */
+                if (sscanf(optarg,"%lf:%lf:%d",&decimation_lmin,
+                           &decimation_lmax,&decimation_columns)!=3)
+                    return -emsg(20);
+                decimating = 1;
+                break;
+            case 'a': /* co-adding */
+                if (sscanf(optarg,"%d",&coadd)!=1) return -emsg(30);
+                averaging = 1;
+                break;
+            case 'e': /* exponential running average */
+                if (sscanf(optarg,"%d",&i)!=1) return -emsg(30);
+                for (emashift=0; emashift<=MAX_EMA_SHIFT && 1<<emashift!=i;
+                     emashift++);
+                if (!emashift || emashift>MAX_EMA_SHIFT) return -emsg(31);
+                averaging = 1;
+                break;
+            case 'm': /* smoothing */
+                if (sscanf(optarg,"boxcar:%d",&smoothingwidth)==1) {
+                    smoothing = SMOOTH_BOXCAR;
+                } else if (sscanf(optarg,"savgol:%d",&smoothingwidth)==1) {
+                    smoothing = SMOOTH_SAVGOL;
+                } else {
+                    return -emsg(30);
+                }
+                averaging = 1;
+                break;
+            case 'A': /* automatic exposure */
+                i = sscanf(optarg,"%lf:%d",&exposuretarget,&exposuremax);
+                if (i<1 || exposuretarget<=0 || exposuretarget>=1 ||
+                    exposuremax<1 || exposuremax>10000) return -emsg(32);
+                autoexposure = 1;
+                break;
+            case 'P': /* peak finding */
+                if (sscanf(optarg,"%d",&peakthreshold)!=1 ||
+                    peakthreshold<1) return -emsg(34);
+                peakfinding = 1;
+                break;
+            case 'r': /* wavelength window */
+                if (regions==MAX_REGIONS ||
+                    sscanf(optarg,"%lf:%lf",&regionlo[regions],
+                           &regionhi[regions])!=2 ||
+                    regionlo[regions]>regionhi[regions]) return -emsg(36);
+                for (i=0; i<regions; i++) /* windows must not overlap */
+                    if (regionlo[regions]<=regionhi[i] &&
+                        regionhi[regions]>=regionlo[i]) return -emsg(36);
+                regions++;
+                selecting = 1;
+                break;
+            case 'b': /* pixel binning */
+                if (sscanf(optarg,"%d",&binning)!=1 || binning<1 ||
+                    binning>SPECTRUM_PIXELS) return -emsg(37);
+                selecting = 1;
+                break;
+            case 'S': /* server mode */
+                if (sscanf(optarg,"%99s",socketname)!=1 ) return -emsg(18);
+                break;
+            case 'R': /* raw capture */
+                if (sscanf(optarg,"%99s",capturename)!=1 ) return -emsg(2);
+                break;
+            case 'C': /* take a dark or reference frame */
+                if (strcmp(optarg,"dark") && strcmp(optarg,"reference"))
+                    return -emsg(25);
+                framekind = optarg;
+                break;
+            case 'X': /* dark and reference correction */
+                if (!strcmp(optarg,"dark")) {
+                    correctionmode = CORRECT_DARK;
+                } else if (!strcmp(optarg,"transmittance")) {
+                    correctionmode = CORRECT_TRANSMITTANCE;
+                } else if (!strcmp(optarg,"absorbance")) {
+                    correctionmode = CORRECT_ABSORBANCE;
+                } else {
+                    return -emsg(26);
+                }
+                break;
         }
-        if (verbositylevel & 2 ) {
-            tme=time(NULL);
-            strftime(data,30,"%a %d %b %y %X %Z",localtime(&tme));
-            fprintf(outhandle,"# %s\n",data);
+    }
+    if (coadd<1 || coadd>MAX_COADD) return -emsg(31);
+    acquirecount = spectrumcount*coadd;
+
+    if (!devices) { /* default device */
+        strcpy(spectrometer[0].devicename, DEFAULT_DEVICENAME);
+        devices = 1;
+    }
+
+    /* several devices need several files, or one binary stream */
+    perdevicefiles = strstr(outfilename,"%d") != NULL;
+    if (devices>1 && !perdevicefiles && outputformat==FORMAT_TEXT &&
+        !socketname[0] && !framekind)
+        return -emsg(17);
+    if (devices>1 && socketname[0]) return -emsg(19);
+    if (decimating && outputformat!=FORMAT_TEXT) return -emsg(22);
+    if (devices>1 && capturename[0] && !strstr(capturename,"%d"))
+        return -emsg(23);
+    if (autoexposure && (outputformat!=FORMAT_TEXT || framekind ||
+                         correctionmode!=CORRECT_NONE || socketname[0]))
+        return -emsg(33);
+    if (peakfinding && (outputformat!=FORMAT_TEXT || decimating ||
+                        correctionmode!=CORRECT_NONE)) return -emsg(35);
+    if (selecting && (outputformat!=FORMAT_TEXT || decimating || peakfinding ||
+                      correctionmode!=CORRECT_NONE)) return -emsg(38);
+    if (correctionmode!=CORRECT_NONE && !framekind &&
+        (outputformat!=FORMAT_TEXT || decimating)) return -emsg(28);
+
+    for (i=0; i<devices; i++) {
+        sp = &spectrometer[i];
+        sp->index = i;
+
+        /* open target file; taking a frame writes nothing, so an existing
+           file must not be truncated */
+        if (framekind) {
+            sp->outhandle = stdout;
+        } else if (perdevicefiles) {
+            device_filename(name, sizeof(name), outfilename, i);
+            sp->outhandle = fopen(name,"w+");
+            if (!sp->outhandle) return -emsg(7);
+        } else if (i) {
+            sp->outhandle = spectrometer[0].outhandle;
+            sp->sharedoutput = spectrometer[0].sharedoutput = 1;
+        } else if (strcmp(outfilename,"-")) {
+            sp->outhandle = fopen(outfilename,"w+");
+            if (!sp->outhandle) return -emsg(7);
+        } else {
+            sp->outhandle=stdout;
         }
-        if (verbositylevel & 4) {
-            fprintf(outhandle,"# Integration time: %d ms\n",integrationtime);
+
+        retval = setup_device(sp);
+        if (retval) return -emsg(retval);
+
+        /* capture file, starting with what we know about the device */
+        sp->capturefd = -1;
+        if (capturename[0]) {
+            device_filename(name, sizeof(name), capturename, i);
+            sp->capturefd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+            if (sp->capturefd == -1) {
+                perror(name);
+                return -emsg(7);
+            }
+            if (write_capture_header(sp->capturefd, sp->deviceID, sp->serial,
+                                     sp->lam_coeff, integrationtime)) {
+                perror("spectroread");
+                return -emsg(24);
+            }
         }
-        if (verbositylevel & 16) {
-            fprintf(outhandle,
-                    "# Black level from blocked pixels (%d to %d): %8.2f\n",
-                    BLACKLEVEL_START, BLACKLEVEL_END, baselevel);
+    }
+
+    /* in server mode, the clients get the spectra */
+    if (socketname[0]) {
+        sp = &spectrometer[0];
+        retval = serve_spectra(socketname, sp->dev, sp->deviceID, sp->serial,
+                               sp->lam_coeff, integrationtime);
+        return -emsg(retval);
+    }
+
+    /* binary files start with the headers of all devices they contain */
+    if ((outputformat==FORMAT_BINARY || outputformat==FORMAT_ARCHIVE) &&
+        !framekind) {
+        for (i=0; i<devices; i++) {
+            sp = &spectrometer[i];
+            if ((outputformat==FORMAT_BINARY ?
+                 write_binary_header : write_archive_header)
+                (fileno(sp->outhandle), sp->deviceID, sp->serial,
+                 sp->lam_coeff, integrationtime,
+                 sp->sharedoutput ? i : 0, sp->sharedoutput ? devices : 1)) {
+                perror("spectroread");
+                return -emsg(12);
+            }
         }
-        if (verbositylevel & 32) {
-            fprintf(outhandle, "# wavelength conversion coefficients, lam = sum_i c_i index**i\n");
-            for (i=0;i<4;i++ ) fprintf(outhandle, "#  c%1d = %lf\n",
-                                       i, lam_coeff[i]);
+    }
+
+    /* acquisition; one thread per device if there are several */
+    if (devices==1) {
+        retval = run_device(&spectrometer[0]);
+        if (retval) return -emsg(retval);
+    } else {
+        for (i=0; i<devices; i++)
+            if (pthread_create(&spectrometer[i].thread, NULL, device_thread,
+                               &spectrometer[i])) return -emsg(14);
+        retval = 0;
+        for (i=0; i<devices; i++) {
+            pthread_join(spectrometer[i].thread, NULL);
+            if (spectrometer[i].error) {
+                fprintf(stderr, "%s: ", spectrometer[i].devicename);
+                retval = emsg(spectrometer[i].error);
+            }
         }
-        if (verbositylevel & 64) {
-            fprintf(outhandle, "# USB device ID: 0x%x\n",deviceID);
+        if (retval) return -retval;
+    }
+    timing_cycle();
+    if (timingreport) timing_report(stderr);
+
+    /* the collected spectra make up the frame */
+    for (i=0; i<devices && framekind; i++) {
+        sp = &spectrometer[i];
+        get_average(&sp->average, dark);
+        if (store_frame(framekind, sp->serial, sp->deviceID, integrationtime,
+                        dark, SPECTRUM_PIXELS)) return -emsg(29);
+        fprintf(stderr, "# %s: %s frame of %u spectra stored\n",
+                sp->devicename, framekind, sp->average.count);
+    }
+
+    /* the last chunks of an archive are usually not full */
+    for (i=0; i<devices && outputformat==FORMAT_ARCHIVE && !framekind; i++) {
+        sp = &spectrometer[i];
+        if (archive_flush(&sp->archive, fileno(sp->outhandle))) {
+            perror("spectroread");
+            return -emsg(12);
         }
-       
     }
-    close(handle);
-   
-    /* close target file if necessary */
-    if (strcmp(outfilename,"-")) fclose(outhandle);
+
+    for (i=0; i<devices; i++) {
+        sp = &spectrometer[i];
+        device_close(sp->dev);
+        if (sp->capturefd != -1) close(sp->capturefd);
+        /* close target file if necessary */
+        if (sp->outhandle!=stdout && (!i || !sp->sharedoutput))
+            fclose(sp->outhandle);
+    }
 
     return 0;  
 }
-
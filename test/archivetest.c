@@ -0,0 +1,217 @@
+/* archivetest.c: checks that the archive format of archive.c is lossless,
+   and that damaged chunks are refused.
+
+   usage: archivetest [rounds]
+
+   Chunks of 1, 17 and ARCHIVE_CHUNK_FRAMES frames are written with
+   archive_add_frame() and archive_flush(), read back and decoded with
+   archive_decode_chunk(); every pixel has to come back unchanged. The
+   frames are random, constant 0 or 65535, jump between 0 and 65535 from
+   frame to frame or pixel to pixel, or alternate between 0 and 32768,
+   which needs blocks of the full width of 16 bits. Then every truncation
+   of a chunk has to give -1, and so do a wrong magic, a frame count of 0
+   or above ARCHIVE_CHUNK_FRAMES, a byte count which is one too large or
+   too small, a wrong frame offset and a block width above 16. Random bit
+   flips must not crash the decoder. The program exits with 0 if all
+   checks passed.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../decode.h"
+#include "../archive.h"
+
+#define PATTERNS 7
+#define HEAD(frames) (sizeof(struct archive_chunk_header) + \
+                      (frames)*sizeof(struct archive_frame_index))
+
+static unsigned int seed = 2009;
+static unsigned int xorshift(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint16_t frames[ARCHIVE_CHUNK_FRAMES][SPECTRUM_PIXELS];
+static uint16_t decoded[ARCHIVE_CHUNK_FRAMES*SPECTRUM_PIXELS];
+static unsigned char chunk[ARCHIVE_CHUNK_FRAMES*(ARCHIVE_MAX_FRAME + 16) + 64];
+static unsigned char damaged[sizeof(chunk)];
+
+/* frame f of pattern k */
+static void pattern(uint16_t *values, int k, int f) {
+    int i;
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        switch (k) {
+            case 0: values[i] = 0; break;
+            case 1: values[i] = 0xffff; break;
+            case 2: values[i] = f & 1 ? 0xffff : 0; break;   /* in time */
+            case 3: values[i] = i & 1 ? 0xffff : 0; break;   /* in space */
+            case 4: values[i] = (i+f) & 1 ? 0x8000 : 0; break; /* 16 bits */
+            case 5: values[i] = 1000 + xorshift()%8; break;  /* noise */
+            default: values[i] = xorshift();
+        }
+    }
+}
+
+/* writes a chunk of n frames of pattern k; returns its size or -1 */
+static long write_chunk(int n, int k) {
+    struct archive_writer w;
+    FILE *f;
+    long size;
+    int i, full = 0;
+
+    memset(&w, 0, sizeof(w));
+    if (archive_init(&w, 3)) return -1;
+    for (i=0; i<n; i++) {
+        pattern(frames[i], k, i);
+        full = archive_add_frame(&w, frames[i], 1000000ULL*i, 7+i);
+        if (full != (i == ARCHIVE_CHUNK_FRAMES-1)) {
+            fprintf(stderr, "chunk full after %d frames\n", i+1);
+            return -1;
+        }
+    }
+    f = tmpfile();
+    if (!f || archive_flush(&w, fileno(f))) return -1;
+    size = lseek(fileno(f), 0, SEEK_CUR);
+    rewind(f);
+    if (size <= 0 || size > (long)sizeof(chunk) ||
+        fread(chunk, 1, size, f) != (size_t)size) return -1;
+    fclose(f);
+    free(w.buffer);
+    return size;
+}
+
+/* decodes the chunk and compares all frames */
+static int round_trip(int n, int k, long size) {
+    struct archive_frame_index ix;
+    int i, j;
+
+    if (archive_chunk_size(chunk, size) != size) {
+        fprintf(stderr, "pattern %d, %d frames: wrong chunk size\n", k, n);
+        return -1;
+    }
+    if (archive_decode_chunk(chunk, size, decoded) != n) {
+        fprintf(stderr, "pattern %d, %d frames: not decoded\n", k, n);
+        return -1;
+    }
+    if (k == 4 && chunk[HEAD(n)] != 16) {
+        fprintf(stderr, "jumps of 0x8000 coded with %d bits\n",
+                chunk[HEAD(n)]);
+        return -1;
+    }
+    for (i=0; i<n; i++) {
+        memcpy(&ix, chunk + sizeof(struct archive_chunk_header) +
+               i*sizeof(ix), sizeof(ix));
+        if (le64toh(ix.timestamp) != 1000000ULL*i ||
+            le32toh(ix.sequence) != (uint32_t)(7+i)) {
+            fprintf(stderr, "pattern %d: index of frame %d\n", k, i);
+            return -1;
+        }
+        for (j=0; j<SPECTRUM_PIXELS; j++) {
+            if (decoded[i*SPECTRUM_PIXELS+j] == frames[i][j]) continue;
+            fprintf(stderr, "pattern %d, frame %d of %d: pixel %d is %u, "
+                    "not %u\n", k, i, n, j, decoded[i*SPECTRUM_PIXELS+j],
+                    frames[i][j]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* decodes a modified copy of the chunk, which has to be refused */
+static int refused(long size, char *what) {
+    if (archive_decode_chunk(damaged, size, decoded) == -1) return 0;
+    fprintf(stderr, "damaged chunk accepted: %s\n", what);
+    return -1;
+}
+
+static int damage(int n, long size) {
+    struct archive_chunk_header *h = (struct archive_chunk_header *)damaged;
+    struct archive_frame_index *ix =
+        (struct archive_frame_index *)(damaged + sizeof(*h));
+    unsigned char *coded = damaged + HEAD(n);
+    long len, i;
+    int r;
+
+    for (len=0; len<size; len++) {
+        memcpy(damaged, chunk, len);
+        if (refused(len, "truncated")) return -1;
+    }
+
+    /* one more byte follows the damaged chunk, as the next chunk would */
+#define DAMAGE(change, what) do {                                   \
+        memcpy(damaged, chunk, size);                               \
+        damaged[size] = 0;                                          \
+        change;                                                     \
+        if (refused(size+1, what)) return -1;                       \
+    } while (0)
+    DAMAGE(h->magic[0] ^= 1, "magic");
+    DAMAGE(h->frames = 0, "no frames");
+    DAMAGE(h->frames = htole16(ARCHIVE_CHUNK_FRAMES+1), "too many frames");
+    DAMAGE(h->bytes = htole32(le32toh(h->bytes)+1), "one byte more");
+    DAMAGE(h->bytes = htole32(le32toh(h->bytes)-1), "one byte less");
+    DAMAGE(coded[0] = 17, "block width 17");
+    DAMAGE(coded[0] = 0xff, "block width 255");
+    if (n > 1) DAMAGE(ix[n-1].offset = htole32(le32toh(ix[n-1].offset)+1),
+                      "frame offset");
+
+    /* anything may come out, but the decoder must stay in bounds */
+    for (i=0; i<200; i++) {
+        memcpy(damaged, chunk, size);
+        damaged[xorshift() % size] ^= 1 << (xorshift() % 8);
+        r = archive_decode_chunk(damaged, size, decoded);
+        if (r != -1 && r != n) {
+            fprintf(stderr, "byte flip gave %d frames\n", r);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int counts[] = {1, 17, ARCHIVE_CHUNK_FRAMES};
+    long size;
+    int c, k, r, rounds, chunks = 0;
+
+    rounds = argc > 1 ? atoi(argv[1]) : 3;
+    for (r=0; r<rounds; r++) {
+        for (k=0; k<PATTERNS; k++) {
+            for (c=0; c<3; c++) {
+                size = write_chunk(counts[c], k);
+                if (size < 0) {
+                    perror("archivetest");
+                    return 1;
+                }
+                if (round_trip(counts[c], k, size) ||
+                    damage(counts[c], size)) return 1;
+                chunks++;
+            }
+        }
+    }
+    printf("archivetest: %d chunks decoded exactly, damaged ones refused\n",
+           chunks);
+    return 0;
+}
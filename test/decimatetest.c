@@ -0,0 +1,162 @@
+/* decimatetest.c: checks that the SSE4.1 version of decimate_minmax() in
+   decimate.c gives exactly the same envelope as the plain C version.
+
+   usage: decimatetest [rounds]
+
+   Both versions decimate the same spectra into the same columns. The
+   columns come from prepare_decimation() for random windows of the
+   wavelength table of a USB2000, with 1 to 2048 columns; windows with
+   more columns than pixels have columns narrower than a pixel, and
+   windows which reach beyond the spectrum end in its last pixels. Then
+   columns of every width from 1 to 40 pixels are placed at random, and
+   columns which end in the last 8 pixels of the spectrum, where the loads
+   of the SSE4.1 version reach into its padding. The spectra are random,
+   with pixels of 0 and 0xffff, or constant. The SSE4.1 version is skipped
+   if the CPU does not have it. The program exits with 0 if both versions
+   agree.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../decimate.h"
+
+#define MAX_WIDTH 40      /* widest column placed by hand */
+
+static unsigned int seed = 1998;
+static unsigned int xorshift(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* a number between 0 and 1 */
+static double uniform(void) {
+    return (xorshift() & 0xffffff) / (double)0x1000000;
+}
+
+/* spectrum of pattern k: random with extreme pixels, or constant */
+static void spectrum(uint16_t *values, int k) {
+    int i;
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        switch (k % 4) {
+            case 0: values[i] = 0; break;
+            case 1: values[i] = 0xffff; break;
+            case 2: values[i] = xorshift(); break;
+            default:
+                switch (xorshift() % 4) {
+                    case 0: values[i] = 0; break;
+                    case 1: values[i] = 0xffff; break;
+                    default: values[i] = xorshift();
+                }
+        }
+    }
+}
+
+/* decimates the spectrum with both versions; returns the number of
+   columns which differ */
+static int compare(struct decimation *d, uint16_t *values, char *what) {
+    static uint16_t min[2][SPECTRUM_PIXELS], max[2][SPECTRUM_PIXELS];
+    int c, errors = 0;
+
+    decimate_minmax_scalar(d, values, min[0], max[0]);
+    decimate_minmax_sse41(d, values, min[1], max[1]);
+    for (c=0; c<d->columns; c++) {
+        if (min[0][c] == min[1][c] && max[0][c] == max[1][c]) continue;
+        if (!errors)
+            fprintf(stderr, "%s: column %d of pixels %d..%d is %u..%u, not "
+                    "%u..%u\n", what, c, d->first[c],
+                    d->first[c]+d->count[c]-1, min[1][c], max[1][c],
+                    min[0][c], max[0][c]);
+        errors++;
+    }
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    static struct decimation d;
+    double wavelength[SPECTRUM_PIXELS];
+    uint16_t values[SPECTRUM_PIXELS];
+    double lmin, lmax;
+    int rounds, r, i, c, columns, errors = 0, cases = 0;
+
+    rounds = argc > 1 ? atoi(argv[1]) : 200;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse4.1")) {
+        printf("decimatetest: no SSE4.1, nothing to compare\n");
+        return 0;
+    }
+
+    /* a USB2000, from about 339 to 1000 nm */
+    for (i=0; i<SPECTRUM_PIXELS; i++)
+        wavelength[i] = 339.1 + i*(0.3726 + i*(-1.6e-5 - i*1.2e-9));
+
+    /* random windows, some reaching beyond the spectrum */
+    for (r=0; r<rounds && !errors; r++) {
+        lmin = 250.0 + 800.0*uniform();
+        lmax = lmin + (r % 2 ? 800.0 : 20.0)*uniform() + 0.01;
+        columns = r % 3 ? 1 + xorshift() % SPECTRUM_PIXELS
+                        : 1 + xorshift() % 200;
+        if (prepare_decimation(&d, wavelength, lmin, lmax, columns))
+            continue;
+        spectrum(values, r);
+        errors += compare(&d, values, "window");
+        cases++;
+    }
+
+    /* columns of every width at random places */
+    for (r=0; r<rounds && !errors; r++) {
+        d.columns = MAX_WIDTH;
+        for (c=0; c<MAX_WIDTH; c++) {
+            d.count[c] = c+1;
+            d.first[c] = xorshift() % (SPECTRUM_PIXELS-c);
+        }
+        spectrum(values, r);
+        errors += compare(&d, values, "width");
+        cases++;
+    }
+
+    /* columns which end in the padding tail */
+    for (r=0; r<rounds/10+1 && !errors; r++) {
+        d.columns = 0;
+        for (i=SPECTRUM_PIXELS-MAX_WIDTH; i<SPECTRUM_PIXELS; i++) {
+            for (c=SPECTRUM_PIXELS-8; c<SPECTRUM_PIXELS; c++) {
+                if (c < i) continue;
+                d.first[d.columns] = i;
+                d.count[d.columns] = c-i+1;
+                d.columns++;
+            }
+        }
+        spectrum(values, r);
+        errors += compare(&d, values, "tail");
+        cases++;
+    }
+
+    printf("decimatetest: %d cases, %d differences\n", cases, errors);
+#else
+    printf("decimatetest: no SIMD version, nothing to compare\n");
+#endif
+    return errors ? 1 : 0;
+}
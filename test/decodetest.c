@@ -0,0 +1,175 @@
+/* decodetest.c: checks that the SSE2 and AVX2 decoders of decode.c give
+   exactly the same pixel values as the plain C versions.
+
+   usage: decodetest [rounds]
+
+   Every version decodes the same raw spectra: random ones, all bytes 0x00
+   or 0xff (pixels of 0xffff), alternating bytes, and a counting pattern.
+   The raw data is placed 0 to 31 bytes before an inaccessible page, which
+   gives all alignments of the input; with 0 bytes, reading beyond the
+   odd 4097 bytes crashes the test. The output goes to all even offsets
+   from 0 to 30 bytes, with guard bytes around it which catch stores beyond
+   the 2048 pixels. The AVX2 versions are skipped if the CPU does not have
+   AVX2. The program exits with 0 if all versions agree.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../decode.h"
+
+#define GUARD 64          /* bytes checked on both sides of the output */
+#define MAX_OFFSET 32     /* offsets tried for input and output */
+#define GUARD_BYTE 0xa5
+
+typedef void (*decoder)(unsigned char *, uint16_t *);
+
+/* the versions under test, for both devices */
+struct version {
+    char *name;
+    decoder usb2000, usb2000p;
+    int avx2;
+} versions[] = {
+    {"dispatch", generate_numbers_USB2000, generate_numbers_USB2000p, 0},
+#ifdef HAVE_X86_SIMD
+    {"sse2", generate_numbers_USB2000_sse2, generate_numbers_USB2000p_sse2, 0},
+    {"avx2", generate_numbers_USB2000_avx2, generate_numbers_USB2000p_avx2, 1},
+#endif
+};
+#define VERSIONS (int)(sizeof(versions)/sizeof(versions[0]))
+
+static unsigned int seed = 12345;
+static unsigned int xorshift(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* fills the raw spectrum with test pattern k; returns 0 if there is none */
+static int pattern(unsigned char *data, int k, int rounds) {
+    int i;
+
+    for (i=0; i<SPECTRUM_BYTES; i++) {
+        switch (k) {
+            case 0: data[i] = 0x00; break;
+            case 1: data[i] = 0xff; break;
+            case 2: data[i] = i & 1 ? 0xff : 0x00; break;
+            case 3: data[i] = i & 1 ? 0x00 : 0xff; break;
+            case 4: data[i] = i; break;
+            default:
+                if (k >= 5+rounds) return 0;
+                data[i] = xorshift();
+        }
+    }
+    return 1;
+}
+
+/* decodes data with one version at all output offsets and compares the
+   result with the reference; returns the number of differences */
+static int compare(char *name, decoder d, unsigned char *data,
+                   uint16_t *reference, unsigned char *out, int k) {
+    uint16_t *values;
+    int o, i, errors = 0;
+
+    for (o=0; o<MAX_OFFSET; o+=2) {
+        memset(out, GUARD_BYTE, 2*GUARD + MAX_OFFSET + 2*SPECTRUM_PIXELS);
+        values = (uint16_t *)(out + GUARD + o);
+        d(data, values);
+        for (i=0; i<SPECTRUM_PIXELS; i++) {
+            if (values[i] == reference[i]) continue;
+            if (!errors)
+                fprintf(stderr, "%s, pattern %d, data offset %d, output "
+                        "offset %d: pixel %d is 0x%04x, not 0x%04x\n", name,
+                        k, (int)((unsigned long)data % MAX_OFFSET), o, i,
+                        values[i], reference[i]);
+            errors++;
+        }
+        for (i=0; i<GUARD+o; i++)
+            if (out[i] != GUARD_BYTE) errors++;
+        for (i=GUARD+o+2*SPECTRUM_PIXELS;
+             i<2*GUARD+MAX_OFFSET+2*SPECTRUM_PIXELS; i++)
+            if (out[i] != GUARD_BYTE) errors++;
+        if (errors) return errors;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned char *pages, *end, *data;
+    unsigned char source[SPECTRUM_BYTES];
+    unsigned char out[2*GUARD + MAX_OFFSET + 2*SPECTRUM_PIXELS];
+    uint16_t reference[2][SPECTRUM_PIXELS];
+    int pagesize = sysconf(_SC_PAGESIZE);
+    int rounds, k, d, v, errors = 0, cases = 0, avx2;
+    decoder dec;
+
+    rounds = argc > 1 ? atoi(argv[1]) : 100;
+
+    /* the input buffer ends where an inaccessible page begins */
+    pages = mmap(NULL, 3*pagesize, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED ||
+        mprotect(pages + 2*pagesize, pagesize, PROT_NONE)) {
+        perror("decodetest");
+        return 1;
+    }
+    end = pages + 2*pagesize;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+#else
+    avx2 = 0;
+#endif
+
+    for (k=0; pattern(source, k, rounds); k++) {
+        /* reference values from the plain C versions */
+        generate_numbers_USB2000_scalar(source, reference[0]);
+        generate_numbers_USB2000p_scalar(source, reference[1]);
+
+        for (d=0; d<MAX_OFFSET; d++) {
+            /* d bytes between the data and the inaccessible page */
+            data = end - SPECTRUM_BYTES - d;
+            memcpy(data, source, SPECTRUM_BYTES);
+            for (v=0; v<VERSIONS; v++) {
+                if (versions[v].avx2 && !avx2) continue;
+                dec = versions[v].usb2000;
+                errors += compare(versions[v].name, dec, data, reference[0],
+                                  out, k);
+                dec = versions[v].usb2000p;
+                errors += compare(versions[v].name, dec, data, reference[1],
+                                  out, k);
+                cases += 2;
+                if (errors) goto out; /* one report is enough */
+            }
+        }
+    }
+
+ out:
+    printf("decodetest: %d cases,", cases);
+    if (VERSIONS == 1) printf(" no SIMD versions,");
+    if (VERSIONS > 1 && !avx2) printf(" no AVX2,");
+    printf(" %d differences\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/* outputtest.c: checks that the prepared text formatter of output.c writes
+   exactly what fprintf(..."%d %7.2f %d %d\n"...) wrote for every pixel.
+
+   usage: outputtest [spectra]
+
+   Both versions write the same spectra to a file each, as spectroread does
+   with -n: the header comment, the lines of the spectrum, and the frame
+   delimiter. The new version writes the lines with one write() between the
+   stdio output, like output_spectrum() in spectroread.c. The files are
+   then compared byte by byte. The spectra are random, with pixels of 0 and
+   0xffff and offsets which make the corrected values negative. This is
+   done for the whole spectrum with several calibrations, including odd
+   wavelengths which round at the second decimal or have a sign, and for
+   bins of pixels as with -b and -r. The program exits with 0 if all files
+   are identical.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../decode.h"
+#include "../output.h"
+#include "../region.h"
+
+#define HEADER "# output of the ocean optics spectrometer.\n"
+
+static unsigned int seed = 4711;
+static unsigned int xorshift(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* random pixel values, with some at the ends of the range */
+static void random_spectrum(uint16_t *values) {
+    int i;
+
+    for (i=0; i<SPECTRUM_PIXELS; i++) {
+        switch (xorshift() % 8) {
+            case 0: values[i] = 0; break;
+            case 1: values[i] = 0xffff; break;
+            case 2: values[i] = xorshift() % 16; break;
+            default: values[i] = xorshift();
+        }
+    }
+}
+
+/* the offsets of the spectra; large ones make the corrected values
+   negative */
+static int random_offset(void) {
+    static const int offsets[] = {0, 1, 1500, 65535, 70000};
+    return offsets[xorshift() % 5];
+}
+
+/* wavelengths of calibration k; returns 0 if there is none */
+static int calibration(double *wavelength, int k) {
+    static const double coeff[][4] = {
+        {339.1, 0.3726, -1.6e-5, -1.2e-9},  /* a USB2000 */
+        {177.3, 0.4515, -2.1e-5, 3.3e-10},  /* a USB2000+ */
+        {0.0, 1.0, 0.0, 0.0},               /* pixel index */
+        {-1.0, 0.000995, 0.0, 0.0},         /* through zero */
+        {1e6, 1e3, 1.0, 0.0},               /* wider than the field */
+    };
+    int i;
+
+    if (k < (int)(sizeof(coeff)/sizeof(coeff[0]))) {
+        for (i=0; i<SPECTRUM_PIXELS; i++)
+            wavelength[i] = coeff[k][0] + i*(coeff[k][1] +
+                                             i*(coeff[k][2] + i*coeff[k][3]));
+    } else if (k == sizeof(coeff)/sizeof(coeff[0])) {
+        /* halves at the second decimal, and values around 0 */
+        for (i=0; i<SPECTRUM_PIXELS; i++)
+            wavelength[i] = (i%2 ? 0.005 : -0.005) + (i/2 - 512)*0.01;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* compares two files; returns 0 if they are identical */
+static int compare_files(FILE *a, FILE *b, char *what) {
+    long la, lb;
+    char *da, *db;
+    int err;
+
+    fflush(a); fflush(b);
+    la = ftell(a); lb = ftell(b);
+    da = malloc(la+1); db = malloc(lb+1);
+    rewind(a); rewind(b);
+    if (!da || !db || fread(da, 1, la, a) != (size_t)la ||
+        fread(db, 1, lb, b) != (size_t)lb) {
+        perror("outputtest");
+        return -1;
+    }
+    err = la != lb || memcmp(da, db, la);
+    if (err) {
+        for (la=0; la<lb && da[la]==db[la]; la++);
+        fprintf(stderr, "%s: files differ at byte %ld\n", what, la);
+    }
+    free(da); free(db);
+    return err;
+}
+
+/* the whole spectrum, with wavelengths of calibration k */
+static int test_spectra(int k, int spectra) {
+    double wavelength[SPECTRUM_PIXELS];
+    uint16_t values[SPECTRUM_PIXELS];
+    struct textformat tf;
+    FILE *old, *new;
+    char *text, what[40];
+    int n, i, offset, len, err;
+
+    if (!calibration(wavelength, k)) return 1;
+    memset(&tf, 0, sizeof(tf));
+    old = tmpfile(); new = tmpfile();
+    if (!old || !new || prepare_text_format(&tf, wavelength, SPECTRUM_PIXELS))
+        return -1;
+
+    for (n=0; n<spectra; n++) {
+        random_spectrum(values);
+        offset = random_offset();
+
+        fprintf(old, HEADER);
+        for (i=0; i<SPECTRUM_PIXELS; i++)
+            fprintf(old, "%d %7.2f %d %d\n",
+                    i, wavelength[i], values[i], values[i]-offset);
+        fprintf(old, "# end of spectrum %d\n\n\n", n);
+
+        fprintf(new, HEADER);
+        len = format_spectrum_text(&tf, values, offset, &text);
+        fflush(new);
+        if (write_all(fileno(new), text, len)) return -1;
+        fseek(new, 0, SEEK_END);
+        fprintf(new, "# end of spectrum %d\n\n\n", n);
+    }
+    snprintf(what, sizeof(what), "calibration %d", k);
+    err = compare_files(old, new, what);
+    fclose(old); fclose(new);
+    return err ? -1 : 0;
+}
+
+/* bins of binning pixels in the windows lo..hi */
+static int test_bins(double *lo, double *hi, int regions, int binning,
+                     int spectra) {
+    static struct selection s;
+    double wavelength[SPECTRUM_PIXELS];
+    uint16_t values[SPECTRUM_PIXELS];
+    int32_t sums[SPECTRUM_PIXELS];
+    struct textformat tf;
+    FILE *old, *new;
+    char *text, what[40];
+    int n, l, offset, len, err;
+
+    calibration(wavelength, 0);
+    memset(&tf, 0, sizeof(tf));
+    old = tmpfile(); new = tmpfile();
+    if (!old || !new ||
+        prepare_selection(&s, wavelength, lo, hi, regions, binning) ||
+        prepare_indexed_text_format(&tf, s.first, s.lambda, s.lines))
+        return -1;
+
+    for (n=0; n<spectra; n++) {
+        random_spectrum(values);
+        offset = random_offset();
+        sum_selection(&s, values, sums);
+
+        fprintf(old, HEADER);
+        for (l=0; l<s.lines; l++)
+            fprintf(old, "%d %7.2f %d %d\n", s.first[l], s.lambda[l],
+                    sums[l], sums[l]-binning*offset);
+        fprintf(old, "# end of spectrum %d\n\n\n", n);
+
+        fprintf(new, HEADER);
+        len = format_sums_text(&tf, sums, binning, offset, &text);
+        fflush(new);
+        if (write_all(fileno(new), text, len)) return -1;
+        fseek(new, 0, SEEK_END);
+        fprintf(new, "# end of spectrum %d\n\n\n", n);
+    }
+    snprintf(what, sizeof(what), "%d windows, binning %d", regions, binning);
+    err = compare_files(old, new, what);
+    fclose(old); fclose(new);
+    return err ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    double lo[2] = {400.0, 700.5}, hi[2] = {450.25, 900.0};
+    int spectra, k, err = 0, tests = 0;
+
+    spectra = argc > 1 ? atoi(argv[1]) : 20;
+
+    for (k=0; !(err = test_spectra(k, spectra)); k++) tests++;
+    if (err > 0) err = 0; /* no more calibrations */
+
+    if (!err) err = test_bins(lo, hi, 0, 1, spectra);
+    if (!err) err = test_bins(lo, hi, 0, 7, spectra);
+    if (!err) err = test_bins(lo, hi, 2, 1, spectra);
+    if (!err) err = test_bins(lo, hi, 2, 16, spectra);
+    if (!err) tests += 4;
+
+    printf("outputtest: %d tests of %d spectra, %s\n", tests, spectra,
+           err ? "FAILED" : "identical");
+    return err ? 1 : 0;
+}
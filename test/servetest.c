@@ -0,0 +1,221 @@
+/* servetest.c: talks to spectroread in server mode (-S) with a simulated
+   device, as a client of the protocol in serve.h.
+
+   usage: servetest path/to/spectroread
+
+   The test first puts a regular file where the socket should go; the
+   server must refuse to start and leave the file alone. Then it starts a
+   server on a fresh socket with sim:usb2000p and connects two clients.
+   The first one asks for the calibration and sets the integration time,
+   the second one subscribes to a number of spectra. Each request must be
+   answered with the right message, and the spectra must come as complete
+   records with increasing sequence numbers. The program exits with 0 if
+   all checks passed.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../decode.h"
+#include "../output.h"
+#include "../serve.h"
+
+#define SPECTRA 10
+#define DEVICE "sim:usb2000p,pace=max"
+
+static char socketname[64];
+
+static int fail(char *what) {
+    fprintf(stderr, "servetest: %s\n", what);
+    return -1;
+}
+
+/* starts the server; returns its pid or -1 */
+static pid_t start_server(char *program) {
+    pid_t pid = fork();
+
+    if (!pid) {
+        execl(program, program, "-d", DEVICE, "-S", socketname, (char *)0);
+        perror(program);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* connects to the server, waiting up to 5 s for the socket */
+static int connect_server(void) {
+    struct sockaddr_un addr;
+    int fd, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketname);
+    for (i=0; i<500; i++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) return fd;
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int read_all(int fd, void *buffer, int len) {
+    int n;
+
+    while (len > 0) {
+        n = read(fd, buffer, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buffer = (char *)buffer + n; len -= n;
+    }
+    return 0;
+}
+
+static int request(int fd, int command, int argument) {
+    struct serve_request r;
+
+    r.command = htole32(command);
+    r.argument = htole32(argument);
+    return write(fd, &r, sizeof(r)) == sizeof(r) ? 0 : -1;
+}
+
+/* reads the next message, which has to be of the given type and length;
+   the payload goes to buffer */
+static int expect(int fd, int type, int length, void *buffer) {
+    struct serve_message m;
+
+    if (read_all(fd, &m, sizeof(m))) return fail("connection lost");
+    if (le32toh(m.type) != (uint32_t)type ||
+        le32toh(m.length) != (uint32_t)length) {
+        fprintf(stderr, "servetest: message %u of %u bytes, wanted %d of %d\n",
+                le32toh(m.type), le32toh(m.length), type, length);
+        return -1;
+    }
+    return read_all(fd, buffer, length) ? fail("short message") : 0;
+}
+
+/* the answer to a request without data */
+static int expect_ack(int fd, int command) {
+    struct serve_ack a;
+
+    if (expect(fd, SERVE_ACK, sizeof(a), &a)) return -1;
+    if (le32toh(a.command) != (uint32_t)command || a.status)
+        return fail("request not acknowledged");
+    return 0;
+}
+
+/* a server must not remove a file which is not a socket */
+static int test_no_clobber(char *program) {
+    struct stat st;
+    FILE *f;
+    pid_t pid;
+    int status, i;
+
+    f = fopen(socketname, "w");
+    if (!f) return fail("cannot create the test file");
+    fprintf(f, "keep\n");
+    fclose(f);
+
+    /* it has to give up within 5 s */
+    pid = start_server(program);
+    if (pid < 0) return fail("cannot run the server");
+    for (i=0; i<500 && !waitpid(pid, &status, WNOHANG); i++) usleep(10000);
+    if (i == 500) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+        unlink(socketname);
+        return fail("server started over a regular file");
+    }
+    if (!WIFEXITED(status) || !WEXITSTATUS(status))
+        return fail("server did not report an error");
+    if (lstat(socketname, &st) || !S_ISREG(st.st_mode) || st.st_size != 5)
+        return fail("regular file was removed");
+    unlink(socketname);
+    printf("servetest: regular file left alone\n");
+    return 0;
+}
+
+static int test_clients(void) {
+    struct spectrum_file_header h;
+    struct spectrum_record_header *r;
+    uint64_t record[SPECTRUM_RECORD_SIZE/sizeof(uint64_t)];
+    uint32_t sequence = 0;
+    int a, b, i;
+
+    a = connect_server();
+    b = connect_server();
+    if (a < 0 || b < 0) return fail("cannot connect");
+
+    if (request(a, SERVE_GET_CALIBRATION, 0) ||
+        expect(a, SERVE_CALIBRATION, sizeof(h), &h)) return -1;
+    if (memcmp(h.magic, SPECTRUM_FILE_MAGIC, sizeof(h.magic)) ||
+        le32toh(h.pixels) != SPECTRUM_PIXELS)
+        return fail("bad calibration header");
+    if (request(a, SERVE_SET_INTEGRATIONTIME, 5) ||
+        expect_ack(a, SERVE_SET_INTEGRATIONTIME)) return -1;
+
+    if (request(b, SERVE_SUBSCRIBE, SPECTRA) ||
+        expect_ack(b, SERVE_SUBSCRIBE)) return -1;
+    r = (struct spectrum_record_header *)record;
+    for (i=0; i<SPECTRA; i++) {
+        if (expect(b, SERVE_SPECTRUM, SPECTRUM_RECORD_SIZE, record))
+            return -1;
+        if (i && le32toh(r->sequence) <= sequence)
+            return fail("sequence numbers do not increase");
+        sequence = le32toh(r->sequence);
+    }
+    printf("servetest: calibration, integration time and %d spectra\n",
+           SPECTRA);
+    close(a);
+    close(b);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    pid_t pid;
+    int err;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: servetest path/to/spectroread\n");
+        return 2;
+    }
+    snprintf(socketname, sizeof(socketname), "/tmp/servetest.%d",
+             (int)getpid());
+
+    if (test_no_clobber(argv[1])) return 1;
+
+    pid = start_server(argv[1]);
+    if (pid < 0) return 1;
+    err = test_clients();
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(socketname);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+/* timing.c: phase timing for spectroread.
+
+   Every phase of the acquisition gets timed with the monotonic clock. For
+   phases which happen for every spectrum, the last TIMING_WINDOW durations
+   are kept, so that min, mean and 99th percentile refer to a rolling window
+   in continuous mode. Count and total always cover the whole run.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timing.h"
+
+#define TIMING_WINDOW 1000 /* samples for the rolling statistics */
+
+static char *phasename[T_PHASES] = {
+    "open", "GetDeviceID", "SetIntegrationTime/Initialize",
+    "QueryInformation", "EmptyPipe", "RequestSpectra", "decode", "baseline",
+    "format", "flush", "cycle",
+};
+
+static struct phasestats {
+    long count;
+    double total;                  /* in us, whole run */
+    float window[TIMING_WINDOW];   /* last durations in us */
+} stats[T_PHASES];
+
+static int enabled = 0;
+static __thread double lastlap; /* in us, per thread for pipelined mode */
+static __thread double lastcycle; /* per thread for several devices */
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_us(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1e6 + t.tv_nsec*1e-3;
+}
+
+static void add_sample(int phase, double us) {
+    struct phasestats *p = &stats[phase];
+    pthread_mutex_lock(&statslock);
+    p->window[p->count % TIMING_WINDOW] = us;
+    p->count++;
+    p->total += us;
+    pthread_mutex_unlock(&statslock);
+}
+
+void timing_enable(void) {
+    enabled = 1;
+    memset(stats, 0, sizeof(stats));
+    lastcycle = 0;
+}
+
+void timing_begin(void) {
+    if (enabled) lastlap = now_us();
+}
+
+void timing_lap(int phase) {
+    double t;
+    if (!enabled) return;
+    t = now_us();
+    add_sample(phase, t-lastlap);
+    lastlap = t;
+}
+
+void timing_cycle(void) {
+    double t;
+    if (!enabled) return;
+    t = now_us();
+    if (lastcycle) add_sample(T_CYCLE, t-lastcycle);
+    lastcycle = t;
+}
+
+static int compare_float(const void *a, const void *b) {
+    float x = *(float *)a, y = *(float *)b;
+    return (x>y) - (x<y);
+}
+
+void timing_report(FILE *f) {
+    static float sorted[TIMING_WINDOW];
+    int i, n;
+    double sum;
+
+    if (!enabled) return;
+    pthread_mutex_lock(&statslock);
+    fprintf(f, "# timing in us: phase count total min mean p99 max\n");
+    for (i=0; i<T_PHASES; i++) {
+        if (!stats[i].count) continue;
+        n = stats[i].count < TIMING_WINDOW ? stats[i].count : TIMING_WINDOW;
+        memcpy(sorted, stats[i].window, n*sizeof(float));
+        qsort(sorted, n, sizeof(float), compare_float);
+        for (sum=0; n--; ) sum += sorted[n];
+        n = stats[i].count < TIMING_WINDOW ? stats[i].count : TIMING_WINDOW;
+        fprintf(f, "#  %-30s %6ld %12.1f %10.1f %10.1f %10.1f %10.1f\n",
+                phasename[i], stats[i].count, stats[i].total, sorted[0],
+                sum/n, sorted[(n*99)/100], sorted[n-1]);
+    }
+    pthread_mutex_unlock(&statslock);
+    fflush(f);
+}
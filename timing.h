@@ -0,0 +1,52 @@
+/* timing.h: phase timing for spectroread. Details see timing.c.
+
+ Copyright (C) 2009      Christian Kurtsiefer, National University
+                         of Singapore <christian.kurtsiefer@gmail.com>
+
+ This source code is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Public License as published
+ by the Free Software Foundation; either version 2 of the License,
+ or (at your option) any later version.
+
+ This source code is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ Please refer to the GNU Public License for more details.
+
+ You should have received a copy of the GNU Public License along with
+ this source code; if not, write to:
+ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+
+/* phases which are timed */
+#define T_OPEN 0        /* open() of the device */
+#define T_DEVICEID 1    /* GetDeviceID */
+#define T_INIT 2        /* SetIntegrationTime and InitializeUSB2000 */
+#define T_QUERY 3       /* QueryInformation calls or calibration cache */
+#define T_DRAIN 4       /* one EmptyPipe call when clearing the pipe */
+#define T_REQUEST 5     /* RequestSpectra */
+#define T_DECODE 6
+#define T_BASELINE 7
+#define T_FORMAT 8      /* generating the output text */
+#define T_FLUSH 9       /* writing the spectrum out */
+#define T_CYCLE 10      /* one complete spectrum from request to flush */
+#define T_PHASES 11
+
+/* switches timing on; without this, the calls below do nothing */
+void timing_enable(void);
+
+/* starts the stopwatch */
+void timing_begin(void);
+
+/* attributes the time since the last call of timing_begin or timing_lap to
+   a phase, and restarts the stopwatch */
+void timing_lap(int phase);
+
+/* takes the time of a complete spectrum, from one call to the next */
+void timing_cycle(void);
+
+/* prints count, total, min, mean, 99th percentile and max of every phase
+   which has been timed, as comment lines */
+void timing_report(FILE *f);